@@ -0,0 +1,233 @@
+#include "sim.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Batch mode
+// --------------------------------------------------------------------------
+
+// A manifest lists one program per line, optionally followed by the prefix
+// its state files are written to. The default prefix is the program path
+// without its extension, so test/fib.bin leaves test/fib.reg_state.out and
+// test/fib.mem_state.out next to the .ref files. Blank lines and lines
+// starting with # are skipped.
+
+struct BatchJob {
+    string programFile;
+    string outputPrefix;
+    Simulator *sim = nullptr; // while the job is running
+    bool loaded = false;
+    SimStatus status = SIM_RUNNING;
+    uint64_t instructions = 0;
+};
+
+// Each worker owns a queue of jobs, some not started yet and some part way
+// through. It takes a job from the front, runs it for one slice and, unless
+// it finished, puts it at the back again, so a thread interleaves all the
+// guests in its queue. A worker whose queue is empty steals from the back
+// of the others'. No new jobs appear once the workers start, so a worker
+// that finds every queue empty is done; the others only hold the job they
+// are running.
+struct WorkQueue {
+    mutex lock;
+    deque<BatchJob*> jobs;
+};
+
+struct WorkerStats {
+    uint64_t instructions = 0;
+    double seconds = 0;
+    size_t finished = 0;
+    size_t stolen = 0;
+};
+
+static BatchJob *takeJob(WorkQueue &queue, bool steal) {
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.jobs.empty()) {
+        return nullptr;
+    }
+    BatchJob *job;
+    if (steal) {
+        job = queue.jobs.back();
+        queue.jobs.pop_back();
+    } else {
+        job = queue.jobs.front();
+        queue.jobs.pop_front();
+    }
+    return job;
+}
+
+static void putJob(WorkQueue &queue, BatchJob *job) {
+    lock_guard<mutex> guard(queue.lock);
+    queue.jobs.push_back(job);
+}
+
+static bool startJob(BatchJob &job, SimEngine engine) {
+    job.sim = new Simulator(engine);
+    if (!job.sim->load(job.programFile.c_str())) {
+        fprintf(stderr, "%s: failed to load\n", job.programFile.c_str());
+        delete job.sim;
+        job.sim = nullptr;
+        return false;
+    }
+    job.loaded = true;
+    return true;
+}
+
+static void finishJob(BatchJob &job) {
+    Simulator &sim = *job.sim;
+    job.instructions = sim.stats.instructions;
+
+    switch (job.status) {
+        case SIM_HALT:
+            break;
+        case SIM_ILLEGAL:
+            fprintf(stderr, "%s: illegal instruction encountered at PC: 0x%lx\n",
+                    job.programFile.c_str(), sim.PC);
+            break;
+        case SIM_LOOP:
+            fprintf(stderr, "%s: infinite loop detected at PC: 0x%lx\n",
+                    job.programFile.c_str(), sim.PC);
+            break;
+        default:
+            fprintf(stderr, "%s: instruction limit reached at PC: 0x%lx\n",
+                    job.programFile.c_str(), sim.PC);
+            break;
+    }
+    if (!sim.dump(job.outputPrefix)) {
+        fprintf(stderr, "%s: cannot write %s.*_state.out\n",
+                job.programFile.c_str(), job.outputPrefix.c_str());
+    }
+
+    // a finished guest gives its memory back right away
+    delete job.sim;
+    job.sim = nullptr;
+}
+
+static void batchWorker(vector<WorkQueue> &queues, unsigned self, SimEngine engine,
+                        uint64_t maxInsts, uint64_t sliceInsts, WorkerStats &stats) {
+    auto start = chrono::steady_clock::now();
+    while (true) {
+        BatchJob *job = takeJob(queues[self], false);
+        for (unsigned i = 1; !job && i < queues.size(); i++) {
+            job = takeJob(queues[(self + i) % queues.size()], true);
+            stats.stolen += job != nullptr;
+        }
+        if (!job) {
+            break;
+        }
+        if (!job->sim && !startJob(*job, engine)) {
+            continue;
+        }
+
+        Simulator &sim = *job->sim;
+        uint64_t before = sim.stats.instructions;
+        job->status = sim.run(min(sliceInsts, maxInsts - before));
+        stats.instructions += sim.stats.instructions - before;
+
+        if (job->status == SIM_RUNNING && sim.stats.instructions < maxInsts) {
+            putJob(queues[self], job);
+        } else {
+            finishJob(*job);
+            stats.finished++;
+        }
+    }
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static bool readManifest(const char *manifestFile, vector<BatchJob> &jobs) {
+    ifstream manifest(manifestFile);
+    if (!manifest.is_open()) {
+        fprintf(stderr, "\tError open manifest %s\n", manifestFile);
+        return false;
+    }
+
+    string line;
+    while (getline(manifest, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+
+        BatchJob job;
+        size_t end = line.find_first_of(" \t\r", start);
+        job.programFile = line.substr(start, end - start);
+
+        size_t prefixStart = end == string::npos ? end : line.find_first_not_of(" \t\r", end);
+        if (prefixStart != string::npos) {
+            job.outputPrefix = line.substr(prefixStart, line.find_first_of(" \t\r", prefixStart) - prefixStart);
+        } else {
+            size_t dot = job.programFile.find_last_of('.');
+            size_t slash = job.programFile.find_last_of('/');
+            bool hasExtension = dot != string::npos && (slash == string::npos || dot > slash);
+            job.outputPrefix = hasExtension ? job.programFile.substr(0, dot) : job.programFile;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int runBatch(const char *manifestFile, SimEngine engine, unsigned numThreads, uint64_t maxInsts,
+             uint64_t sliceInsts) {
+    vector<BatchJob> jobs;
+    if (!readManifest(manifestFile, jobs)) {
+        return -1;
+    }
+
+    if (numThreads == 0) {
+        numThreads = max(1U, thread::hardware_concurrency());
+    }
+    numThreads = min<size_t>(numThreads, max<size_t>(jobs.size(), 1));
+
+    // deal the jobs out round robin, stealing evens out the rest
+    vector<WorkQueue> queues(numThreads);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        queues[i % numThreads].jobs.push_back(&jobs[i]);
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<WorkerStats> workerStats(numThreads);
+    vector<thread> workers;
+    for (unsigned i = 0; i < numThreads; i++) {
+        workers.emplace_back(batchWorker, ref(queues), i, engine, maxInsts, max<uint64_t>(sliceInsts, 1),
+                             ref(workerStats[i]));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    size_t outcomes[SIM_LOOP + 1] = {0};
+    uint64_t instructions = 0;
+    for (const BatchJob &job : jobs) {
+        if (job.loaded) {
+            outcomes[job.status]++;
+        } else {
+            failed++;
+        }
+        instructions += job.instructions;
+    }
+    size_t halted = outcomes[SIM_HALT];
+
+    printf("Batch: %zu jobs on %u threads: %zu halted, %zu illegal, %zu looping, "
+           "%zu over the instruction limit, %zu failed to load\n",
+           jobs.size(), numThreads, halted, outcomes[SIM_ILLEGAL], outcomes[SIM_LOOP],
+           outcomes[SIM_RUNNING], failed);
+    printf("Batch: %lu instructions in %.3f s, %.2f MIPS, %.1f jobs/s\n",
+           instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0,
+           seconds > 0 ? jobs.size() / seconds : 0.0);
+    for (unsigned i = 0; i < numThreads; i++) {
+        const WorkerStats &worker = workerStats[i];
+        printf("Batch: worker %u: %lu instructions in %.3f s, %.2f MIPS, %zu jobs finished, %zu stolen\n",
+               i, worker.instructions, worker.seconds,
+               worker.seconds > 0 ? worker.instructions / worker.seconds / 1e6 : 0.0,
+               worker.finished, worker.stolen);
+    }
+
+    return halted == jobs.size() ? 0 : 1;
+}
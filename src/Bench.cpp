@@ -0,0 +1,97 @@
+#include "sim.h"
+
+#include <sys/resource.h>
+#include <x86intrin.h>
+
+#include <algorithm>
+#include <chrono>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Benchmarking
+// --------------------------------------------------------------------------
+
+static const char *const engineNames[] = {"staged", "threaded", "jit"};
+
+// Column names of a results file, in the order appendBenchResult writes them
+#define BENCH_CSV_HEADER "program,engine,instructions,runs,first_s,best_s,median_s,mips,host_cycles_per_inst,peak_rss_kb"
+
+struct BenchRun {
+    double seconds;
+    uint64_t cycles; // time stamp counter ticks
+};
+
+static bool appendBenchResult(const char *resultsFile, const char *programFile, SimEngine engine,
+                              uint64_t instructions, const vector<BenchRun> &runs, const BenchRun &best,
+                              double median, long peakRSS) {
+    FILE *out = fopen(resultsFile, "a");
+    if (!out) {
+        return false;
+    }
+    if (ftell(out) == 0) {
+        fprintf(out, "%s\n", BENCH_CSV_HEADER);
+    }
+    fprintf(out, "%s,%s,%lu,%zu,%.6f,%.6f,%.6f,%.2f,%.2f,%ld\n", programFile, engineNames[engine], instructions,
+            runs.size(), runs[0].seconds, best.seconds, median, instructions / best.seconds / 1e6,
+            (double)best.cycles / instructions, peakRSS);
+    return fclose(out) == 0;
+}
+
+int runBench(const char *programFile, SimEngine engine, unsigned runs, uint64_t maxInsts, const char *resultsFile) {
+    Simulator sim(engine);
+    if (!sim.load(programFile)) {
+        fprintf(stderr, "Failed to initialize memory with program binary.\n");
+        return -1;
+    }
+
+    // every run after the first starts from reset(), which keeps the decoded
+    // blocks and host code, so the first run alone pays for translation
+    vector<BenchRun> times;
+    uint64_t instructions = 0;
+    for (unsigned i = 0; i < runs; i++) {
+        if (i > 0 && !sim.reset()) {
+            fprintf(stderr, "Cannot reset %s\n", programFile);
+            return -1;
+        }
+        auto start = chrono::steady_clock::now();
+        uint64_t startCycles = __rdtsc();
+        SimStatus status = sim.run(maxInsts);
+        uint64_t cycles = __rdtsc() - startCycles;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (status != SIM_HALT) {
+            fprintf(stderr, "%s did not halt normally (at PC: 0x%lx after %lu instructions)\n", programFile,
+                    sim.PC, sim.stats.instructions);
+            return 1;
+        }
+        if (i > 0 && sim.stats.instructions != instructions) {
+            fprintf(stderr, "%s ran %lu instructions, then %lu\n", programFile, instructions,
+                    sim.stats.instructions);
+            return 1;
+        }
+        instructions = sim.stats.instructions;
+        times.push_back({seconds, cycles});
+    }
+
+    vector<BenchRun> sorted = times;
+    sort(sorted.begin(), sorted.end(), [](const BenchRun &a, const BenchRun &b) { return a.seconds < b.seconds; });
+    const BenchRun &best = sorted[0];
+    double median = sorted.size() % 2 ? sorted[sorted.size() / 2].seconds
+                                      : (sorted[sorted.size() / 2 - 1].seconds + sorted[sorted.size() / 2].seconds) / 2;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("Bench: %s on the %s engine: %lu instructions, %u runs\n", programFile, engineNames[engine],
+           instructions, runs);
+    printf("Bench: first %.4f s, best %.4f s, median %.4f s\n", times[0].seconds, best.seconds, median);
+    printf("Bench: %.2f MIPS, %.2f host cycles per instruction, peak RSS %ld KB\n",
+           instructions / best.seconds / 1e6, (double)best.cycles / instructions, usage.ru_maxrss);
+
+    if (resultsFile && !appendBenchResult(resultsFile, programFile, engine, instructions, times, best, median,
+                                          usage.ru_maxrss)) {
+        fprintf(stderr, "Cannot write results %s\n", resultsFile);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include "Cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Cache model
+// --------------------------------------------------------------------------
+
+// Low bits of a tag word; the line number sits above them
+#define LINE_VALID 1
+#define LINE_DIRTY 2
+#define LINE_FLAG_BITS 2
+
+static bool isPowerOfTwo(uint64_t n) {
+    return n && !(n & (n - 1));
+}
+
+static unsigned log2Of(uint64_t n) {
+    return __builtin_ctzll(n);
+}
+
+bool CacheConfig::parse(const string &text) {
+    vector<string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t colon = text.find(':', start);
+        fields.push_back(text.substr(start, colon - start));
+        if (colon == string::npos) {
+            break;
+        }
+        start = colon + 1;
+    }
+    if (fields.size() < 3) {
+        fprintf(stderr, "Bad cache configuration %s: expected SIZE:WAYS:LINE\n", text.c_str());
+        return false;
+    }
+
+    char *end;
+    size = strtoull(fields[0].c_str(), &end, 0);
+    if (*end == 'k' || *end == 'K') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size <<= 20;
+        end++;
+    }
+    bool numbersOk = *end == '\0';
+    ways = strtoul(fields[1].c_str(), &end, 0);
+    numbersOk = numbersOk && *end == '\0';
+    lineSize = strtoul(fields[2].c_str(), &end, 0);
+    numbersOk = numbersOk && *end == '\0';
+
+    for (size_t i = 3; i < fields.size(); i++) {
+        const string &option = fields[i];
+        if (option == "lru") {
+            replacement = REPLACE_LRU;
+        } else if (option == "plru") {
+            replacement = REPLACE_PLRU;
+        } else if (option == "wb" || option == "wt") {
+            writeBack = option == "wb";
+        } else if (option == "wa" || option == "nwa") {
+            writeAllocate = option == "wa";
+        } else {
+            fprintf(stderr, "Bad cache configuration %s: unknown option %s\n", text.c_str(), option.c_str());
+            return false;
+        }
+    }
+
+    const char *problem = nullptr;
+    if (!numbersOk || size == 0 || ways == 0) {
+        problem = "size and ways must be positive numbers";
+    } else if (!isPowerOfTwo(lineSize) || lineSize < 8) {
+        problem = "the line size must be a power of two of at least 8 bytes";
+    } else if (size % ((uint64_t)ways * lineSize) != 0 || !isPowerOfTwo(size / ((uint64_t)ways * lineSize))) {
+        problem = "size / (ways * line size) must be a power of two";
+    } else if (replacement == REPLACE_PLRU && (!isPowerOfTwo(ways) || ways > 64)) {
+        problem = "PLRU needs a power of two of at most 64 ways";
+    }
+    if (problem) {
+        fprintf(stderr, "Bad cache configuration %s: %s\n", text.c_str(), problem);
+        return false;
+    }
+    return true;
+}
+
+string CacheConfig::describe() const {
+    char text[128];
+    if (size % (1 << 20) == 0) {
+        snprintf(text, sizeof(text), "%lu MB", size >> 20);
+    } else if (size % (1 << 10) == 0) {
+        snprintf(text, sizeof(text), "%lu KB", size >> 10);
+    } else {
+        snprintf(text, sizeof(text), "%lu B", size);
+    }
+    string description = text;
+    snprintf(text, sizeof(text), ", %u-way, %u B lines, %s, %s, %s", ways, lineSize,
+             replacement == REPLACE_LRU ? "LRU" : "PLRU", writeBack ? "write-back" : "write-through",
+             writeAllocate ? "write-allocate" : "no-write-allocate");
+    return description + text;
+}
+
+Cache::Cache(const char *name, const CacheConfig &config, Cache *next)
+    : name(name), config(config), lineBits(log2Of(config.lineSize)), next(next),
+      setMask(config.size / ((uint64_t)config.ways * config.lineSize) - 1) {
+    tags.resize((setMask + 1) * config.ways);
+    if (config.replacement == REPLACE_PLRU) {
+        treeBits.resize(setMask + 1);
+    }
+}
+
+bool Cache::lookup(uint64_t address, bool write) {
+    uint64_t line = address >> lineBits;
+    size_t setIndex = line & setMask;
+    uint64_t *set = &tags[setIndex * config.ways];
+    uint64_t wanted = line << LINE_FLAG_BITS | LINE_VALID;
+    if (write) {
+        stats.writes++;
+    } else {
+        stats.reads++;
+    }
+
+    unsigned way = 0;
+    while (way < config.ways && (set[way] & ~(uint64_t)LINE_DIRTY) != wanted) {
+        way++;
+    }
+
+    bool hit = way < config.ways;
+    if (!hit) {
+        if (write) {
+            stats.writeMisses++;
+        } else {
+            stats.readMisses++;
+        }
+        if (write && !config.writeAllocate) {
+            if (next) {
+                next->access(address, true);
+            }
+            lastLine = ~0ULL;
+            return false;
+        }
+        // fill from the next level, then make room; with LRU the least
+        // recent way is the last, and invalid ways collect there too
+        if (next) {
+            next->access(address, false);
+        }
+        way = config.replacement == REPLACE_LRU ? config.ways - 1 : victimPLRU(setIndex);
+        evict(set[way]);
+        set[way] = wanted;
+    }
+
+    if (write) {
+        if (config.writeBack) {
+            set[way] |= LINE_DIRTY;
+        } else if (next) {
+            next->access(address, true);
+        }
+    }
+
+    lastLine = line;
+    lastDirty = set[way] & LINE_DIRTY;
+    if (config.replacement == REPLACE_LRU) {
+        uint64_t entry = set[way];
+        memmove(set + 1, set, way * sizeof(*set));
+        set[0] = entry;
+    } else {
+        touchPLRU(setIndex, way);
+    }
+    return hit;
+}
+
+void Cache::evict(uint64_t entry) {
+    if (!(entry & LINE_VALID)) {
+        return;
+    }
+    stats.evictions++;
+    if (entry & LINE_DIRTY) {
+        stats.writebacks++;
+        if (next) {
+            next->access(entry >> LINE_FLAG_BITS << lineBits, true);
+        }
+    }
+}
+
+// The tree of a set has ways - 1 inner nodes, numbered from 1 at the root
+// with node n's children at 2n and 2n + 1. A node's bit says which half to
+// replace from next: 0 the lower ways, 1 the upper ones. Touching a way
+// points every node on its path at the other half.
+void Cache::touchPLRU(size_t setIndex, unsigned way) {
+    uint64_t &bits = treeBits[setIndex];
+    unsigned node = 1;
+    for (int level = (int)log2Of(config.ways) - 1; level >= 0; level--) {
+        unsigned upper = (way >> level) & 1;
+        if (upper) {
+            bits &= ~(1ULL << node);
+        } else {
+            bits |= 1ULL << node;
+        }
+        node = node * 2 + upper;
+    }
+}
+
+unsigned Cache::victimPLRU(size_t setIndex) const {
+    // lines are never invalidated, so a set fills from way 0 up
+    const uint64_t *set = &tags[setIndex * config.ways];
+    if (!(set[config.ways - 1] & LINE_VALID)) {
+        unsigned way = 0;
+        while (set[way] & LINE_VALID) {
+            way++;
+        }
+        return way;
+    }
+    uint64_t bits = treeBits[setIndex];
+    unsigned node = 1;
+    while (node < config.ways) {
+        node = node * 2 + ((bits >> node) & 1);
+    }
+    return node - config.ways;
+}
+
+bool CacheHierarchy::configure(const char *spec) {
+    string levels = strcmp(spec, "default") == 0 ? CACHE_DEFAULT : spec;
+    CacheConfig configs[3];
+    bool present[3] = {false, false, false};
+    static const char *const levelNames[3] = {"l1i", "l1d", "l2"};
+
+    size_t start = 0;
+    while (start <= levels.size()) {
+        size_t comma = levels.find(',', start);
+        string level = levels.substr(start, comma - start);
+        start = comma == string::npos ? levels.size() + 1 : comma + 1;
+
+        size_t colon = level.find(':');
+        int index = -1;
+        for (int i = 0; i < 3; i++) {
+            if (level.compare(0, colon, levelNames[i]) == 0) {
+                index = i;
+            }
+        }
+        if (index < 0 || colon == string::npos) {
+            fprintf(stderr, "Bad cache level %s: expected l1i, l1d or l2 and SIZE:WAYS:LINE\n", level.c_str());
+            return false;
+        }
+        if (present[index]) {
+            fprintf(stderr, "Cache level %s given twice\n", levelNames[index]);
+            return false;
+        }
+        if (!configs[index].parse(level.substr(colon + 1))) {
+            return false;
+        }
+        present[index] = true;
+    }
+
+    if (present[2]) {
+        l2.reset(new Cache("L2", configs[2], nullptr));
+    }
+    if (present[0]) {
+        l1i.reset(new Cache("L1I", configs[0], l2.get()));
+    }
+    if (present[1]) {
+        l1d.reset(new Cache("L1D", configs[1], l2.get()));
+    }
+    fetchCache = l1i ? l1i.get() : l2.get();
+    dataCache = l1d ? l1d.get() : l2.get();
+    return true;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+void CacheHierarchy::print(FILE *out) const {
+    for (const Cache *cache : {l1i.get(), l1d.get(), l2.get()}) {
+        if (!cache) {
+            continue;
+        }
+        const CacheStats &stats = cache->stats;
+        uint64_t accesses = stats.reads + stats.writes;
+        uint64_t misses = stats.readMisses + stats.writeMisses;
+        fprintf(out, "Cache: %-3s %s\n", cache->name, cache->config.describe().c_str());
+        fprintf(out, "Cache: %-3s %lu accesses, %lu hits, %lu misses (%.2f%%), %lu evictions, %lu writebacks\n",
+                cache->name, accesses, accesses - misses, misses, percent(misses, accesses), stats.evictions,
+                stats.writebacks);
+        if (stats.writes) {
+            fprintf(out, "Cache: %-3s %lu reads, %lu misses (%.2f%%); %lu writes, %lu misses (%.2f%%)\n",
+                    cache->name, stats.reads, stats.readMisses, percent(stats.readMisses, stats.reads),
+                    stats.writes, stats.writeMisses, percent(stats.writeMisses, stats.writes));
+        }
+    }
+}
+
+AddressStream::AddressStream(unsigned readers) : positions(readers) {
+    current = make_shared<vector<uint64_t>>();
+    current->reserve(STREAM_CHUNK_ACCESSES);
+}
+
+void AddressStream::publish(bool wait) {
+    unique_lock<mutex> guard(lock);
+    chunks.push_back(move(current));
+    changed.notify_all();
+    if (wait) {
+        changed.wait(guard, [this] { return chunks.size() < STREAM_CHUNKS_IN_FLIGHT; });
+    }
+    current = make_shared<vector<uint64_t>>();
+    current->reserve(STREAM_CHUNK_ACCESSES);
+}
+
+void AddressStream::close() {
+    if (!current->empty()) {
+        publish(false);
+    }
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    changed.notify_all();
+}
+
+shared_ptr<const vector<uint64_t>> AddressStream::next(unsigned reader) {
+    unique_lock<mutex> guard(lock);
+    uint64_t wanted = positions[reader];
+    changed.wait(guard, [&] { return wanted < first + chunks.size() || closed; });
+    if (wanted >= first + chunks.size()) {
+        return nullptr;
+    }
+    shared_ptr<const vector<uint64_t>> chunk = chunks[wanted - first];
+    positions[reader]++;
+
+    // drop the chunks every reader is past, which may let record() go on
+    uint64_t slowest = positions[0];
+    for (uint64_t position : positions) {
+        slowest = min(slowest, position);
+    }
+    if (slowest > first) {
+        while (first < slowest) {
+            chunks.pop_front();
+            first++;
+        }
+        changed.notify_all();
+    }
+    return chunk;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hierarchy --cache default stands for: 32 KB 8-way L1s and a 256 KB 8-way
+// L2, all with 64-byte lines, LRU, write-back and write-allocate
+#define CACHE_DEFAULT "l1i:32k:8:64,l1d:32k:8:64,l2:256k:8:64"
+
+enum CacheReplacement {
+    REPLACE_LRU,  // true LRU, ways kept in recency order
+    REPLACE_PLRU  // tree pseudo-LRU, one bit per inner node
+};
+
+// Geometry and policies of one cache level
+struct CacheConfig {
+    uint64_t size = 0;     // bytes
+    unsigned ways = 1;
+    unsigned lineSize = 64; // bytes, a power of two
+    CacheReplacement replacement = REPLACE_LRU;
+    bool writeBack = true;     // else write-through
+    bool writeAllocate = true; // else a store miss goes around the cache
+
+    // Parse "SIZE:WAYS:LINE" followed by any of ":lru" or ":plru", ":wb" or
+    // ":wt", ":wa" or ":nwa". SIZE takes a k or m suffix. Prints what is
+    // wrong and returns false on a bad or impossible geometry.
+    bool parse(const std::string &text);
+
+    // "32 KB, 8-way, 64 B lines, LRU, write-back, write-allocate"
+    std::string describe() const;
+};
+
+struct CacheStats {
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t readMisses = 0;
+    uint64_t writeMisses = 0;
+    uint64_t evictions = 0;  // valid lines replaced
+    uint64_t writebacks = 0; // of those, dirty ones written to the next level
+};
+
+// One set-associative cache. Only tags are modelled, not data. Each set's
+// tags sit next to each other, one word per way holding the line number, a
+// dirty bit and a valid bit, so a lookup touches one or two host cache
+// lines. With LRU the ways of a set are kept most recently used first, so
+// the common hit is on the first word; PLRU keeps ways in place and a word
+// of tree bits per set. Before any of that, an access to the line the last
+// access left in the cache only counts a hit: neither policy can have moved
+// that line out, and touching it again changes nothing.
+class Cache
+{
+    public:
+        // Misses, write-backs and write-throughs go to next, or to memory
+        // if there is none
+        Cache(const char *name, const CacheConfig &config, Cache *next);
+
+        Cache(const Cache &) = delete;
+        Cache &operator=(const Cache &) = delete;
+
+        // Look the line holding address up, filling it on a miss. Returns
+        // true on a hit.
+        bool access(uint64_t address, bool write) {
+            if (address >> lineBits == lastLine && (!write || lastDirty)) {
+                if (write) {
+                    stats.writes++;
+                } else {
+                    stats.reads++;
+                }
+                return true;
+            }
+            return lookup(address, write);
+        }
+
+        const char *const name;
+        const CacheConfig config;
+        const unsigned lineBits;
+        CacheStats stats;
+
+    private:
+        Cache *const next;
+        const uint64_t setMask;
+        std::vector<uint64_t> tags;     // sets * ways
+        std::vector<uint64_t> treeBits; // PLRU only, one word per set
+        uint64_t lastLine = ~0ULL;      // left in the cache by the last access
+        bool lastDirty = false;         // and a store would not change it
+
+        bool lookup(uint64_t address, bool write);
+        void evict(uint64_t entry);
+        void touchPLRU(size_t setIndex, unsigned way);
+        unsigned victimPLRU(size_t setIndex) const;
+};
+
+// Split L1 instruction and data caches in front of an optional shared L2.
+// Any level can be left out; a missing L1 sends its accesses straight to
+// the L2, and with no levels at all nothing is counted.
+class CacheHierarchy
+{
+    public:
+        // Build the levels a spec names, a comma-separated list of
+        // LEVEL:CONFIG where LEVEL is l1i, l1d or l2 and CONFIG is what
+        // CacheConfig::parse takes, or "default" for CACHE_DEFAULT.
+        // Returns false and prints why on a bad spec.
+        bool configure(const char *spec);
+
+        // Fetch of the instruction at PC
+        void fetch(uint64_t PC) {
+            if (fetchCache) {
+                fetchCache->access(PC, false);
+            }
+        }
+
+        // Load or store of size bytes at address, which may straddle two
+        // lines
+        void data(uint64_t address, unsigned size, bool write) {
+            if (!dataCache) {
+                return;
+            }
+            dataCache->access(address, write);
+            if (((address ^ (address + size - 1)) >> dataCache->lineBits) != 0) {
+                dataCache->access(address + size - 1, write);
+            }
+        }
+
+        // One line per level of its configuration and counts
+        void print(FILE *out) const;
+
+        // Level index of l1i, l1d and l2, or nullptr when it is left out
+        const Cache *level(int index) const {
+            const Cache *levels[3] = {l1i.get(), l1d.get(), l2.get()};
+            return levels[index];
+        }
+
+    private:
+        std::unique_ptr<Cache> l1i, l1d, l2;
+        Cache *fetchCache = nullptr;
+        Cache *dataCache = nullptr;
+};
+
+// Accesses in one chunk of an AddressStream
+#define STREAM_CHUNK_ACCESSES (1 << 16)
+
+// Chunks an AddressStream keeps before the simulation waits for the slowest
+// reader to catch up
+#define STREAM_CHUNKS_IN_FLIGHT 8
+
+// The loads and stores of one simulation, handed to any number of reader
+// threads a chunk at a time. Every reader sees every chunk; a chunk goes
+// away once the last reader has it. Each entry packs one access as
+// address << 3 | log2(size) << 1 | write.
+class AddressStream
+{
+    public:
+        explicit AddressStream(unsigned readers);
+
+        AddressStream(const AddressStream &) = delete;
+        AddressStream &operator=(const AddressStream &) = delete;
+
+        // Only the simulation thread calls record() and close()
+        void record(uint64_t address, unsigned sizeLog2, bool write) {
+            current->push_back(address << 3 | sizeLog2 << 1 | write);
+            if (current->size() == STREAM_CHUNK_ACCESSES) {
+                publish(true);
+            }
+        }
+
+        // Hand out the last partial chunk, then end the stream
+        void close();
+
+        // The next chunk for reader, waiting for one if need be, or null at
+        // the end of the stream
+        std::shared_ptr<const std::vector<uint64_t>> next(unsigned reader);
+
+    private:
+        std::shared_ptr<std::vector<uint64_t>> current; // being recorded
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::shared_ptr<const std::vector<uint64_t>>> chunks;
+        uint64_t first = 0;              // number of the chunk at chunks[0]
+        std::vector<uint64_t> positions; // next chunk number of each reader
+        bool closed = false;
+
+        void publish(bool wait);
+};
@@ -0,0 +1,141 @@
+#include "sim.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Checkpoints
+// --------------------------------------------------------------------------
+
+// A checkpoint file is this header, the page numbers of the pages it holds
+// in ascending order, and then the pages themselves in the same order,
+// starting at the first page boundary. Pages of zeros are left out. The
+// page data is never parsed: loading maps each run of consecutive pages
+// straight into guest memory, copy-on-write.
+#define CHECKPOINT_MAGIC "RVCKPT01"
+
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t PC;
+    uint64_t instructions;
+    uint64_t registers[REG_SIZE];
+    uint64_t numPages;
+};
+
+static bool isZeroPage(const uint8_t *page) {
+    return page[0] == 0 && memcmp(page, page + 1, PAGE_SIZE - 1) == 0;
+}
+
+static uint64_t pageDataOffset(uint64_t numPages) {
+    uint64_t indexEnd = sizeof(CheckpointHeader) + numPages * sizeof(uint64_t);
+    return (indexEnd + PAGE_SIZE - 1) & ~PAGE_OFFSET_MASK;
+}
+
+void Simulator::checkpoint(Checkpoint &cp) {
+    cp.regData = regData;
+    cp.PC = PC;
+    cp.stats = stats;
+    myMem->checkpoint(cp.mem);
+}
+
+void Simulator::restore(const Checkpoint &cp) {
+    // blocks decoded from pages the checkpoint replaces may not match it,
+    // and would not match the original either once reset
+    if (myMem->codeWritten()) {
+        invalidateCode();
+    }
+    if (myMem->restoreCheckpoint(cp.mem)) {
+        dropBlocks();
+        codeModified = true;
+    }
+
+    regData = cp.regData;
+    PC = cp.PC;
+    stats = cp.stats;
+    loopCheck = LoopCheck();
+}
+
+bool Simulator::saveCheckpoint(const char *checkpointFile) {
+    Checkpoint cp;
+    checkpoint(cp);
+
+    vector<const MemCheckpoint::Page*> pages;
+    for (const MemCheckpoint::Page &page : cp.mem.pages) {
+        if (!isZeroPage(page.host)) {
+            pages.push_back(&page);
+        }
+    }
+
+    CheckpointHeader header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.PC = PC;
+    header.instructions = stats.instructions;
+    memcpy(header.registers, regData.registers, sizeof(header.registers));
+    header.numPages = pages.size();
+
+    FILE *out = fopen(checkpointFile, "wb");
+    if (!out) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (const MemCheckpoint::Page *page : pages) {
+        ok = ok && fwrite(&page->vpn, sizeof(page->vpn), 1, out) == 1;
+    }
+    ok = ok && fseek(out, pageDataOffset(pages.size()), SEEK_SET) == 0;
+    for (const MemCheckpoint::Page *page : pages) {
+        ok = ok && fwrite(page->host, PAGE_SIZE, 1, out) == 1;
+    }
+    return fclose(out) == 0 && ok;
+}
+
+bool Simulator::loadCheckpoint(const char *checkpointFile) {
+    programFile = checkpointFile;
+    loaded = false;
+    dropBlocks();
+    codeModified = false;
+    delete myMem;
+    myMem = new PagedMemory();
+
+    int fd = open(checkpointFile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "\tError open checkpoint %s\n", checkpointFile);
+        return false;
+    }
+
+    CheckpointHeader header;
+    vector<uint64_t> vpns;
+    bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+              memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0;
+    if (ok) {
+        vpns.resize(header.numPages);
+        ssize_t indexSize = vpns.size() * sizeof(uint64_t);
+        ok = read(fd, vpns.data(), indexSize) == indexSize;
+    }
+
+    // one mapping per run of consecutive pages
+    uint64_t dataOffset = ok ? pageDataOffset(vpns.size()) : 0;
+    for (size_t first = 0; ok && first < vpns.size();) {
+        size_t last = first;
+        while (last + 1 < vpns.size() && vpns[last + 1] == vpns[last] + 1) {
+            last++;
+        }
+        ok = myMem->mapFile(vpns[first] << PAGE_BITS, fd, dataOffset + first * PAGE_SIZE,
+                            (last - first + 1) * PAGE_SIZE);
+        first = last + 1;
+    }
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "\tError reading checkpoint %s\n", checkpointFile);
+        return false;
+    }
+
+    myMem->snapshot();
+    entryPC = header.PC;
+    memcpy(entryRegs.registers, header.registers, sizeof(entryRegs.registers));
+    entryStats = SimStats();
+    entryStats.instructions = header.instructions;
+    loaded = true;
+    return reset();
+}
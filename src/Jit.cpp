@@ -0,0 +1,713 @@
+#include "sim.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// x86-64 dynamic binary translation
+// --------------------------------------------------------------------------
+
+// Cached blocks start out in the interpreter. Once a block has run
+// JIT_THRESHOLD times it is translated to host code that works directly on
+// regData.registers, and its exits are linked straight to the host code of
+// their successors, so hot loops never return to the dispatcher.
+
+#if defined(__x86_64__)
+
+// Block executions before a block is translated
+#define JIT_THRESHOLD 16
+
+// Host code buffer, flushed and refilled when it runs out
+#define JIT_CODE_SIZE (16 << 20)
+
+// Longest host code a single block can need, checked before translating.
+// A doubleword store, the longest instruction, takes about 260 bytes.
+#define JIT_MAX_BLOCK_CODE (MAX_BLOCK_INSTS * 320 + 128)
+
+// Host registers
+enum X86Reg {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3, // guest register file
+    RBP = 5, // software TLB of guest memory
+    RSI = 6,
+    RDI = 7
+};
+
+// Condition codes for jcc/setcc
+enum X86Cond {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_A  = 0x7,
+    CC_L  = 0xc,
+    CC_GE = 0xd
+};
+
+// /digit of the 0x81 (immediate) group, also used to pick the 0x03-0x3b
+// register forms: opcode = digit * 8 + 3
+enum X86Alu {
+    ALU_ADD = 0,
+    ALU_OR  = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7
+};
+
+// /digit of the shift group
+enum X86Shift {
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7
+};
+
+typedef uint64_t (*JitEntry)(uint64_t *registers, PagedMemory *myMem, void *code, PagedMemory::Tlb *tlb);
+
+// The inline TLB lookup scales the index by 16
+static_assert(sizeof(PagedMemory::TlbEntry) == 16, "TLB entries must be 16 bytes");
+
+// Per-simulator translator state
+struct JitState {
+    BlockCache &blockCache;   // the simulator's blocks, for linking exits
+    uint64_t budget = 0;      // instructions left, charged by each block
+    uint64_t parkedBudget = 0; // budget set aside to stop at the next block
+
+    uint8_t *code = nullptr;
+    size_t used = 0;
+
+    JitEntry enter = nullptr; // saves host registers and jumps into a block
+    uint8_t *exit = nullptr;  // returns to the dispatcher with next PC in rax
+
+    // rel32 fields of exit stubs waiting for their target block
+    unordered_map<uint64_t, vector<uint8_t*>> pendingLinks;
+    vector<DecodedBlock*> translated;
+
+    explicit JitState(BlockCache &blockCache) : blockCache(blockCache) {}
+};
+
+// Out of line path for TLB misses and accesses that straddle two pages
+static uint64_t jitLoad(PagedMemory *myMem, uint64_t address, uint64_t size) {
+    uint64_t value = 0;
+    myMem->getMemValue(address, value, (MemEntrySize)size);
+    return value;
+}
+
+static void jitStore(PagedMemory *myMem, uint64_t address, uint64_t value, uint64_t size) {
+    myMem->setMemValue(address, value, (MemEntrySize)size);
+}
+
+// A store hit a page with decoded code. Empty the budget so the next block
+// entered leaves for the dispatcher, which drops the stale blocks.
+static void jitCodeWritten(void *arg) {
+    JitState &jit = *(JitState*)arg;
+    jit.parkedBudget += jit.budget;
+    jit.budget = 0;
+}
+
+// Appends x86-64 machine code at the end of the code buffer
+class X86Emitter {
+    public:
+        uint8_t *pos;
+
+        explicit X86Emitter(uint8_t *start) : pos(start) {}
+
+        void byte(uint8_t b) { *pos++ = b; }
+        void imm32(uint32_t v) { memcpy(pos, &v, 4); pos += 4; }
+        void imm64(uint64_t v) { memcpy(pos, &v, 8); pos += 8; }
+
+        // modrm for [rbx + disp32] addressing a guest register
+        void guestOperand(int reg, int guestReg) {
+            byte(0x80 | (reg << 3) | RBX);
+            imm32(guestReg * 8);
+        }
+
+        // reg = x[guestReg]
+        void loadGuest(X86Reg reg, uint64_t guestReg) {
+            byte(0x48); byte(0x8b); guestOperand(reg, guestReg);
+        }
+
+        // x[guestReg] = reg
+        void storeGuest(uint64_t guestReg, X86Reg reg) {
+            byte(0x48); byte(0x89); guestOperand(reg, guestReg);
+        }
+
+        // reg op= x[guestReg]
+        void aluGuest(X86Alu op, X86Reg reg, uint64_t guestReg, bool is64) {
+            if (is64) byte(0x48);
+            byte(op * 8 + 3); guestOperand(reg, guestReg);
+        }
+
+        // reg op= sign-extended imm32
+        void aluImm(X86Alu op, X86Reg reg, uint32_t imm, bool is64) {
+            if (is64) byte(0x48);
+            byte(0x81); byte(0xc0 | (op << 3) | reg); imm32(imm);
+        }
+
+        // reg shift= cl
+        void shiftCl(X86Shift op, X86Reg reg, bool is64) {
+            if (is64) byte(0x48);
+            byte(0xd3); byte(0xc0 | (op << 3) | reg);
+        }
+
+        // reg shift= imm8
+        void shiftImm(X86Shift op, X86Reg reg, uint8_t amount, bool is64) {
+            if (is64) byte(0x48);
+            byte(0xc1); byte(0xc0 | (op << 3) | reg); byte(amount);
+        }
+
+        // movsxd reg, reg32
+        void signExtend32(X86Reg reg) {
+            byte(0x48); byte(0x63); byte(0xc0 | (reg << 3) | reg);
+        }
+
+        // rax = sign-extended al/ax
+        void signExtendRax(int bytes) {
+            if (bytes == 4) {
+                signExtend32(RAX);
+            } else {
+                byte(0x48); byte(0x0f); byte(bytes == 1 ? 0xbe : 0xbf); byte(0xc0);
+            }
+        }
+
+        // rax = (condition) ? 1 : 0
+        void setcc(X86Cond cond) {
+            byte(0x0f); byte(0x90 | cond); byte(0xc0); // setcc al
+            byte(0x0f); byte(0xb6); byte(0xc0);        // movzx eax, al
+        }
+
+        void movImm64(X86Reg reg, uint64_t imm) {
+            byte(0x48); byte(0xb8 | reg); imm64(imm);
+        }
+
+        void movImm32(X86Reg reg, uint32_t imm) {
+            byte(0xb8 | reg); imm32(imm);
+        }
+
+        // qword [rax] op= sign-extended imm32
+        void aluMemRax(X86Alu op, uint32_t imm) {
+            byte(0x48); byte(0x81); byte(op << 3); imm32(imm);
+        }
+
+        // dst = src
+        void mov(X86Reg dst, X86Reg src, bool is64) {
+            if (is64) byte(0x48);
+            byte(0x89); byte(0xc0 | (src << 3) | dst);
+        }
+
+        // rsi += rax
+        void addRsiRax() { byte(0x48); byte(0x01); byte(0xc6); }
+
+        // reg = [rbp + rcx + disp32], or cmp reg with it
+        void tlbOperand(uint8_t opcode, X86Reg reg, uint32_t disp) {
+            byte(0x48); byte(opcode);
+            byte(0x84 | (reg << 3)); byte(0x0d); // [rbp + rcx*1 + disp32]
+            imm32(disp);
+        }
+
+        // rdi = r12, the PagedMemory pointer
+        void movMemArg() { byte(0x4c); byte(0x89); byte(0xe7); }
+
+        // bts rax, 63
+        void setRaxTopBit() { byte(0x48); byte(0x0f); byte(0xba); byte(0xe8); byte(63); }
+
+        // rax = [rax + disp8]
+        void loadRaxFromRax(uint8_t disp) { byte(0x48); byte(0x8b); byte(0x40); byte(disp); }
+
+        // rcx = [rax + rcx * 8 + disp8]
+        void loadRcxIndexed(uint8_t disp) { byte(0x48); byte(0x8b); byte(0x4c); byte(0xc8); byte(disp); }
+
+        // CF = bit rdi % 64 of rcx
+        void btRcxRdi() { byte(0x48); byte(0x0f); byte(0xa3); byte(0xf9); }
+
+        // rax = size bytes at [rsi], sign or zero extended
+        void loadHost(int size, bool isSigned) {
+            switch (size) {
+                case 1: if (isSigned) { byte(0x48); byte(0x0f); byte(0xbe); } else { byte(0x0f); byte(0xb6); } break;
+                case 2: if (isSigned) { byte(0x48); byte(0x0f); byte(0xbf); } else { byte(0x0f); byte(0xb7); } break;
+                case 4: if (isSigned) { byte(0x48); byte(0x63); } else { byte(0x8b); } break;
+                default: byte(0x48); byte(0x8b); break;
+            }
+            byte(0x06);
+        }
+
+        // size bytes at [rsi] = rdx
+        void storeHost(int size) {
+            switch (size) {
+                case 1: byte(0x88); break;
+                case 2: byte(0x66); byte(0x89); break;
+                case 4: byte(0x89); break;
+                default: byte(0x48); byte(0x89); break;
+            }
+            byte(0x16);
+        }
+
+        void call(void *target) {
+            movImm64(RAX, (uint64_t)target);
+            byte(0xff); byte(0xd0);
+        }
+
+        // Returns the rel32 field so the jump can be retargeted later
+        uint8_t *jmp(uint8_t *target) {
+            byte(0xe9);
+            uint8_t *field = pos;
+            imm32(target - (field + 4));
+            return field;
+        }
+
+        uint8_t *jcc(X86Cond cond, uint8_t *target) {
+            byte(0x0f); byte(0x80 | cond);
+            uint8_t *field = pos;
+            imm32(target - (field + 4));
+            return field;
+        }
+};
+
+static void patchRel32(uint8_t *field, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (field + 4));
+    memcpy(field, &rel, 4);
+}
+
+// Point an exit at its target block's host code, or queue it until that
+// block gets translated
+static void linkExit(JitState &jit, uint8_t *field, uint64_t targetPC) {
+    DecodedBlock *target = nullptr;
+    auto cached = jit.blockCache.find(targetPC);
+    if (cached != jit.blockCache.end()) {
+        target = &cached->second;
+    }
+
+    if (target && target->jitCode) {
+        patchRel32(field, (uint8_t*)target->jitCode);
+    } else {
+        jit.pendingLinks[targetPC].push_back(field);
+    }
+}
+
+// Exit stub: leave with targetPC in rax, until it is linked to the target
+static void emitExit(JitState &jit, X86Emitter &x86, uint64_t targetPC) {
+    x86.movImm64(RAX, targetPC);
+    uint8_t *field = x86.jmp(jit.exit);
+    linkExit(jit, field, targetPC);
+}
+
+static void emitEntryAndExit(JitState &jit) {
+    X86Emitter x86(jit.code);
+
+    // enter(registers, myMem, code, tlb): keeps the stack 16-byte
+    // aligned for the helper calls made from block code
+    jit.enter = (JitEntry)x86.pos;
+    x86.byte(0x53);                                 // push rbx
+    x86.byte(0x41); x86.byte(0x54);                 // push r12
+    x86.byte(0x55);                                 // push rbp
+    x86.byte(0x48); x86.byte(0x89); x86.byte(0xfb); // mov rbx, rdi
+    x86.byte(0x49); x86.byte(0x89); x86.byte(0xf4); // mov r12, rsi
+    x86.byte(0x48); x86.byte(0x89); x86.byte(0xcd); // mov rbp, rcx
+    x86.byte(0xff); x86.byte(0xe2);                 // jmp rdx
+
+    jit.exit = x86.pos;
+    x86.byte(0x5d);                                 // pop rbp
+    x86.byte(0x41); x86.byte(0x5c);                 // pop r12
+    x86.byte(0x5b);                                 // pop rbx
+    x86.byte(0xc3);                                 // ret
+
+    jit.used = x86.pos - jit.code;
+}
+
+static JitState *jitCreate(Simulator &sim) {
+    void *code = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "JIT: could not map code buffer, using the interpreter\n");
+        return nullptr;
+    }
+    JitState *jit = new JitState(sim.blockCache);
+    jit->code = (uint8_t*)code;
+    emitEntryAndExit(*jit);
+    return jit;
+}
+
+void jitRelease(JitState *jit) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    delete jit;
+}
+
+// Drop every translation once the code buffer is full
+static void jitFlush(JitState &jit) {
+    for (DecodedBlock *block : jit.translated) {
+        block->jitCode = nullptr;
+        block->execCount = 0;
+    }
+    jit.translated.clear();
+    jit.pendingLinks.clear();
+    emitEntryAndExit(jit);
+}
+
+void jitInvalidate(JitState *jit) {
+    jitFlush(*jit);
+}
+
+// Binary ALU op on two guest registers (or a register and an immediate)
+static void emitAlu(X86Emitter &x86, const Instruction &inst, X86Alu op, bool useImm, bool is64) {
+    x86.loadGuest(RAX, inst.rs1);
+    if (useImm) {
+        x86.aluImm(op, RAX, (uint32_t)inst.imm, is64);
+    } else {
+        x86.aluGuest(op, RAX, inst.rs2, is64);
+    }
+    if (!is64) {
+        x86.signExtend32(RAX);
+    }
+}
+
+static void emitShift(X86Emitter &x86, const Instruction &inst, X86Shift op, bool useImm, bool is64) {
+    x86.loadGuest(RAX, inst.rs1);
+    if (useImm) {
+        x86.shiftImm(op, RAX, inst.imm & (is64 ? 0x3f : 0x1f), is64);
+    } else {
+        x86.loadGuest(RCX, inst.rs2);
+        x86.shiftCl(op, RAX, is64);
+    }
+    if (!is64) {
+        x86.signExtend32(RAX);
+    }
+}
+
+static void emitCompare(X86Emitter &x86, const Instruction &inst, X86Cond cond, bool useImm) {
+    x86.loadGuest(RAX, inst.rs1);
+    if (useImm) {
+        x86.aluImm(ALU_CMP, RAX, (uint32_t)inst.imm, true);
+    } else {
+        x86.aluGuest(ALU_CMP, RAX, inst.rs2, true);
+    }
+    x86.setcc(cond);
+}
+
+// Inline software TLB lookup. Leaves the guest address x[rs1] + imm in rsi
+// and, on a hit for an access inside one page, turns it into the host
+// address. The jcc fields returned branch to the slow path, where rsi
+// still holds the guest address. Clobbers rax, rcx and rdi.
+struct TlbLookup {
+    uint8_t *crossesPage;
+    uint8_t *miss;
+    uint8_t *codeWords[3] = {nullptr, nullptr, nullptr}; // stores to marked words
+};
+
+// Test the bit of the word holding the byte at rsi + add in the CodeMap in
+// rax. Clobbers rcx and rdi.
+static uint8_t *emitCodeWordTest(X86Emitter &x86, uint32_t add) {
+    x86.mov(RDI, RSI, false);
+    x86.aluImm(ALU_AND, RDI, PAGE_OFFSET_MASK, false);
+    x86.aluImm(ALU_ADD, RDI, add, false);
+    x86.shiftImm(SHIFT_SHR, RDI, 2, false);
+    x86.mov(RCX, RDI, false);
+    x86.shiftImm(SHIFT_SHR, RCX, 6, false);
+    x86.loadRcxIndexed(offsetof(PagedMemory::CodeMap, words));
+    x86.btRcxRdi();
+    return x86.jcc(CC_B, x86.pos);
+}
+
+static TlbLookup emitTlbLookup(X86Emitter &x86, const Instruction &inst, int size, bool isWrite) {
+    TlbLookup slowPath;
+    uint32_t entries = isWrite ? offsetof(PagedMemory::Tlb, write) : offsetof(PagedMemory::Tlb, read);
+
+    x86.loadGuest(RSI, inst.rs1);
+    x86.aluImm(ALU_ADD, RSI, (uint32_t)inst.imm, true);
+
+    // page offset, anything straddling two pages goes the slow way
+    x86.mov(RAX, RSI, false);
+    x86.aluImm(ALU_AND, RAX, PAGE_OFFSET_MASK, false);
+    x86.aluImm(ALU_CMP, RAX, PAGE_SIZE - size, false);
+    slowPath.crossesPage = x86.jcc(CC_A, x86.pos);
+
+    // rax = page number, rcx = byte offset of its TLB entry
+    x86.mov(RAX, RSI, true);
+    x86.shiftImm(SHIFT_SHR, RAX, PAGE_BITS, true);
+    x86.mov(RCX, RAX, false);
+    x86.aluImm(ALU_AND, RCX, TLB_ENTRIES - 1, false);
+    x86.shiftImm(SHIFT_SHL, RCX, 4, false);
+
+    x86.tlbOperand(0x3b, RAX, entries + offsetof(PagedMemory::TlbEntry, tag));  // cmp
+    if (!isWrite) {
+        slowPath.miss = x86.jcc(CC_NE, x86.pos);
+        x86.tlbOperand(0x8b, RAX, entries + offsetof(PagedMemory::TlbEntry, page)); // mov
+    } else {
+        uint8_t *hit = x86.jcc(CC_E, x86.pos);
+
+        // a page with code has a TLB_CODE entry pointing at its CodeMap,
+        // and the store only goes the slow way if it covers a marked word:
+        // the first, last and, for a doubleword, the one after the first
+        x86.setRaxTopBit();
+        x86.tlbOperand(0x3b, RAX, entries + offsetof(PagedMemory::TlbEntry, tag));  // cmp
+        slowPath.miss = x86.jcc(CC_NE, x86.pos);
+        x86.tlbOperand(0x8b, RAX, entries + offsetof(PagedMemory::TlbEntry, code)); // mov
+        slowPath.codeWords[0] = emitCodeWordTest(x86, 0);
+        if (size > 1) {
+            slowPath.codeWords[1] = emitCodeWordTest(x86, size - 1);
+        }
+        if (size == 8) {
+            slowPath.codeWords[2] = emitCodeWordTest(x86, 4);
+        }
+        x86.loadRaxFromRax(offsetof(PagedMemory::CodeMap, host));
+        uint8_t *haveHost = x86.jmp(x86.pos);
+
+        patchRel32(hit, x86.pos);
+        x86.tlbOperand(0x8b, RAX, entries + offsetof(PagedMemory::TlbEntry, page)); // mov
+        patchRel32(haveHost, x86.pos);
+    }
+    x86.aluImm(ALU_AND, RSI, PAGE_OFFSET_MASK, false);
+    x86.addRsiRax();
+    return slowPath;
+}
+
+static void patchSlowPath(const TlbLookup &slowPath, uint8_t *target) {
+    patchRel32(slowPath.crossesPage, target);
+    patchRel32(slowPath.miss, target);
+    for (uint8_t *codeWord : slowPath.codeWords) {
+        if (codeWord) {
+            patchRel32(codeWord, target);
+        }
+    }
+}
+
+// TLB hits are a single host load, the rest call jitLoad
+static void emitLoad(X86Emitter &x86, const Instruction &inst, int size, bool isSigned) {
+    TlbLookup slowPath = emitTlbLookup(x86, inst, size, false);
+    x86.loadHost(size, isSigned);
+    uint8_t *done = x86.jmp(x86.pos);
+
+    patchSlowPath(slowPath, x86.pos);
+    x86.movMemArg();
+    x86.movImm32(RDX, size);
+    x86.call((void*)jitLoad);
+    if (isSigned && size < 8) {
+        x86.signExtendRax(size);
+    }
+    patchRel32(done, x86.pos);
+}
+
+static void emitStore(X86Emitter &x86, const Instruction &inst, int size) {
+    x86.loadGuest(RDX, inst.rs2);
+    TlbLookup slowPath = emitTlbLookup(x86, inst, size, true);
+    x86.storeHost(size);
+    uint8_t *done = x86.jmp(x86.pos);
+
+    patchSlowPath(slowPath, x86.pos);
+    x86.movMemArg();
+    x86.movImm32(RCX, size);
+    x86.call((void*)jitStore);
+    patchRel32(done, x86.pos);
+}
+
+static void emitBranch(JitState &jit, X86Emitter &x86, const Instruction &inst, X86Cond cond) {
+    x86.loadGuest(RAX, inst.rs1);
+    x86.aluGuest(ALU_CMP, RAX, inst.rs2, true);
+
+    // jcc to the taken stub, emitted right after the fall-through one
+    uint8_t *taken = x86.jcc(cond, x86.pos);
+    emitExit(jit, x86, inst.PC + 4);
+    patchRel32(taken, x86.pos);
+    emitExit(jit, x86, inst.PC + inst.imm);
+}
+
+// Translate one instruction. Control flow also emits the block's exits.
+// Returns false for anything the translator does not cover.
+static bool emitInstruction(JitState &jit, X86Emitter &x86, const Instruction &inst) {
+    switch (inst.id) {
+        case INSC_ADD:   emitAlu(x86, inst, ALU_ADD, false, true); break;
+        case INSC_ADDW:  emitAlu(x86, inst, ALU_ADD, false, false); break;
+        case INSC_ADDI:  emitAlu(x86, inst, ALU_ADD, true, true); break;
+        case INSC_ADDIW: emitAlu(x86, inst, ALU_ADD, true, false); break;
+        case INSC_SUB:   emitAlu(x86, inst, ALU_SUB, false, true); break;
+        case INSC_SUBW:  emitAlu(x86, inst, ALU_SUB, false, false); break;
+        case INSC_AND:   emitAlu(x86, inst, ALU_AND, false, true); break;
+        case INSC_ANDI:  emitAlu(x86, inst, ALU_AND, true, true); break;
+        case INSC_OR:    emitAlu(x86, inst, ALU_OR, false, true); break;
+        case INSC_ORI:   emitAlu(x86, inst, ALU_OR, true, true); break;
+        case INSC_XOR:   emitAlu(x86, inst, ALU_XOR, false, true); break;
+        case INSC_XORI:  emitAlu(x86, inst, ALU_XOR, true, true); break;
+
+        case INSC_SLL:   emitShift(x86, inst, SHIFT_SHL, false, true); break;
+        case INSC_SLLW:  emitShift(x86, inst, SHIFT_SHL, false, false); break;
+        case INSC_SLLI:  emitShift(x86, inst, SHIFT_SHL, true, true); break;
+        case INSC_SLLIW: emitShift(x86, inst, SHIFT_SHL, true, false); break;
+        case INSC_SRL:   emitShift(x86, inst, SHIFT_SHR, false, true); break;
+        case INSC_SRLW:  emitShift(x86, inst, SHIFT_SHR, false, false); break;
+        case INSC_SRLI:  emitShift(x86, inst, SHIFT_SHR, true, true); break;
+        case INSC_SRLIW: emitShift(x86, inst, SHIFT_SHR, true, false); break;
+        case INSC_SRA:   emitShift(x86, inst, SHIFT_SAR, false, true); break;
+        case INSC_SRAW:  emitShift(x86, inst, SHIFT_SAR, false, false); break;
+        case INSC_SRAI:  emitShift(x86, inst, SHIFT_SAR, true, true); break;
+        case INSC_SRAIW: emitShift(x86, inst, SHIFT_SAR, true, false); break;
+
+        case INSC_SLT:   emitCompare(x86, inst, CC_L, false); break;
+        case INSC_SLTI:  emitCompare(x86, inst, CC_L, true); break;
+        case INSC_SLTU:  emitCompare(x86, inst, CC_B, false); break;
+        case INSC_SLTIU: emitCompare(x86, inst, CC_B, true); break;
+
+        case INSC_LUI:   x86.movImm64(RAX, inst.imm); break;
+        case INSC_AUIPC: x86.movImm64(RAX, inst.PC + inst.imm); break;
+
+        case INSC_LB:  emitLoad(x86, inst, BYTE_SIZE, true); break;
+        case INSC_LBU: emitLoad(x86, inst, BYTE_SIZE, false); break;
+        case INSC_LH:  emitLoad(x86, inst, HALF_SIZE, true); break;
+        case INSC_LHU: emitLoad(x86, inst, HALF_SIZE, false); break;
+        case INSC_LW:  emitLoad(x86, inst, WORD_SIZE, true); break;
+        case INSC_LWU: emitLoad(x86, inst, WORD_SIZE, false); break;
+        case INSC_LD:  emitLoad(x86, inst, DOUBLE_SIZE, false); break;
+
+        case INSC_SB: emitStore(x86, inst, BYTE_SIZE); return true;
+        case INSC_SH: emitStore(x86, inst, HALF_SIZE); return true;
+        case INSC_SW: emitStore(x86, inst, WORD_SIZE); return true;
+        case INSC_SD: emitStore(x86, inst, DOUBLE_SIZE); return true;
+
+        case INSC_BEQ:  emitBranch(jit, x86, inst, CC_E); return true;
+        case INSC_BNE:  emitBranch(jit, x86, inst, CC_NE); return true;
+        case INSC_BLT:  emitBranch(jit, x86, inst, CC_L); return true;
+        case INSC_BGE:  emitBranch(jit, x86, inst, CC_GE); return true;
+        case INSC_BLTU: emitBranch(jit, x86, inst, CC_B); return true;
+        case INSC_BGEU: emitBranch(jit, x86, inst, CC_AE); return true;
+
+        case INSC_JAL:
+            if (inst.rd != 0) {
+                x86.movImm64(RAX, inst.PC + 4);
+                x86.storeGuest(inst.rd, RAX);
+            }
+            emitExit(jit, x86, inst.PC + inst.imm);
+            return true;
+
+        case INSC_JALR:
+            // target first, rd may be the same register as rs1
+            x86.loadGuest(RAX, inst.rs1);
+            x86.aluImm(ALU_ADD, RAX, (uint32_t)inst.imm, true);
+            x86.aluImm(ALU_AND, RAX, ~1U, true);
+            if (inst.rd != 0) {
+                x86.movImm64(RCX, inst.PC + 4);
+                x86.storeGuest(inst.rd, RCX);
+            }
+            x86.jmp(jit.exit); // indirect, back to the dispatcher
+            return true;
+
+        default:
+            return false;
+    }
+
+    // value ops leave their result in rax
+    if (inst.rd != 0) {
+        x86.storeGuest(inst.rd, RAX);
+    }
+    return true;
+}
+
+// Translate a block up to its first halt or illegal instruction, which are
+// left for the interpreter. Returns false if nothing could be translated.
+static bool jitTranslate(JitState &jit, DecodedBlock &block) {
+    uint64_t numInsts = 0;
+    while (numInsts < block.insts.size() && block.insts[numInsts].isLegal &&
+           !block.insts[numInsts].isHalt) {
+        numInsts++;
+    }
+    if (numInsts == 0) {
+        return false;
+    }
+
+    if (jit.used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+        jitFlush(jit);
+    }
+
+    X86Emitter x86(jit.code + jit.used);
+    uint8_t *start = x86.pos;
+
+    // charge the whole block to the budget up front, or leave without
+    // running any of it when the budget is too small
+    x86.movImm64(RAX, (uint64_t)&jit.budget);
+    x86.aluMemRax(ALU_SUB, numInsts);
+    uint8_t *overBudget = x86.jcc(CC_B, x86.pos);
+
+    for (uint64_t i = 0; i < numInsts; i++) {
+        if (!emitInstruction(jit, x86, block.insts[i])) {
+            return false;
+        }
+    }
+    const Instruction &last = block.insts[numInsts - 1];
+    if (last.id != INSC_JAL && last.id != INSC_JALR && last.opcode != OP_STRBYT) {
+        emitExit(jit, x86, last.PC + 4);
+    }
+
+    patchRel32(overBudget, x86.pos);
+    x86.aluMemRax(ALU_ADD, numInsts);
+    x86.movImm64(RAX, block.startPC);
+    x86.jmp(jit.exit);
+
+    jit.used = x86.pos - jit.code;
+    block.jitCode = start;
+    block.jitInsts = numInsts;
+    jit.translated.push_back(&block);
+
+    // exits that were waiting for this block can now jump straight in
+    auto pending = jit.pendingLinks.find(block.startPC);
+    if (pending != jit.pendingLinks.end()) {
+        for (uint8_t *field : pending->second) {
+            patchRel32(field, start);
+        }
+        jit.pendingLinks.erase(pending);
+    }
+    return true;
+}
+
+// Run cached blocks, translating hot ones to x86-64, until a halt, an
+// illegal instruction or the end of the budget. Cold blocks, and blocks
+// the budget cannot cover in full, go through the staged interpreter.
+SimStatus simJit(Simulator &sim, uint64_t &budget) {
+    if (!sim.jit) {
+        sim.jit = jitCreate(sim);
+        if (!sim.jit) {
+            sim.engine = ENGINE_THREADED;
+            return simThreaded(sim, sim.myMem, budget);
+        }
+    }
+    JitState &jit = *sim.jit;
+
+    while (true) {
+        if (sim.myMem->codeWritten()) {
+            sim.invalidateCode();
+        }
+        DecodedBlock &block = simDecodeBlock(sim, sim.PC);
+
+        if (!block.jitCode && ++block.execCount >= JIT_THRESHOLD) {
+            jitTranslate(jit, block);
+        }
+
+        if (block.jitCode && block.jitInsts <= budget) {
+            jit.budget = budget;
+            sim.myMem->setCodeWriteHook(jitCodeWritten, &jit);
+            sim.PC = jit.enter(sim.regData.registers, sim.myMem, block.jitCode, sim.myMem->tlbBase());
+            sim.myMem->setCodeWriteHook(nullptr, nullptr);
+            budget = jit.budget + jit.parkedBudget;
+            jit.parkedBudget = 0;
+            continue;
+        }
+
+        SimStatus status = simBlock(sim, budget);
+        if (status != SIM_RUNNING || budget == 0) {
+            return status;
+        }
+    }
+}
+
+#else
+
+// No translator for this host, run the threaded interpreter instead
+SimStatus simJit(Simulator &sim, uint64_t &budget) {
+    return simThreaded(sim, sim.myMem, budget);
+}
+
+void jitRelease(JitState *jit) {}
+
+void jitInvalidate(JitState *jit) {}
+
+#endif
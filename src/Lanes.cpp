@@ -0,0 +1,586 @@
+#include "sim.h"
+
+#include <chrono>
+#include <sstream>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Lockstep lanes
+// --------------------------------------------------------------------------
+
+// Lanes run in gangs of LANE_WIDTH. A gang keeps each guest register as one
+// vector with an element per lane, so an ALU instruction is a few vector
+// operations for the whole gang. With the default flags GCC lowers these to
+// SSE2; building with -march=native gets AVX2 or AVX-512.
+#define LANE_WIDTH 8
+
+// GCC warns that returning these depends on the target's vector extensions.
+// Only the small static helpers below do, everything else takes references.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// aligned(8) lets a gang live anywhere without over-aligned allocation
+typedef uint64_t LaneVec __attribute__((vector_size(8 * LANE_WIDTH), aligned(8)));
+typedef int64_t LaneSVec __attribute__((vector_size(8 * LANE_WIDTH), aligned(8)));
+
+// Each line of the inputs file starts one lane, its values going to a0,
+// a1, ... in order. Blank lines and lines starting with # are skipped.
+// A lane whose code no longer matches the gang's blocks leaves the gang
+// still SIM_RUNNING and finishes on a Simulator of its own.
+struct Lane {
+    vector<uint64_t> inputs;
+    PagedMemory *mem = nullptr;
+    SimStatus status = SIM_RUNNING;
+    uint64_t instructions = 0;
+    REGS regs; // taken from the gang when the lane stops
+};
+
+// Registers and PCs of the lanes in a gang. live is all ones for the lanes
+// still running; a partial last gang starts with the rest off.
+struct LaneGang {
+    LaneVec regs[REG_SIZE + 1]; // regs[REG_SIZE] absorbs writes to x0
+    LaneVec pc;
+    LaneVec live;
+    LaneVec instructions; // retired by each lane, not counting the halt
+    Lane *lanes[LANE_WIDTH];
+    PagedMemory *mems[LANE_WIDTH];
+    uint64_t steps = 0; // instructions run for the gang as a whole
+    uint64_t id = 0;
+    bool codeWritten = false; // a lane stored to words its blocks came from
+};
+
+// One instruction of a LaneBlock; target is the label in runGang that runs
+// it for every lane of the gang
+struct LaneOp {
+    const void *target = nullptr;
+    uint64_t PC = 0;
+    uint64_t imm = 0;
+    uint32_t instruction = 0;
+    uint8_t rd = 0; // REG_SIZE (the scratch register) when the result goes to x0
+    uint8_t rs1 = 0;
+    uint8_t rs2 = 0;
+};
+
+// A cached block translated once into LaneOps, ending in its branch or jump,
+// or else in a halt, illegal or fallthrough op. Like the threaded engine's
+// blocks, it links to the blocks the gang went to from it.
+struct LaneBlock {
+    uint64_t startPC = 0;
+    uint64_t endPC = 0;    // the instruction after its last one
+    uint64_t numInsts = 0; // retired by a full run, not counting a halt
+    vector<LaneOp> ops;
+    LaneBlock *taken = nullptr;
+    LaneBlock *notTaken = nullptr;
+    uint64_t gang = 0; // the last gang whose memories have it marked
+};
+
+typedef unordered_map<uint64_t, LaneBlock> LaneBlocks;
+
+static inline LaneVec splat(uint64_t value) {
+    LaneVec v = {};
+    return v + value;
+}
+
+// Lanes in mask take a, the others b
+static inline LaneVec blend(const LaneVec &mask, const LaneVec &a, const LaneVec &b) {
+    return (a & mask) | (b & ~mask);
+}
+
+static inline LaneVec sext32(const LaneVec &v) {
+    return (LaneVec)((LaneSVec)(v << 32) >> 32);
+}
+
+// Bit i set for each lane i that mask has on
+static inline unsigned laneBits(const LaneVec &mask) {
+    unsigned bits = 0;
+    for (int i = 0; i < LANE_WIDTH; i++) {
+        bits |= (unsigned)(mask[i] & 1) << i;
+    }
+    return bits;
+}
+
+// The block at PC translated for runGang, whose label addresses are in labels
+static LaneBlock &laneBlock(Simulator &code, LaneBlocks &blocks, uint64_t PC, const void *const *labels) {
+    LaneBlock &block = blocks[PC];
+    if (!block.ops.empty()) {
+        return block;
+    }
+
+    const DecodedBlock &decoded = simDecodeBlock(code, PC);
+    block.startPC = PC;
+    block.endPC = decoded.insts.back().PC + 4;
+    for (const Instruction &inst : decoded.insts) {
+        LaneOp op;
+        op.target = labels[inst.isHalt ? INSC_HALT : inst.isLegal ? inst.id : INSC_ILLEGAL];
+        op.PC = inst.PC;
+        op.imm = inst.imm;
+        op.instruction = inst.instruction;
+        op.rd = (inst.writesRd && inst.rd != 0) ? inst.rd : REG_SIZE;
+        op.rs1 = inst.rs1;
+        op.rs2 = inst.rs2;
+        block.ops.push_back(op);
+        if (inst.isHalt || !inst.isLegal) {
+            return block;
+        }
+        block.numInsts++;
+    }
+    if (!isControlFlow(decoded.insts.back())) {
+        LaneOp op;
+        op.target = labels[INSC_FALLTHROUGH];
+        op.PC = block.endPC;
+        block.ops.push_back(op);
+    }
+    return block;
+}
+
+// Whether v has the same value in every lane of mask
+static inline bool uniform(const LaneVec &v, const LaneVec &mask, unsigned bits) {
+    LaneVec differ = (v ^ v[__builtin_ctz(bits)]) & mask;
+    uint64_t any = 0;
+    for (int i = 0; i < LANE_WIDTH; i++) {
+        any |= differ[i];
+    }
+    return any == 0;
+}
+
+// The block PC leads to from the one the gang ran last, through from's
+// links when they already point there
+static LaneBlock &chainLaneBlock(Simulator &code, LaneBlocks &blocks, LaneBlock &from, uint64_t PC,
+                                 const void *const *labels) {
+    LaneBlock *&link = PC == from.endPC ? from.notTaken : from.taken;
+    if (!link || link->startPC != PC) {
+        link = &laneBlock(code, blocks, PC, labels);
+    }
+    return *link;
+}
+
+static void laneCodeWritten(void *arg) {
+    *(bool*)arg = true;
+}
+
+// Mark the block's words as code in the memories of the lanes in bits, so
+// the stores they make to them are noticed. Returns the lanes whose memory
+// already holds other words there than the block was translated from.
+static unsigned markLaneBlock(const LaneBlock &block, LaneGang &gang, unsigned bits) {
+    unsigned differ = 0;
+    for (unsigned b = bits; b; b &= b - 1) {
+        int i = __builtin_ctz(b);
+        gang.mems[i]->markCode(block.startPC, block.endPC - block.startPC);
+        for (const LaneOp &op : block.ops) {
+            uint64_t word;
+            if (op.PC >= block.endPC) {
+                break; // the fallthrough op
+            }
+            gang.mems[i]->getMemValue(op.PC, word, WORD_SIZE);
+            if ((uint32_t)word != op.instruction) {
+                differ |= 1u << i;
+                break;
+            }
+        }
+    }
+    return differ;
+}
+
+// Take lane i out of the gang, with its registers
+static void leaveGang(LaneGang &gang, int i, SimStatus status) {
+    Lane &lane = *gang.lanes[i];
+    lane.status = status;
+    for (int r = 0; r < REG_SIZE; r++) {
+        lane.regs.registers[r] = gang.regs[r][i];
+    }
+    gang.live[i] = 0;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // labels as values
+
+// Run a gang until every lane has halted, hit an illegal instruction or
+// used up maxInsts. Each round the lanes at the lowest PC run one block
+// together; lanes a branch sent further ahead wait there until the others
+// catch up, which is where a gang reconverges after an if or a loop.
+// Blocks run as LaneOps, one indirect jump per instruction as in
+// simThreaded, and find their successors through their links. While every
+// running lane is in the round, results are written without blending in
+// rd's old value, which the lanes that stopped took with them. Loads and
+// stores still go lane by lane, each lane having its own memory, but only
+// to the lanes in the round and straight through PagedMemory's TLB.
+// Blocks come from the original code, so a lane whose memory holds other
+// words where a block is about to run, or that stored to a block's words,
+// leaves the gang at the start or end of that block.
+static void runGang(Simulator &code, LaneBlocks &blocks, LaneGang &gang, uint64_t maxInsts) {
+    static const void *const labels[NUM_INSC] = {
+        &&do_illegal, &&do_halt, &&do_fallthrough,
+        &&do_add, &&do_addw, &&do_addi, &&do_addiw, &&do_and, &&do_andi,
+        &&do_auipc, &&do_beq, &&do_bge, &&do_bgeu, &&do_blt, &&do_bltu,
+        &&do_bne, &&do_jal, &&do_jalr, &&do_lb, &&do_lbu, &&do_ld, &&do_lh,
+        &&do_lhu, &&do_lui, &&do_lw, &&do_lwu, &&do_or, &&do_ori, &&do_sb,
+        &&do_sd, &&do_sh, &&do_sll, &&do_sllw, &&do_slli, &&do_slliw, &&do_slt,
+        &&do_slti, &&do_sltiu, &&do_sltu, &&do_sra, &&do_sraw, &&do_srai,
+        &&do_sraiw, &&do_srl, &&do_srlw, &&do_srli, &&do_srliw, &&do_sub,
+        &&do_subw, &&do_sw, &&do_xor, &&do_xori,
+        // pairs and traces are the threaded engine's own
+        &&do_illegal, &&do_illegal, &&do_illegal, &&do_illegal,
+        &&do_illegal, &&do_illegal, &&do_illegal, &&do_illegal,
+        &&do_illegal, &&do_illegal,
+        &&do_illegal, &&do_illegal
+    };
+
+    LaneVec *R = gang.regs;
+    unsigned liveBits = laneBits(gang.live);
+    LaneBlock *block = nullptr;
+    LaneBlock partial;
+    const LaneOp *op;
+    LaneVec mask, next, waiting;
+    unsigned bits;
+    bool converged;
+    uint64_t PC, executed;
+    SimStatus status;
+
+next_round:
+    if (!liveBits) {
+        return;
+    }
+    waiting = gang.pc | ~gang.live; // lanes that stopped never lead
+    PC = waiting[0];
+    for (int i = 1; i < LANE_WIDTH; i++) {
+        PC = min<uint64_t>(PC, waiting[i]);
+    }
+    mask = gang.live & (LaneVec)(gang.pc == PC);
+    bits = laneBits(mask);
+    converged = bits == liveBits;
+
+run_block:
+    block = block ? &chainLaneBlock(code, blocks, *block, PC, labels) : &laneBlock(code, blocks, PC, labels);
+    if (block->gang != gang.id) {
+        block->gang = gang.id;
+        unsigned differ = markLaneBlock(*block, gang, liveBits);
+        for (unsigned b = differ; b; b &= b - 1) {
+            leaveGang(gang, __builtin_ctz(b), SIM_RUNNING);
+        }
+        liveBits &= ~differ;
+        bits &= ~differ;
+        mask = gang.live & (LaneVec)(gang.pc == PC);
+        if (!bits) {
+            goto next_round;
+        }
+    }
+    executed = block->numInsts;
+    op = block->ops.data();
+
+    // lanes never run more than the gang, so a lane can only reach maxInsts
+    // inside the block once the gang is that far; then the block is cut
+    // where the first of them does
+    if (gang.steps + executed > maxInsts) {
+        uint64_t budget = executed;
+        for (unsigned b = bits; b; b &= b - 1) {
+            budget = min<uint64_t>(budget, maxInsts - gang.instructions[__builtin_ctz(b)]);
+        }
+        if (budget < executed) {
+            partial.ops.assign(block->ops.begin(), block->ops.begin() + budget);
+            LaneOp stop;
+            stop.target = labels[INSC_FALLTHROUGH];
+            stop.PC = block->ops[budget].PC;
+            partial.ops.push_back(stop);
+            executed = budget;
+            op = partial.ops.data();
+        }
+    }
+    status = SIM_RUNNING;
+    goto *op->target;
+
+block_done:
+    gang.pc = blend(mask, next, gang.pc);
+    gang.steps += executed;
+    gang.instructions += splat(executed) & mask;
+    if (status != SIM_RUNNING || gang.steps >= maxInsts || gang.codeWritten) {
+        for (unsigned b = bits; b; b &= b - 1) {
+            int i = __builtin_ctz(b);
+            if (status != SIM_RUNNING || gang.instructions[i] == maxInsts || gang.mems[i]->codeWritten()) {
+                leaveGang(gang, i, status);
+                liveBits &= ~(1u << i);
+            }
+        }
+        gang.codeWritten = false;
+    }
+    // a gang that stays together goes on to its next block without looking
+    // for the lowest PC
+    if (bits == liveBits && uniform(next, mask, bits)) {
+        PC = next[__builtin_ctz(bits)];
+        converged = true;
+        goto run_block;
+    }
+    goto next_round;
+
+#define NEXT() op++; goto *op->target
+#define RS1 R[op->rs1]
+#define RS2 R[op->rs2]
+#define IMM splat(op->imm)
+
+// The result goes to the lanes in the round, the others keep rd
+#define VALUE_OP(result)                                    \
+    if (converged) {                                        \
+        R[op->rd] = result;                                 \
+    } else {                                                \
+        R[op->rd] = blend(mask, result, R[op->rd]);         \
+    }                                                       \
+    NEXT()
+
+#define BRANCH_OP(taken)                                    \
+    next = blend((LaneVec)(taken), splat(op->PC + op->imm), splat(op->PC + 4)); \
+    goto block_done
+
+#define LOAD_OP(size, type)                                 \
+    for (unsigned b = bits; b; b &= b - 1) {                \
+        int i = __builtin_ctz(b);                           \
+        uint64_t value;                                     \
+        gang.mems[i]->getMemValue(R[op->rs1][i] + op->imm, value, size); \
+        R[op->rd][i] = (type)value;                         \
+    }                                                       \
+    NEXT()
+
+#define STORE_OP(size)                                      \
+    for (unsigned b = bits; b; b &= b - 1) {                \
+        int i = __builtin_ctz(b);                           \
+        gang.mems[i]->setMemValue(R[op->rs1][i] + op->imm, R[op->rs2][i], size); \
+    }                                                       \
+    NEXT()
+
+do_add:    VALUE_OP(RS1 + RS2);
+do_addw:   VALUE_OP(sext32(RS1 + RS2));
+do_addi:   VALUE_OP(RS1 + IMM);
+do_addiw:  VALUE_OP(sext32(RS1 + IMM));
+do_sub:    VALUE_OP(RS1 - RS2);
+do_subw:   VALUE_OP(sext32(RS1 - RS2));
+do_and:    VALUE_OP(RS1 & RS2);
+do_andi:   VALUE_OP(RS1 & IMM);
+do_or:     VALUE_OP(RS1 | RS2);
+do_ori:    VALUE_OP(RS1 | IMM);
+do_xor:    VALUE_OP(RS1 ^ RS2);
+do_xori:   VALUE_OP(RS1 ^ IMM);
+do_sll:    VALUE_OP(RS1 << (RS2 & 0x3f));
+do_slli:   VALUE_OP(RS1 << (op->imm & 0x3f));
+do_sllw:   VALUE_OP(sext32(RS1 << (RS2 & 0x1f)));
+do_slliw:  VALUE_OP(sext32(RS1 << (op->imm & 0x1f)));
+do_srl:    VALUE_OP(RS1 >> (RS2 & 0x3f));
+do_srli:   VALUE_OP(RS1 >> (op->imm & 0x3f));
+do_srlw:   VALUE_OP(sext32((RS1 & 0xffffffffULL) >> (RS2 & 0x1f)));
+do_srliw:  VALUE_OP(sext32((RS1 & 0xffffffffULL) >> (op->imm & 0x1f)));
+do_sra:    VALUE_OP((LaneVec)((LaneSVec)RS1 >> (LaneSVec)(RS2 & 0x3f)));
+do_srai:   VALUE_OP((LaneVec)((LaneSVec)RS1 >> (int64_t)(op->imm & 0x3f)));
+do_sraw:   VALUE_OP((LaneVec)((LaneSVec)sext32(RS1) >> (LaneSVec)(RS2 & 0x1f)));
+do_sraiw:  VALUE_OP((LaneVec)((LaneSVec)sext32(RS1) >> (int64_t)(op->imm & 0x1f)));
+do_slt:    VALUE_OP((LaneVec)((LaneSVec)RS1 < (LaneSVec)RS2) & 1);
+do_slti:   VALUE_OP((LaneVec)((LaneSVec)RS1 < (LaneSVec)IMM) & 1);
+do_sltu:   VALUE_OP((LaneVec)(RS1 < RS2) & 1);
+do_sltiu:  VALUE_OP((LaneVec)(RS1 < IMM) & 1);
+do_lui:    VALUE_OP(IMM);
+do_auipc:  VALUE_OP(splat(op->PC + op->imm));
+
+do_lb:     LOAD_OP(BYTE_SIZE, int8_t);
+do_lbu:    LOAD_OP(BYTE_SIZE, uint8_t);
+do_lh:     LOAD_OP(HALF_SIZE, int16_t);
+do_lhu:    LOAD_OP(HALF_SIZE, uint16_t);
+do_lw:     LOAD_OP(WORD_SIZE, int32_t);
+do_lwu:    LOAD_OP(WORD_SIZE, uint32_t);
+do_ld:     LOAD_OP(DOUBLE_SIZE, uint64_t);
+do_sb:     STORE_OP(BYTE_SIZE);
+do_sh:     STORE_OP(HALF_SIZE);
+do_sw:     STORE_OP(WORD_SIZE);
+do_sd:     STORE_OP(DOUBLE_SIZE);
+
+do_beq:    BRANCH_OP(RS1 == RS2);
+do_bne:    BRANCH_OP(RS1 != RS2);
+do_blt:    BRANCH_OP((LaneSVec)RS1 < (LaneSVec)RS2);
+do_bge:    BRANCH_OP((LaneSVec)RS1 >= (LaneSVec)RS2);
+do_bltu:   BRANCH_OP(RS1 < RS2);
+do_bgeu:   BRANCH_OP(RS1 >= RS2);
+
+do_jal:
+    R[op->rd] = blend(mask, splat(op->PC + 4), R[op->rd]);
+    next = splat(op->PC + op->imm);
+    goto block_done;
+
+do_jalr:
+    next = (RS1 + op->imm) & ~1ULL; // before rd, which may be rs1
+    R[op->rd] = blend(mask, splat(op->PC + 4), R[op->rd]);
+    goto block_done;
+
+do_fallthrough:
+    next = splat(op->PC);
+    goto block_done;
+
+do_halt:
+    status = SIM_HALT;
+    next = splat(op->PC);
+    goto block_done;
+
+do_illegal:
+    status = SIM_ILLEGAL;
+    next = splat(op->PC);
+    goto block_done;
+
+#undef NEXT
+#undef RS1
+#undef RS2
+#undef IMM
+#undef VALUE_OP
+#undef BRANCH_OP
+#undef LOAD_OP
+#undef STORE_OP
+}
+
+#pragma GCC diagnostic pop
+
+static bool readInputs(const char *inputsFile, vector<Lane> &lanes) {
+    ifstream inputs(inputsFile);
+    if (!inputs.is_open()) {
+        fprintf(stderr, "\tError open inputs %s\n", inputsFile);
+        return false;
+    }
+
+    string line;
+    while (getline(inputs, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+
+        Lane lane;
+        istringstream values(line);
+        string value;
+        while (values >> value) {
+            char *end;
+            lane.inputs.push_back(strtoull(value.c_str(), &end, 0));
+            if (*end || lane.inputs.size() > 8) {
+                fprintf(stderr, "\tBad input line %zu in %s: %s\n", lanes.size() + 1, inputsFile, line.c_str());
+                return false;
+            }
+        }
+        lanes.push_back(lane);
+    }
+    return true;
+}
+
+int runLanes(const char *programFile, const char *inputsFile, uint64_t maxInsts) {
+    vector<Lane> lanes;
+    if (!readInputs(inputsFile, lanes)) {
+        return -1;
+    }
+
+    // blocks are decoded and translated once from here for every gang
+    Simulator code;
+    LaneBlocks blocks;
+    if (!code.load(programFile)) {
+        fprintf(stderr, "%s: failed to load\n", programFile);
+        return -1;
+    }
+
+    string prefix = inputsFile;
+    size_t dot = prefix.find_last_of('.');
+    size_t slash = prefix.find_last_of('/');
+    if (dot != string::npos && (slash == string::npos || dot > slash)) {
+        prefix.resize(dot);
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint64_t steps = 0;
+    size_t alone = 0;
+    for (size_t first = 0; first < lanes.size(); first += LANE_WIDTH) {
+        LaneGang gang = {};
+        gang.id = first / LANE_WIDTH + 1;
+        for (int i = 0; i < LANE_WIDTH; i++) {
+            Lane &lane = lanes[min(first + i, lanes.size() - 1)];
+            gang.lanes[i] = &lane;
+            if (first + i >= lanes.size()) {
+                continue;
+            }
+
+            // memories only live as long as their gang
+            uint64_t entryPC;
+            lane.mem = new PagedMemory();
+            if (!initMemory(programFile, lane.mem, entryPC)) {
+                fprintf(stderr, "%s: failed to load\n", programFile);
+                for (int j = 0; j <= i; j++) {
+                    delete lanes[first + j].mem;
+                    lanes[first + j].mem = nullptr;
+                }
+                return -1;
+            }
+            lane.mem->setCodeWriteHook(laneCodeWritten, &gang.codeWritten);
+            gang.mems[i] = lane.mem;
+            gang.pc[i] = entryPC;
+            gang.live[i] = ~0ULL;
+            for (size_t arg = 0; arg < lane.inputs.size(); arg++) {
+                gang.regs[10 + arg][i] = lane.inputs[arg];
+            }
+        }
+
+        runGang(code, blocks, gang, maxInsts);
+        steps += gang.steps;
+
+        for (int i = 0; i < LANE_WIDTH && first + i < lanes.size(); i++) {
+            Lane &lane = lanes[first + i];
+            lane.instructions = gang.instructions[i];
+            lane.mem->setCodeWriteHook(nullptr, nullptr);
+            uint64_t PC = gang.pc[i];
+
+            // the rest of a lane whose code changed runs on its own, from
+            // its memory, which is lent to the Simulator meanwhile
+            if (lane.status == SIM_RUNNING && lane.instructions < maxInsts) {
+                Simulator solo;
+                swap(solo.myMem, lane.mem);
+                solo.regData = lane.regs;
+                solo.PC = PC;
+                lane.status = solo.step(maxInsts - lane.instructions);
+                lane.instructions += solo.stats.instructions;
+                lane.regs = solo.regData;
+                PC = solo.PC;
+                swap(solo.myMem, lane.mem);
+                alone++;
+            }
+
+            if (lane.status == SIM_ILLEGAL) {
+                fprintf(stderr, "lane %zu: illegal instruction encountered at PC: 0x%lx\n", first + i, PC);
+            } else if (lane.status == SIM_RUNNING) {
+                fprintf(stderr, "lane %zu: instruction limit reached at PC: 0x%lx\n", first + i, PC);
+            }
+
+            string outputPrefix = prefix + "." + to_string(first + i);
+            FILE *regOut = fopen((outputPrefix + ".reg_state.out").c_str(), "w");
+            FILE *memOut = fopen((outputPrefix + ".mem_state.out").c_str(), "w");
+            if (regOut) {
+                writeRegisterState(regOut, lane.regs);
+                fclose(regOut);
+            }
+            if (memOut) {
+                writeMemoryState(memOut, lane.mem);
+                fclose(memOut);
+            }
+            if (!regOut || !memOut) {
+                fprintf(stderr, "lane %zu: cannot write %s.*_state.out\n", first + i, outputPrefix.c_str());
+            }
+            delete lane.mem;
+            lane.mem = nullptr;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t outcomes[SIM_LOOP + 1] = {0};
+    uint64_t instructions = 0;
+    for (const Lane &lane : lanes) {
+        outcomes[lane.status]++;
+        instructions += lane.instructions;
+    }
+
+    size_t gangs = (lanes.size() + LANE_WIDTH - 1) / LANE_WIDTH;
+    printf("Lanes: %zu lanes in %zu gangs of %d: %zu halted, %zu illegal, %zu over the instruction limit\n",
+           lanes.size(), gangs, LANE_WIDTH, outcomes[SIM_HALT], outcomes[SIM_ILLEGAL], outcomes[SIM_RUNNING]);
+    printf("Lanes: %lu instructions in %.3f s, %.2f MIPS, %.1f lanes active per step\n",
+           instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0,
+           steps > 0 ? (double)instructions / steps : 0.0);
+    if (alone > 0) {
+        printf("Lanes: %zu lanes stored to their code and finished alone\n", alone);
+    }
+
+    return outcomes[SIM_HALT] == lanes.size() ? 0 : 1;
+}
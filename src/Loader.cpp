@@ -0,0 +1,237 @@
+#include "sim.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Program loading
+// --------------------------------------------------------------------------
+
+// A program is either a RISC-V ELF file or a flat binary of instructions
+// loaded at address 0. Either way the file is mapped rather than read, and
+// guest memory is filled a page at a time.
+
+static bool loadError(const char *programFile, const char *reason) {
+    fprintf(stderr, "\t%s: %s\n", programFile, reason);
+    return false;
+}
+
+static bool inFile(uint64_t offset, uint64_t size, size_t length) {
+    return offset <= length && size <= length - offset;
+}
+
+// Place one PT_LOAD segment. Whole pages of a read-only segment are mapped
+// straight from the file; partial pages at either end and writable
+// segments are copied. The rest of the segment, up to p_memsz, stays zero.
+static bool loadSegment(int fd, const uint8_t *image, const Elf64_Phdr &ph, PagedMemory *myMem) {
+    uint64_t start = ph.p_vaddr;
+    uint64_t end = start + ph.p_filesz;
+    const uint8_t *src = image + ph.p_offset;
+
+    bool sameAlignment = (ph.p_vaddr & PAGE_OFFSET_MASK) == (ph.p_offset & PAGE_OFFSET_MASK);
+    if (!(ph.p_flags & PF_W) && sameAlignment) {
+        uint64_t mapStart = (start + PAGE_OFFSET_MASK) & ~PAGE_OFFSET_MASK;
+        uint64_t mapEnd = end & ~PAGE_OFFSET_MASK;
+        if (mapStart < mapEnd &&
+            myMem->mapFile(mapStart, fd, ph.p_offset + (mapStart - start), mapEnd - mapStart)) {
+            myMem->writeBytes(start, src, mapStart - start);
+            myMem->writeBytes(mapEnd, src + (mapEnd - start), end - mapEnd);
+            return true;
+        }
+    }
+
+    myMem->writeBytes(start, src, ph.p_filesz);
+    return true;
+}
+
+// Executables: every PT_LOAD segment at its virtual address, starting at
+// the entry point
+static bool loadExecutable(const char *programFile, int fd, const uint8_t *image, size_t length,
+                           PagedMemory *myMem, uint64_t &entryPC) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr*)image;
+    if (eh->e_phentsize != sizeof(Elf64_Phdr) ||
+        !inFile(eh->e_phoff, (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr), length)) {
+        return loadError(programFile, "bad program header table");
+    }
+
+    const Elf64_Phdr *phdrs = (const Elf64_Phdr*)(image + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum; i++) {
+        const Elf64_Phdr &ph = phdrs[i];
+        if (ph.p_type != PT_LOAD) {
+            continue;
+        }
+        if (!inFile(ph.p_offset, ph.p_filesz, length) || ph.p_filesz > ph.p_memsz) {
+            return loadError(programFile, "bad PT_LOAD segment");
+        }
+        loadSegment(fd, image, ph, myMem);
+    }
+
+    entryPC = eh->e_entry;
+    return true;
+}
+
+// The .text section header, nullptr (with an error printed) if the file
+// has none or its section headers are broken
+static const Elf64_Shdr *findText(const char *programFile, const uint8_t *image, size_t length) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr*)image;
+    if (eh->e_shentsize != sizeof(Elf64_Shdr) || eh->e_shstrndx >= eh->e_shnum ||
+        !inFile(eh->e_shoff, (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr), length)) {
+        loadError(programFile, "bad section header table");
+        return nullptr;
+    }
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr*)(image + eh->e_shoff);
+    const Elf64_Shdr &names = shdrs[eh->e_shstrndx];
+    if (!inFile(names.sh_offset, names.sh_size, length)) {
+        loadError(programFile, "bad section name table");
+        return nullptr;
+    }
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        const Elf64_Shdr &sh = shdrs[i];
+        if (sh.sh_name >= names.sh_size ||
+            strncmp((const char*)image + names.sh_offset + sh.sh_name, ".text", names.sh_size - sh.sh_name) != 0) {
+            continue;
+        }
+        if (sh.sh_type != SHT_PROGBITS || !inFile(sh.sh_offset, sh.sh_size, length)) {
+            loadError(programFile, "bad .text section");
+            return nullptr;
+        }
+        return &sh;
+    }
+    loadError(programFile, "no .text section");
+    return nullptr;
+}
+
+// Relocatable objects, as the assembler leaves them in test/: just .text,
+// at its section address, like the objcopy step that makes the .bin files
+static bool loadObject(const char *programFile, const uint8_t *image, size_t length,
+                       PagedMemory *myMem, uint64_t &entryPC) {
+    const Elf64_Shdr *text = findText(programFile, image, length);
+    if (!text) {
+        return false;
+    }
+    myMem->writeBytes(text->sh_addr, image + text->sh_offset, text->sh_size);
+    entryPC = ((const Elf64_Ehdr*)image)->e_entry;
+    return true;
+}
+
+static bool isElf(const uint8_t *image, size_t length) {
+    return length >= SELFMAG && memcmp(image, ELFMAG, SELFMAG) == 0;
+}
+
+static bool checkElf(const char *programFile, const uint8_t *image, size_t length) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr*)image;
+    if (length < sizeof(Elf64_Ehdr) || image[EI_CLASS] != ELFCLASS64 ||
+        image[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_RISCV) {
+        return loadError(programFile, "not a 64-bit little-endian RISC-V ELF file");
+    }
+    return true;
+}
+
+static bool loadElf(const char *programFile, int fd, const uint8_t *image, size_t length,
+                    PagedMemory *myMem, uint64_t &entryPC) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr*)image;
+    if (!checkElf(programFile, image, length)) {
+        return false;
+    }
+
+    switch (eh->e_type) {
+        case ET_EXEC:
+        case ET_DYN: return loadExecutable(programFile, fd, image, length, myMem, entryPC);
+        case ET_REL: return loadObject(programFile, image, length, myMem, entryPC);
+        default:     return loadError(programFile, "unsupported ELF file type");
+    }
+}
+
+// A program file mapped read-only. image is nullptr for an empty file.
+struct ProgramImage {
+    int fd = -1;
+    const uint8_t *image = nullptr;
+    size_t length = 0;
+};
+
+static bool openProgram(const char *programFile, ProgramImage &program) {
+    program.fd = open(programFile, O_RDONLY);
+    if (program.fd < 0) {
+        fprintf(stderr, "\tError open input file\n");
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(program.fd, &info) != 0) {
+        close(program.fd);
+        return loadError(programFile, "cannot stat file");
+    }
+
+    program.length = info.st_size;
+    if (program.length == 0) {
+        return true;
+    }
+
+    void *mapped = mmap(nullptr, program.length, PROT_READ, MAP_PRIVATE, program.fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(program.fd);
+        return loadError(programFile, "cannot map file");
+    }
+    program.image = (const uint8_t*)mapped;
+    return true;
+}
+
+static void closeProgram(ProgramImage &program) {
+    if (program.image) {
+        munmap((void*)program.image, program.length);
+    }
+    close(program.fd);
+}
+
+// initialize memory with the program and set the PC it starts at
+bool initMemory(const char *programFile, PagedMemory *myMem, uint64_t &entryPC) {
+    ProgramImage program;
+    if (!openProgram(programFile, program)) {
+        return false;
+    }
+
+    entryPC = 0;
+    bool ok = true;
+    if (isElf(program.image, program.length)) {
+        ok = loadElf(programFile, program.fd, program.image, program.length, myMem, entryPC);
+    } else if (program.image) {
+        myMem->writeBytes(0, program.image, program.length);
+    }
+
+    // segment mappings made by mapFile outlive these
+    closeProgram(program);
+    return ok;
+}
+
+// Address range of a program's code: the .text section of an ELF file, or
+// all of a flat binary
+bool findCode(const char *programFile, uint64_t &start, uint64_t &end) {
+    ProgramImage program;
+    if (!openProgram(programFile, program)) {
+        return false;
+    }
+
+    bool ok = true;
+    start = end = 0;
+    if (isElf(program.image, program.length)) {
+        const Elf64_Shdr *text = nullptr;
+        ok = checkElf(programFile, program.image, program.length) &&
+             (text = findText(programFile, program.image, program.length)) != nullptr;
+        if (ok) {
+            start = text->sh_addr;
+            end = text->sh_addr + text->sh_size;
+        }
+    } else {
+        end = program.length;
+    }
+
+    closeProgram(program);
+    return ok;
+}
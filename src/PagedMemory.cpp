@@ -0,0 +1,546 @@
+#include "sim.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+// Every untouched page reads as this one
+alignas(PAGE_SIZE) static const uint8_t zeroPage[PAGE_SIZE] = {0};
+
+static void **newTable() {
+    void **table = (void**)calloc(PAGE_TABLE_ENTRIES, sizeof(void*));
+    if (!table) {
+        fprintf(stderr, "Out of memory allocating a page table\n");
+        exit(-1);
+    }
+    return table;
+}
+
+// Index into the page table at the given level for a page number
+static inline uint64_t levelIndex(uint64_t vpn, int level) {
+    return (vpn >> ((PAGE_LEVELS - 1 - level) * PAGE_LEVEL_BITS)) & (PAGE_TABLE_ENTRIES - 1);
+}
+
+// Host address of the page in a leaf entry
+static inline uint8_t *leafPage(void *leaf) {
+    return (uint8_t*)((uintptr_t)leaf & ~(uintptr_t)PAGE_FLAGS);
+}
+
+static uint8_t *allocPage(uint64_t vpn) {
+    uint8_t *page = (uint8_t*)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (!page) {
+        fprintf(stderr, "Out of memory allocating guest page 0x%lx\n", vpn << PAGE_BITS);
+        exit(-1);
+    }
+    return page;
+}
+
+// Pages held by more than one memory or checkpoint, with their number of
+// holders. A page not in here has a single holder, even if its leaf entry
+// still says PAGE_SHARED. Checkpoints may be taken and dropped on any
+// thread, hence the lock.
+static mutex sharedLock;
+static unordered_map<uint8_t*, uint32_t> sharedRefs;
+
+// One more holder, the caller has sharedLock
+static void addRef(uint8_t *host) {
+    auto found = sharedRefs.find(host);
+    if (found == sharedRefs.end()) {
+        sharedRefs[host] = 2;
+    } else {
+        found->second++;
+    }
+}
+
+// One holder less. Returns whether that was the last one.
+static bool dropRef(uint8_t *host, bool shared) {
+    if (!shared) {
+        return true;
+    }
+    lock_guard<mutex> guard(sharedLock);
+    auto found = sharedRefs.find(host);
+    if (found == sharedRefs.end()) {
+        return true;
+    }
+    if (--found->second == 1) {
+        sharedRefs.erase(found);
+    }
+    return false;
+}
+
+static void releasePage(uint8_t *host, bool shared, bool mapped) {
+    if (dropRef(host, shared) && !mapped) {
+        free(host);
+    }
+}
+
+static void freeTable(void **table, int level) {
+    for (int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        if (!table[i]) continue;
+        if (level == PAGE_LEVELS - 1) {
+            uintptr_t leaf = (uintptr_t)table[i];
+            releasePage(leafPage(table[i]), leaf & PAGE_SHARED, leaf & PAGE_MAPPED);
+        } else {
+            freeTable((void**)table[i], level + 1);
+        }
+    }
+    free(table);
+}
+
+// Call visit(vpn, leaf) for every present page in page number order
+template <class Visit>
+static void forEachLeaf(void **table, int level, uint64_t prefix, Visit &visit) {
+    for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        if (!table[i]) continue;
+        uint64_t vpn = (prefix << PAGE_LEVEL_BITS) | i;
+        if (level == PAGE_LEVELS - 1) {
+            visit(vpn, table[i]);
+        } else {
+            forEachLeaf((void**)table[i], level + 1, vpn, visit);
+        }
+    }
+}
+
+void MemCheckpoint::clear() {
+    for (Page &page : pages) {
+        releasePage(page.host, true, page.mapped);
+    }
+    pages.clear();
+    mappings.clear();
+}
+
+PagedMemory::PagedMemory() : root(newTable()) {
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        tlb.read[i] = {~0ULL, nullptr};
+        tlb.write[i] = {~0ULL, nullptr};
+    }
+}
+
+PagedMemory::~PagedMemory() {
+    freeTable(root, 0);
+    for (SavedPage &saved : savedPages) {
+        free(saved.copy);
+    }
+    for (uint8_t *copy : spareCopies) {
+        free(copy);
+    }
+}
+
+// TLB miss on a read: find the page if it exists, otherwise read zeros
+const uint8_t *PagedMemory::walkForRead(uint64_t vpn) {
+    void **table = root;
+    for (int level = 0; level < PAGE_LEVELS - 1 && table; level++) {
+        table = (void**)table[levelIndex(vpn, level)];
+    }
+
+    const uint8_t *page = table ? leafPage(table[levelIndex(vpn, PAGE_LEVELS - 1)]) : nullptr;
+    if (!page) {
+        page = zeroPage;
+    }
+
+    tlb.read[vpn % TLB_ENTRIES] = {vpn, (uint8_t*)page};
+    return page;
+}
+
+// Leaf entry for a page, allocating any missing tables on the way down
+void *&PagedMemory::leafEntry(uint64_t vpn) {
+    void **table = root;
+    for (int level = 0; level < PAGE_LEVELS - 1; level++) {
+        void *&next = table[levelIndex(vpn, level)];
+        if (!next) {
+            next = newTable();
+        }
+        table = (void**)next;
+    }
+    return table[levelIndex(vpn, PAGE_LEVELS - 1)];
+}
+
+void *PagedMemory::newPage(uint64_t vpn) {
+    uint8_t *page = allocPage(vpn);
+    memset(page, 0, PAGE_SIZE);
+    numPages++;
+    return page;
+}
+
+// Make the page in a leaf entry this memory's own before a store to it,
+// copying it if a checkpoint still holds it
+uint8_t *PagedMemory::ownPage(uint64_t vpn, void *&page) {
+    uintptr_t leaf = (uintptr_t)page;
+    uint8_t *host = leafPage(page);
+    if (!(leaf & PAGE_SHARED)) {
+        return host;
+    }
+
+    if (dropRef(host, true)) {
+        page = (void*)(leaf & ~(uintptr_t)PAGE_SHARED);
+        return host;
+    }
+    uint8_t *copy = allocPage(vpn);
+    memcpy(copy, host, PAGE_SIZE);
+    page = (void*)((uintptr_t)copy | (leaf & (PAGE_CODE | PAGE_SAVED)));
+    if (tlb.read[vpn % TLB_ENTRIES].tag == vpn) {
+        tlb.read[vpn % TLB_ENTRIES].page = copy;
+    }
+    return copy;
+}
+
+// TLB miss on a write: find the page, allocating it if needed
+uint8_t *PagedMemory::walkForWrite(uint64_t address, uint64_t length) {
+    uint64_t vpn = address >> PAGE_BITS;
+    storeSeen = true;
+    void *&page = leafEntry(vpn);
+    bool existed = page != nullptr;
+    if (!existed) {
+        page = newPage(vpn);
+    }
+    if (tracking && !((uintptr_t)page & PAGE_SAVED)) {
+        savePage(vpn, page, existed);
+    }
+
+    // the read TLB may still map this page to the zero page
+    uint8_t *host = ownPage(vpn, page);
+    tlb.read[vpn % TLB_ENTRIES] = {vpn, host};
+
+    // a page with code in it gets into the write TLB through its word map,
+    // until the last of its marked words is overwritten
+    TlbEntry &entry = tlb.write[vpn % TLB_ENTRIES];
+    if ((uintptr_t)page & PAGE_CODE) {
+        if (storeHitsCode(address, length)) {
+            codeWrites.push_back(address);
+            if (codeWriteHook) {
+                codeWriteHook(codeWriteArg);
+            }
+        }
+        auto found = codeMaps.find(vpn);
+        if (found != codeMaps.end()) {
+            found->second.host = host;
+            entry.tag = vpn | TLB_CODE;
+            entry.code = &found->second;
+            return host;
+        }
+        page = (void*)((uintptr_t)page & ~(uintptr_t)PAGE_CODE);
+    }
+    entry = {vpn, host};
+    return host;
+}
+
+// Unmark the words of a code page the store overlaps, dropping the page's
+// map once it is empty. Returns whether any of them was marked.
+bool PagedMemory::storeHitsCode(uint64_t address, uint64_t length) {
+    auto found = codeMaps.find(address >> PAGE_BITS);
+    if (found == codeMaps.end()) {
+        return false;
+    }
+    CodeMap &map = found->second;
+
+    uint64_t offset = address & PAGE_OFFSET_MASK;
+    uint64_t last = min<uint64_t>(offset + length, PAGE_SIZE) - 1;
+    bool hit = false;
+    for (uint64_t word = offset / 4; word <= last / 4; word++) {
+        uint64_t bit = 1ULL << (word % 64);
+        if (map.words[word / 64] & bit) {
+            map.words[word / 64] &= ~bit;
+            hit = true;
+        }
+    }
+
+    if (hit) {
+        bool empty = true;
+        for (uint64_t bits : map.words) {
+            empty = empty && !bits;
+        }
+        if (empty) {
+            codeMaps.erase(found);
+        }
+    }
+    return hit;
+}
+
+// First store to a page since the snapshot: keep what it held
+void PagedMemory::savePage(uint64_t vpn, void *&page, bool existed) {
+    uint8_t *copy = nullptr;
+    if (existed) {
+        if (!spareCopies.empty()) {
+            copy = spareCopies.back();
+            spareCopies.pop_back();
+        } else if (!(copy = (uint8_t*)malloc(PAGE_SIZE))) {
+            fprintf(stderr, "Out of memory saving guest page 0x%lx\n", vpn << PAGE_BITS);
+            exit(-1);
+        }
+        memcpy(copy, leafPage(page), PAGE_SIZE);
+    }
+    savedPages.push_back({vpn, copy});
+    page = (void*)((uintptr_t)page | PAGE_SAVED);
+}
+
+void PagedMemory::snapshot() {
+    for (SavedPage &saved : savedPages) {
+        void *&page = leafEntry(saved.vpn);
+        page = (void*)((uintptr_t)page & ~(uintptr_t)PAGE_SAVED);
+        if (saved.copy) {
+            spareCopies.push_back(saved.copy);
+        }
+    }
+    savedPages.clear();
+    tracking = true;
+    watchStores();
+}
+
+void PagedMemory::restore() {
+    // pages that appeared since the snapshot are zeroed rather than freed,
+    // they read the same and the next run is likely to want them again.
+    // A page restoreCheckpoint dropped and a store brought back is listed
+    // twice, so the oldest copy goes last.
+    for (auto saved = savedPages.rbegin(); saved != savedPages.rend(); ++saved) {
+        void *&page = leafEntry(saved->vpn);
+        if (!page) {
+            page = newPage(saved->vpn);
+        }
+        uint8_t *host = ownPage(saved->vpn, page);
+        if (saved->copy) {
+            memcpy(host, saved->copy, PAGE_SIZE);
+            spareCopies.push_back(saved->copy);
+        } else {
+            memset(host, 0, PAGE_SIZE);
+        }
+        page = (void*)((uintptr_t)page & ~(uintptr_t)PAGE_SAVED);
+        tlb.read[saved->vpn % TLB_ENTRIES] = {saved->vpn, host};
+    }
+    savedPages.clear();
+    watchStores();
+}
+
+void PagedMemory::checkpoint(MemCheckpoint &cp) {
+    cp.clear();
+    {
+        lock_guard<mutex> guard(sharedLock);
+        auto share = [&](uint64_t vpn, void *&page) {
+            uintptr_t leaf = (uintptr_t)page;
+            addRef(leafPage(page));
+            cp.pages.push_back({vpn, leafPage(page), (leaf & PAGE_MAPPED) != 0});
+            page = (void*)(leaf | PAGE_SHARED);
+        };
+        forEachLeaf(root, 0, 0, share);
+    }
+    cp.mappings = mappings;
+    // the shared pages must be copied before they are stored to, but
+    // stores made before the checkpoint still count for the watch
+    flushWriteTlb();
+}
+
+bool PagedMemory::restoreCheckpoint(const MemCheckpoint &cp) {
+    // both lists are in page number order, so one merge finds the pages
+    // that are the same, the ones to replace and the ones to drop
+    vector<pair<uint64_t, void**>> present;
+    auto collect = [&](uint64_t vpn, void *&page) {
+        present.push_back({vpn, &page});
+    };
+    forEachLeaf(root, 0, 0, collect);
+
+    bool codeChanged = false;
+    auto dropPage = [&](uint64_t vpn, void *&page) {
+        if (tracking && !((uintptr_t)page & PAGE_SAVED)) {
+            savePage(vpn, page, true);
+        }
+        uintptr_t leaf = (uintptr_t)page;
+        codeChanged = codeChanged || (leaf & PAGE_CODE);
+        releasePage(leafPage(page), leaf & PAGE_SHARED, leaf & PAGE_MAPPED);
+        page = nullptr;
+        numPages--;
+    };
+
+    size_t next = 0;
+    for (const MemCheckpoint::Page &saved : cp.pages) {
+        for (; next < present.size() && present[next].first < saved.vpn; next++) {
+            dropPage(present[next].first, *present[next].second);
+        }
+        uintptr_t keep = 0;
+        if (next < present.size() && present[next].first == saved.vpn) {
+            void *&page = *present[next++].second;
+            if (leafPage(page) == saved.host) {
+                continue;
+            }
+            dropPage(saved.vpn, page);
+            keep = tracking ? PAGE_SAVED : 0;
+        } else if (tracking) {
+            // not there at all, restore() is to zero it
+            savedPages.push_back({saved.vpn, nullptr});
+            keep = PAGE_SAVED;
+        }
+
+        void *&page = leafEntry(saved.vpn);
+        {
+            lock_guard<mutex> guard(sharedLock);
+            addRef(saved.host);
+        }
+        page = (void*)((uintptr_t)saved.host | PAGE_SHARED | (saved.mapped ? PAGE_MAPPED : 0) | keep);
+        numPages++;
+    }
+    for (; next < present.size(); next++) {
+        dropPage(present[next].first, *present[next].second);
+    }
+
+    for (const shared_ptr<void> &mapping : cp.mappings) {
+        if (find(mappings.begin(), mappings.end(), mapping) == mappings.end()) {
+            mappings.push_back(mapping);
+        }
+    }
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        tlb.read[i].tag = ~0ULL;
+    }
+    watchStores();
+    return codeChanged;
+}
+
+void PagedMemory::watchStores() {
+    flushWriteTlb();
+    storeSeen = false;
+}
+
+void PagedMemory::flushWriteTlb() {
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        tlb.write[i].tag = ~0ULL;
+    }
+}
+
+void PagedMemory::markCode(uint64_t address, uint64_t length) {
+    uint64_t end = address + length;
+    while (address < end) {
+        uint64_t vpn = address >> PAGE_BITS;
+        uint64_t offset = address & PAGE_OFFSET_MASK;
+        uint64_t last = min<uint64_t>(end - address + offset, PAGE_SIZE) - 1;
+
+        void *&page = leafEntry(vpn);
+        // only a page stored to or replaced since the snapshot can hold
+        // other words than it did then; restoreCheckpoint may have dropped
+        // one that was there
+        bool touched = tracking && (!page || ((uintptr_t)page & PAGE_SAVED));
+        if (!page) {
+            // the flag needs a leaf to live in, so code on an untouched
+            // page gets the page allocated
+            page = newPage(vpn);
+        }
+        page = (void*)((uintptr_t)page | PAGE_CODE);
+        if (touched && !markedChanged) {
+            markedChanged = differsFromSnapshot(vpn, offset, last + 1 - offset);
+        }
+
+        CodeMap &map = codeMaps.emplace(vpn, CodeMap()).first->second;
+        for (uint64_t word = offset / 4; word <= last / 4; word++) {
+            map.words[word / 64] |= 1ULL << (word % 64);
+        }
+
+        tlb.read[vpn % TLB_ENTRIES] = {vpn, leafPage(page)};
+
+        // a plain write TLB entry would let stores by unchecked, the next
+        // store puts a TLB_CODE one in its place
+        if (tlb.write[vpn % TLB_ENTRIES].tag == vpn) {
+            tlb.write[vpn % TLB_ENTRIES].tag = ~0ULL;
+        }
+        address += last + 1 - offset;
+    }
+}
+
+void PagedMemory::unmarkCode() {
+    for (auto &marked : codeMaps) {
+        void *&page = leafEntry(marked.first);
+        page = (void*)((uintptr_t)page & ~(uintptr_t)PAGE_CODE);
+    }
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        if (tlb.write[i].tag & TLB_CODE) {
+            tlb.write[i].tag = ~0ULL;
+        }
+    }
+    codeMaps.clear();
+    codeWrites.clear();
+    markedChanged = false;
+}
+
+// Whether bytes of a page differ from what the snapshot holds. The first
+// time the page was saved is the one with the snapshot's contents.
+bool PagedMemory::differsFromSnapshot(uint64_t vpn, uint64_t offset, uint64_t length) {
+    const uint8_t *host = leafPage(leafEntry(vpn)) + offset;
+    for (const SavedPage &saved : savedPages) {
+        if (saved.vpn != vpn) {
+            continue;
+        }
+        if (saved.copy) {
+            return memcmp(host, saved.copy + offset, length) != 0;
+        }
+        return any_of(host, host + length, [](uint8_t byte) { return byte != 0; });
+    }
+    return false;
+}
+
+void PagedMemory::writeBytes(uint64_t address, const uint8_t *src, uint64_t length) {
+    while (length > 0) {
+        uint64_t offset = address & PAGE_OFFSET_MASK;
+        uint64_t chunk = min<uint64_t>(length, PAGE_SIZE - offset);
+        memcpy(writePage(address, chunk) + offset, src, chunk);
+        address += chunk;
+        src += chunk;
+        length -= chunk;
+    }
+}
+
+bool PagedMemory::mapFile(uint64_t address, int fd, uint64_t offset, uint64_t length) {
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    mappings.push_back(shared_ptr<void>(base, [length](void *mapping) { munmap(mapping, length); }));
+
+    for (uint64_t done = 0; done < length; done += PAGE_SIZE) {
+        uint64_t vpn = (address + done) >> PAGE_BITS;
+        uint8_t *host = (uint8_t*)base + done;
+        void *&page = leafEntry(vpn);
+        if (page) {
+            memcpy(leafPage(page), host, PAGE_SIZE);
+            continue;
+        }
+        page = (void*)((uintptr_t)host | PAGE_MAPPED);
+        numPages++;
+
+        // drop stale zero-page translations
+        if (tlb.read[vpn % TLB_ENTRIES].tag == vpn) {
+            tlb.read[vpn % TLB_ENTRIES].tag = ~0ULL;
+        }
+    }
+    return true;
+}
+
+// Accesses that straddle two pages are assembled byte by byte
+int PagedMemory::getSplitValue(uint64_t address, uint64_t & value, MemEntrySize size) {
+    value = 0;
+    for (int i = 0; i < size; i++) {
+        uint64_t byteAddress = address + i;
+        value |= (uint64_t)readPage(byteAddress)[byteAddress & PAGE_OFFSET_MASK] << (8 * i);
+    }
+    return 0;
+}
+
+int PagedMemory::setSplitValue(uint64_t address, uint64_t value, MemEntrySize size) {
+    for (int i = 0; i < size; i++) {
+        uint64_t byteAddress = address + i;
+        writePage(byteAddress, 1)[byteAddress & PAGE_OFFSET_MASK] = (uint8_t)(value >> (8 * i));
+    }
+    return 0;
+}
+
+int PagedMemory::printMemory(uint64_t startAddress, uint64_t endAddress) {
+    for (uint64_t address = startAddress; address < endAddress; address += 4) {
+        if ((address - startAddress) % 20 == 0) {
+            printf("%s0x%08lx: ", address == startAddress ? "" : "\n", address);
+        }
+        uint64_t word;
+        getMemValue(address, word, WORD_SIZE);
+        printf("0x%02lx%02lx%02lx%02lx ", word & 0xff, (word >> 8) & 0xff,
+               (word >> 16) & 0xff, word >> 24);
+    }
+    printf("\n");
+    return 0;
+}
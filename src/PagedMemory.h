@@ -0,0 +1,290 @@
+#include <string.h>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Guest pages are 4 KB
+#define PAGE_BITS 12
+#define PAGE_SIZE (1ULL << PAGE_BITS)
+#define PAGE_OFFSET_MASK (PAGE_SIZE - 1)
+
+// Four levels of 13 bits cover the 52-bit page number of a 64-bit address
+#define PAGE_LEVELS 4
+#define PAGE_LEVEL_BITS 13
+#define PAGE_TABLE_ENTRIES (1 << PAGE_LEVEL_BITS)
+
+// Direct-mapped software TLB in front of the page table
+#define TLB_ENTRIES 256
+
+// Set in the tag of a write TLB entry for a page with decoded instructions,
+// whose entry then points at the page's CodeMap rather than the page. Page
+// numbers are 52 bits, so no plain tag has it.
+#define TLB_CODE (1ULL << 63)
+
+// Low bits of a leaf entry, free since pages are 4 KB aligned
+#define PAGE_MAPPED 1 // part of a file mapping rather than allocated by us
+#define PAGE_CODE   2 // holds instructions the simulator has decoded
+#define PAGE_SAVED  4 // copied aside since the last snapshot
+#define PAGE_SHARED 8 // may also be held by a checkpoint, copied before a store
+#define PAGE_FLAGS  (PAGE_MAPPED | PAGE_CODE | PAGE_SAVED | PAGE_SHARED)
+
+// The pages of a PagedMemory at one point in time. The pages themselves are
+// shared with the memory copy-on-write, so a checkpoint costs a reference
+// per page, and memory only for the pages that diverge afterwards.
+class MemCheckpoint
+{
+    public:
+        struct Page {
+            uint64_t vpn;
+            uint8_t *host;
+            bool mapped; // part of a file mapping, freed with it
+        };
+
+        MemCheckpoint() = default;
+        ~MemCheckpoint() { clear(); }
+
+        MemCheckpoint(const MemCheckpoint &) = delete;
+        MemCheckpoint &operator=(const MemCheckpoint &) = delete;
+
+        // Drop the checkpoint's references
+        void clear();
+
+        std::vector<Page> pages; // in page number order
+        std::vector<std::shared_ptr<void>> mappings; // keep mapped pages alive
+};
+
+// A sparse guest memory covering the full 64-bit address space. Pages are
+// allocated on their first store, so resident memory grows with the pages
+// a program actually writes; reads of untouched pages see zeros.
+//
+// Like any MemoryStore it can be used through the virtual interface, but
+// the class is final and the TLB-hit path is defined here, so code holding a
+// PagedMemory* gets inlined accesses: an access that stays inside one page
+// and hits the TLB is a tag compare plus a single little-endian memcpy.
+class PagedMemory final : public MemoryStore
+{
+    public:
+        // One bit per 4-byte word of a PAGE_CODE page, set for the words
+        // of decoded instructions, and the page itself while it is in the
+        // write TLB
+        struct CodeMap {
+            uint8_t *host = nullptr;
+            uint64_t words[PAGE_SIZE / 4 / 64] = {};
+        };
+
+        struct TlbEntry {
+            uint64_t tag; // virtual page number, ~0 when empty
+            union {
+                uint8_t *page; // host address of the page
+                CodeMap *code; // for a tag with TLB_CODE
+            };
+        };
+
+        // Separate TLBs for reads and writes: untouched pages are mapped to
+        // a shared zero page for reading only
+        struct Tlb {
+            TlbEntry read[TLB_ENTRIES];
+            TlbEntry write[TLB_ENTRIES];
+        };
+
+        PagedMemory();
+        ~PagedMemory();
+
+        int getMemValue(uint64_t address, uint64_t & value, MemEntrySize size) override {
+            uint64_t offset = address & PAGE_OFFSET_MASK;
+            if (offset > PAGE_SIZE - size) {
+                return getSplitValue(address, value, size);
+            }
+            value = hostLoad(readPage(address) + offset, size);
+            return 0;
+        }
+
+        int setMemValue(uint64_t address, uint64_t value, MemEntrySize size) override {
+            uint64_t offset = address & PAGE_OFFSET_MASK;
+            if (offset > PAGE_SIZE - size) {
+                return setSplitValue(address, value, size);
+            }
+            hostStore(writePage(address, size) + offset, value, size);
+            return 0;
+        }
+
+        int printMemory(uint64_t startAddress, uint64_t endAddress) override;
+
+        // Host page backing address, for reading or (allocating it) writing
+        const uint8_t *readPage(uint64_t address) {
+            uint64_t vpn = address >> PAGE_BITS;
+            const TlbEntry &entry = tlb.read[vpn % TLB_ENTRIES];
+            return entry.tag == vpn ? entry.page : walkForRead(vpn);
+        }
+
+        // length is how many bytes of the page the caller is about to
+        // store to, for the check against decoded instructions
+        uint8_t *writePage(uint64_t address, uint64_t length) {
+            uint64_t vpn = address >> PAGE_BITS;
+            const TlbEntry &entry = tlb.write[vpn % TLB_ENTRIES];
+            if (entry.tag == vpn) {
+                return entry.page;
+            }
+            if (entry.tag == (vpn | TLB_CODE) && !marksAny(*entry.code, address, length)) {
+                return entry.code->host;
+            }
+            return walkForWrite(address, length);
+        }
+
+        // Copy length bytes into guest memory a page at a time
+        void writeBytes(uint64_t address, const uint8_t *src, uint64_t length);
+
+        // Back the page-aligned guest range [address, address + length) with
+        // a private mapping of the file at offset, so its pages are shared
+        // with the page cache until the guest writes to them. Pages that are
+        // already present keep their contents and get a copy instead.
+        // Returns false if the mapping fails.
+        bool mapFile(uint64_t address, int fd, uint64_t offset, uint64_t length);
+
+        // Take the current contents as the state restore() goes back to.
+        // Empties the write TLB, so the first store to each page afterwards
+        // takes the slow path, which saves a copy of the page. restore()
+        // then puts back just the saved pages, so its cost follows what the
+        // guest wrote rather than the size of the image.
+        void snapshot();
+        void restore();
+        size_t dirtyPages() const { return savedPages.size(); }
+
+        // Share every page with cp, which is cleared first. Empties the
+        // write TLB, so a store to a shared page copies it on the slow path.
+        void checkpoint(MemCheckpoint &cp);
+
+        // Make the contents those of cp, replacing only the pages that
+        // differ from it. Replaced pages count as stored to for restore().
+        // Returns whether any of them had decoded instructions in it.
+        bool restoreCheckpoint(const MemCheckpoint &cp);
+
+        // TLBs, for the JIT's inline lookups
+        Tlb *tlbBase() { return &tlb; }
+
+        uint64_t residentPages() const { return numPages; }
+
+        // Start watching for stores. Empties the write TLB, so the first
+        // store afterwards takes the slow path and is noticed there, while
+        // the TLB-hit path costs nothing extra.
+        void watchStores();
+        bool storesSinceWatch() const { return storeSeen; }
+
+        // Empty the write TLB, so every page's next store takes the slow
+        // path, without starting a new watch
+        void flushWriteTlb();
+
+        // Note that [address, address + length) holds decoded instructions.
+        // Pages with such words are flagged in their leaf entry and get
+        // TLB_CODE write TLB entries, so a store to them tests the bits of
+        // the words it covers in the page's word map. Only a store that
+        // overlaps a marked word takes the slow path, which unmarks it and
+        // records it (and calls the hook, if one is set). Stores to pages
+        // without code pay nothing, and other stores to code pages a bit
+        // test.
+        void markCode(uint64_t address, uint64_t length);
+        bool codeWritten() const { return !codeWrites.empty(); }
+
+        // Whether words were marked that differ from what the snapshot
+        // holds, so the blocks decoded from them are wrong once restore()
+        // has run. unmarkCode() clears it.
+        bool changedCodeMarked() const { return markedChanged; }
+
+        // Forget every mark, for when the blocks they were made for are gone
+        void unmarkCode();
+
+        // Addresses of stores to marked words since the last call
+        void takeCodeWrites(std::vector<uint64_t> &addresses) {
+            addresses.clear();
+            addresses.swap(codeWrites);
+        }
+
+        void setCodeWriteHook(void (*hook)(void *arg), void *arg) {
+            codeWriteHook = hook;
+            codeWriteArg = arg;
+        }
+
+    private:
+        Tlb tlb;
+        void **root;         // level 0 of the page table
+        uint64_t numPages = 0;
+        bool storeSeen = false;
+        std::vector<std::shared_ptr<void>> mappings; // from mapFile
+
+        // Pages stored to since the snapshot, with their contents at the
+        // time, or no copy for pages that did not exist yet
+        struct SavedPage {
+            uint64_t vpn;
+            uint8_t *copy;
+        };
+        bool tracking = false; // snapshot() was called
+        std::vector<SavedPage> savedPages;
+        std::vector<uint8_t*> spareCopies;
+        std::vector<uint64_t> codeWrites;
+        std::unordered_map<uint64_t, CodeMap> codeMaps; // TLB entries point into it
+        bool markedChanged = false;
+        void (*codeWriteHook)(void *arg) = nullptr;
+        void *codeWriteArg = nullptr;
+
+        void *&leafEntry(uint64_t vpn);
+        void *newPage(uint64_t vpn);
+        void savePage(uint64_t vpn, void *&page, bool existed);
+        uint8_t *ownPage(uint64_t vpn, void *&page);
+
+        const uint8_t *walkForRead(uint64_t vpn);
+        uint8_t *walkForWrite(uint64_t address, uint64_t length);
+        bool storeHitsCode(uint64_t address, uint64_t length);
+        bool differsFromSnapshot(uint64_t vpn, uint64_t offset, uint64_t length);
+
+        // Whether the page's part of [address, address + length) overlaps a
+        // marked word
+        static bool marksAny(const CodeMap &map, uint64_t address, uint64_t length) {
+            uint64_t offset = address & PAGE_OFFSET_MASK;
+            uint64_t last = (offset + length > PAGE_SIZE ? PAGE_SIZE : offset + length) - 1;
+            for (uint64_t word = offset / 4; word <= last / 4; word++) {
+                if (map.words[word / 64] & (1ULL << (word % 64))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        int getSplitValue(uint64_t address, uint64_t & value, MemEntrySize size);
+        int setSplitValue(uint64_t address, uint64_t value, MemEntrySize size);
+
+        // Guest memory is little-endian, so on a little-endian host an
+        // access is a plain (possibly unaligned) memcpy
+        static uint64_t hostLoad(const uint8_t *p, MemEntrySize size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            switch (size) {
+                case BYTE_SIZE:   return *p;
+                case HALF_SIZE:   { uint16_t v; memcpy(&v, p, 2); return v; }
+                case WORD_SIZE:   { uint32_t v; memcpy(&v, p, 4); return v; }
+                case DOUBLE_SIZE: { uint64_t v; memcpy(&v, p, 8); return v; }
+            }
+            return 0;
+#else
+            uint64_t value = 0;
+            for (int i = 0; i < size; i++) {
+                value |= (uint64_t)p[i] << (8 * i);
+            }
+            return value;
+#endif
+        }
+
+        static void hostStore(uint8_t *p, uint64_t value, MemEntrySize size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            switch (size) {
+                case BYTE_SIZE:   *p = (uint8_t)value; break;
+                case HALF_SIZE:   { uint16_t v = value; memcpy(p, &v, 2); break; }
+                case WORD_SIZE:   { uint32_t v = value; memcpy(p, &v, 4); break; }
+                case DOUBLE_SIZE: memcpy(p, &value, 8); break;
+            }
+#else
+            for (int i = 0; i < size; i++) {
+                p[i] = (uint8_t)(value >> (8 * i));
+            }
+#endif
+        }
+};
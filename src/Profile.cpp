@@ -0,0 +1,280 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Profiling
+// --------------------------------------------------------------------------
+
+// The opcodes the decoder knows, and whether funct3 picks the instruction
+// (for U- and J-type instructions those bits are immediate)
+static const struct {
+    uint8_t opcode;
+    const char *name;
+    bool hasFunct3;
+} opcodeNames[] = {
+    {OP_INTIMM, "OP_INTIMM", true},
+    {OP_OFFIMM, "OP_OFFIMM", true},
+    {OP_WORIMM, "OP_WORIMM", true},
+    {OP_LNKREG, "OP_LNKREG", true},
+    {OP_REGFMT, "OP_REGFMT", true},
+    {OP_REGWRD, "OP_REGWRD", true},
+    {OP_STRFMT, "OP_STRFMT", true},
+    {OP_STRBYT, "OP_STRBYT", true},
+    {OP_ADDIMM, "OP_ADDIMM", false},
+    {OP_LDUIMM, "OP_LDUIMM", false},
+    {OP_JMPLNK, "OP_JMPLNK", false},
+};
+
+// Executions of one PC, summed over every block decoded there
+struct PCCount {
+    const Instruction *inst = nullptr; // as last decoded
+    uint64_t count = 0;
+    uint64_t taken = 0;    // conditional branches only
+    uint64_t notTaken = 0;
+};
+
+// Executions of one opcode/funct3 class
+struct ClassCount {
+    const char *opcode = nullptr;
+    int funct3 = -1; // -1 when funct3 is immediate bits
+    uint64_t count = 0;
+    set<string> mnemonics;
+};
+
+// Everything the reports show, added up from the block counts
+struct ProfileTotals {
+    uint64_t instructions = 0;
+    vector<pair<uint64_t, PCCount>> pcs; // hottest first
+    vector<ClassCount> classes;          // most executed first
+    uint64_t taken = 0;
+    uint64_t notTaken = 0;
+    uint64_t loads[4] = {0};  // by log2 of MemEntrySize
+    uint64_t stores[4] = {0};
+};
+
+static const char *const sizeNames[4] = {"byte", "half", "word", "double"};
+
+void profileBlock(Simulator &sim, DecodedBlock &block, size_t executed) {
+    if (!block.profile) {
+        sim.profile->blocks.emplace_back();
+        block.profile = &sim.profile->blocks.back();
+        block.profile->insts = block.insts;
+    }
+
+    BlockProfile &counts = *block.profile;
+    if (executed == block.insts.size()) {
+        counts.runs++;
+        counts.taken += sim.PC != block.insts.back().PC + 4;
+    } else {
+        if (counts.cut.empty()) {
+            counts.cut.resize(block.insts.size());
+        }
+        counts.cut[executed]++;
+    }
+}
+
+// The disassembler's text of an instruction, or "?" for the legal ones it
+// does not know (it covers fewer than the decoder)
+static string disassembly(const Instruction &inst) {
+    string text = disassembleInstruction(inst.instruction);
+    size_t first = text.find_first_not_of(' ');
+    text = first == string::npos ? "" : text.substr(first, text.find_last_not_of(' ') - first + 1);
+    return text == "ILLEGAL" && inst.isLegal ? "?" : text;
+}
+
+static void addUp(const Profile &profile, ProfileTotals &totals) {
+    map<uint64_t, PCCount> byPC;
+    for (const BlockProfile &block : profile.blocks) {
+        // an instruction ran in every full run and every run cut after it
+        uint64_t cutLater = 0;
+        for (size_t i = block.insts.size(); i-- > 0;) {
+            const Instruction &inst = block.insts[i];
+            uint64_t count = block.runs + cutLater;
+            if (!block.cut.empty()) {
+                cutLater += block.cut[i];
+            }
+            if (count == 0) {
+                continue;
+            }
+            PCCount &pc = byPC[inst.PC];
+            pc.inst = &inst;
+            pc.count += count;
+            if (i + 1 == block.insts.size() && inst.opcode == OP_STRBYT) {
+                pc.taken += block.taken;
+                pc.notTaken += block.runs - block.taken;
+            }
+        }
+    }
+
+    map<pair<int, int>, ClassCount> byClass;
+    for (const auto &entry : byPC) {
+        const PCCount &pc = entry.second;
+        const Instruction &inst = *pc.inst;
+        totals.instructions += pc.count;
+        totals.taken += pc.taken;
+        totals.notTaken += pc.notTaken;
+        if (inst.readsMem) {
+            totals.loads[inst.funct3 & 0b11] += pc.count;
+        }
+        if (inst.writesMem) {
+            totals.stores[inst.funct3 & 0b11] += pc.count;
+        }
+
+        for (const auto &name : opcodeNames) {
+            if (name.opcode == inst.opcode) {
+                int funct3 = name.hasFunct3 ? inst.funct3 : -1;
+                ClassCount &cls = byClass[make_pair((int)inst.opcode, funct3)];
+                cls.opcode = name.name;
+                cls.funct3 = funct3;
+                cls.count += pc.count;
+                string text = disassembly(inst);
+                if (text != "?") {
+                    cls.mnemonics.insert(text.substr(0, text.find(' ')));
+                }
+            }
+        }
+    }
+
+    totals.pcs.assign(byPC.begin(), byPC.end());
+    stable_sort(totals.pcs.begin(), totals.pcs.end(),
+                [](const pair<uint64_t, PCCount> &a, const pair<uint64_t, PCCount> &b) {
+                    return a.second.count > b.second.count;
+                });
+    for (auto &entry : byClass) {
+        totals.classes.push_back(move(entry.second));
+    }
+    stable_sort(totals.classes.begin(), totals.classes.end(), [](const ClassCount &a, const ClassCount &b) {
+        return a.count > b.count;
+    });
+}
+
+static string classLabel(const ClassCount &cls) {
+    string label = cls.opcode;
+    if (cls.funct3 >= 0) {
+        label += '/';
+        for (int bit = 2; bit >= 0; bit--) {
+            label += (cls.funct3 >> bit) & 1 ? '1' : '0';
+        }
+    }
+    return label;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+void printProfile(FILE *out, const Profile &profile, size_t hotSpots) {
+    ProfileTotals totals;
+    addUp(profile, totals);
+
+    fprintf(out, "Profile: %lu instructions at %zu PCs, %zu blocks decoded\n",
+            totals.instructions, totals.pcs.size(), profile.blocks.size());
+
+    fprintf(out, "Profile: hot spots\n");
+    for (size_t i = 0; i < totals.pcs.size() && i < hotSpots; i++) {
+        const PCCount &pc = totals.pcs[i].second;
+        string text = disassembly(*pc.inst);
+        fprintf(out, "  %12lu %6.2f%%  0x%08lx: %08x %s", pc.count, percent(pc.count, totals.instructions),
+                totals.pcs[i].first, pc.inst->instruction, text.c_str());
+        if (pc.taken + pc.notTaken > 0) {
+            fprintf(out, "%*s  taken %.1f%%", (int)(text.size() < 24 ? 24 - text.size() : 0), "",
+                    percent(pc.taken, pc.taken + pc.notTaken));
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "Profile: opcode classes\n");
+    for (const ClassCount &cls : totals.classes) {
+        string mnemonics;
+        for (const string &mnemonic : cls.mnemonics) {
+            mnemonics += (mnemonics.empty() ? "" : " ") + mnemonic;
+        }
+        fprintf(out, mnemonics.empty() ? "  %12lu %6.2f%%  %s\n" : "  %12lu %6.2f%%  %-14s %s\n", cls.count,
+                percent(cls.count, totals.instructions), classLabel(cls).c_str(), mnemonics.c_str());
+    }
+
+    fprintf(out, "Profile: branches: %lu taken, %lu not taken (%.1f%% taken)\n",
+            totals.taken, totals.notTaken, percent(totals.taken, totals.taken + totals.notTaken));
+    fprintf(out, "Profile: loads:  %s %lu, %s %lu, %s %lu, %s %lu\n",
+            sizeNames[0], totals.loads[0], sizeNames[1], totals.loads[1],
+            sizeNames[2], totals.loads[2], sizeNames[3], totals.loads[3]);
+    fprintf(out, "Profile: stores: %s %lu, %s %lu, %s %lu, %s %lu\n",
+            sizeNames[0], totals.stores[0], sizeNames[1], totals.stores[1],
+            sizeNames[2], totals.stores[2], sizeNames[3], totals.stores[3]);
+}
+
+// A JSON string literal of text
+static string jsonString(const string &text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        if ((unsigned char)c >= 0x20) {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+bool writeProfileJson(const char *jsonFile, const Profile &profile, const char *programFile) {
+    FILE *out = fopen(jsonFile, "w");
+    if (!out) {
+        return false;
+    }
+    ProfileTotals totals;
+    addUp(profile, totals);
+
+    fprintf(out, "{\n  \"program\": %s,\n  \"instructions\": %lu,\n",
+            jsonString(programFile).c_str(), totals.instructions);
+
+    fprintf(out, "  \"pcs\": [");
+    for (size_t i = 0; i < totals.pcs.size(); i++) {
+        const PCCount &pc = totals.pcs[i].second;
+        fprintf(out, "%s\n    {\"pc\": \"0x%lx\", \"instruction\": \"0x%08x\", \"disassembly\": %s, \"count\": %lu",
+                i ? "," : "", totals.pcs[i].first, pc.inst->instruction,
+                jsonString(disassembly(*pc.inst)).c_str(), pc.count);
+        if (pc.inst->opcode == OP_STRBYT) {
+            fprintf(out, ", \"taken\": %lu, \"not_taken\": %lu", pc.taken, pc.notTaken);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"classes\": [");
+    for (size_t i = 0; i < totals.classes.size(); i++) {
+        const ClassCount &cls = totals.classes[i];
+        fprintf(out, "%s\n    {\"opcode\": \"%s\", ", i ? "," : "", cls.opcode);
+        if (cls.funct3 >= 0) {
+            fprintf(out, "\"funct3\": %d, ", cls.funct3);
+        } else {
+            fprintf(out, "\"funct3\": null, ");
+        }
+        fprintf(out, "\"count\": %lu, \"mnemonics\": [", cls.count);
+        bool first = true;
+        for (const string &mnemonic : cls.mnemonics) {
+            fprintf(out, "%s%s", first ? "" : ", ", jsonString(mnemonic).c_str());
+            first = false;
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"branches\": {\"taken\": %lu, \"not_taken\": %lu},\n", totals.taken, totals.notTaken);
+    const char *const kinds[2] = {"loads", "stores"};
+    const uint64_t *counts[2] = {totals.loads, totals.stores};
+    for (int kind = 0; kind < 2; kind++) {
+        fprintf(out, "  \"%s\": {", kinds[kind]);
+        for (int size = 0; size < 4; size++) {
+            fprintf(out, "%s\"%s\": %lu", size ? ", " : "", sizeNames[size], counts[kind][size]);
+        }
+        fprintf(out, "}%s\n", kind == 0 ? "," : "");
+    }
+    fprintf(out, "}\n");
+    return fclose(out) == 0;
+}
@@ -0,0 +1,485 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Sampled simulation
+// --------------------------------------------------------------------------
+
+// Dimensions basic block vectors are projected down to before clustering,
+// the same as SimPoint
+#define BBV_DIMS 15
+
+// Most rounds of k-means before settling for the clusters so far
+#define KMEANS_ROUNDS 100
+
+// Instructions run through the caches before each window, without being
+// counted, so the window does not start with them cold
+#define CACHE_WARMUP 100000
+
+// Windows measured per cluster, drawn at random from its intervals so that
+// their spread is an unbiased estimate of the cluster's
+#define CLUSTER_SAMPLES 2
+
+// What the detailed pass counts
+enum SampleEvent {
+    EVENT_LOADS,
+    EVENT_STORES,
+    EVENT_BRANCHES,
+    EVENT_TAKEN,
+    EVENT_JUMPS,
+    EVENT_L1I_MISSES, // the cache levels, in CacheHierarchy::level order
+    EVENT_L1D_MISSES,
+    EVENT_L2_MISSES,
+    NUM_EVENTS
+};
+
+static const char *const eventNames[NUM_EVENTS] = {
+    "loads", "stores", "branches", "taken branches", "jumps",
+    "L1I misses", "L1D misses", "L2 misses"
+};
+
+// One window run through the stages
+struct SampleWindow {
+    uint64_t start = 0;        // instructions retired before it
+    uint64_t length = 0;       // instructions it should cover
+    size_t stratum = 0;        // cluster it stands for
+    uint64_t instructions = 0; // instructions it did cover
+    uint64_t events[NUM_EVENTS] = {0};
+};
+
+// A part of the program the windows in it are a sample of: all of it for
+// fixed offsets, one cluster of intervals for SimPoint-style sampling
+struct Stratum {
+    double weight = 0;     // share of the program's instructions
+    double population = 0; // windows that would cover it entirely
+    vector<const SampleWindow*> windows;
+};
+
+typedef array<double, BBV_DIMS> Projected;
+
+static uint64_t cacheMisses(const CacheHierarchy &caches, int level) {
+    const Cache *cache = caches.level(level);
+    return cache ? cache->stats.readMisses + cache->stats.writeMisses : 0;
+}
+
+// Run one window through fetch, decode and the execution stages an
+// instruction at a time, counting events on the way, and looking its
+// fetches, loads and stores up in caches if there are any
+static SimStatus simDetailed(Simulator &sim, CacheHierarchy *caches, SampleWindow &window) {
+    uint64_t missesBefore[3];
+    for (int level = 0; caches && level < 3; level++) {
+        missesBefore[level] = cacheMisses(*caches, level);
+    }
+
+    SimStatus status = SIM_RUNNING;
+    while (window.instructions < window.length) {
+        uint64_t PC = sim.PC;
+        InFlight ex;
+        Instruction inst = simInstruction(sim.PC, sim.myMem, sim.regData, ex);
+        if (inst.isHalt) {
+            status = SIM_HALT;
+            break;
+        }
+        if (!inst.isLegal) {
+            status = SIM_ILLEGAL;
+            break;
+        }
+        if (caches) {
+            caches->fetch(PC);
+            if (inst.readsMem || inst.writesMem) {
+                caches->data(ex.memAddress, 1 << (inst.funct3 & 0b11), inst.writesMem);
+            }
+        }
+        window.instructions++;
+        window.events[EVENT_LOADS] += inst.readsMem;
+        window.events[EVENT_STORES] += inst.writesMem;
+        if (inst.opcode == OP_STRBYT) {
+            window.events[EVENT_BRANCHES]++;
+            window.events[EVENT_TAKEN] += sim.PC != PC + 4;
+        } else if (inst.opcode == OP_JMPLNK || inst.opcode == OP_LNKREG) {
+            window.events[EVENT_JUMPS]++;
+        }
+    }
+    for (int level = 0; caches && level < 3; level++) {
+        window.events[EVENT_L1I_MISSES + level] = cacheMisses(*caches, level) - missesBefore[level];
+    }
+    sim.stats.instructions += window.instructions;
+    return status;
+}
+
+// Fixed random projection of a block's dimension of the BBV, in [-1, 1)
+static double projection(uint64_t startPC, int dim) {
+    // splitmix64
+    uint64_t x = startPC * BBV_DIMS + dim + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (double)(x >> 11) / (1ULL << 52) - 1.0;
+}
+
+// Instructions a profiled block has retired so far
+static uint64_t profiledInstructions(const BlockProfile &block) {
+    uint64_t instructions = block.runs * block.insts.size();
+    for (size_t k = 0; k < block.cut.size(); k++) {
+        instructions += k * block.cut[k];
+    }
+    return instructions;
+}
+
+// Run the whole program on sim's engine with profile counting its blocks,
+// collecting the basic block vector of every interval of the given
+// length: the share of the interval's instructions each block accounted
+// for, projected down to BBV_DIMS dimensions. The last interval may be
+// shorter.
+static SimStatus profileIntervals(Simulator &sim, Profile &profile, uint64_t interval, uint64_t maxInsts,
+                                  vector<Projected> &bbvs, vector<uint64_t> &lengths) {
+    vector<uint64_t> counted; // instructions of each block up to the last interval
+    SimStatus status = SIM_RUNNING;
+    sim.profile = &profile;
+    while (status == SIM_RUNNING && sim.stats.instructions < maxInsts) {
+        uint64_t before = sim.stats.instructions;
+        status = sim.step(min(interval, maxInsts - sim.stats.instructions));
+        uint64_t length = sim.stats.instructions - before;
+        if (length == 0) {
+            break;
+        }
+
+        Projected bbv {};
+        counted.resize(profile.blocks.size());
+        for (size_t b = 0; b < profile.blocks.size(); b++) {
+            const BlockProfile &block = profile.blocks[b];
+            uint64_t instructions = profiledInstructions(block);
+            if (instructions == counted[b]) {
+                continue;
+            }
+            double share = (double)(instructions - counted[b]) / length;
+            for (int dim = 0; dim < BBV_DIMS; dim++) {
+                bbv[dim] += share * projection(block.insts[0].PC, dim);
+            }
+            counted[b] = instructions;
+        }
+        bbvs.push_back(bbv);
+        lengths.push_back(length);
+    }
+    sim.profile = nullptr;
+    return status;
+}
+
+static double distance2(const Projected &a, const Projected &b) {
+    double sum = 0;
+    for (int dim = 0; dim < BBV_DIMS; dim++) {
+        sum += (a[dim] - b[dim]) * (a[dim] - b[dim]);
+    }
+    return sum;
+}
+
+// Cluster the points with k-means, k-means++ seeded from a fixed seed so
+// runs repeat. cluster[i] is the cluster of point i.
+static void kmeans(const vector<Projected> &points, unsigned k,
+                   vector<Projected> &centers, vector<unsigned> &cluster) {
+    mt19937_64 rng(1);
+    vector<double> nearest(points.size(), INFINITY);
+    centers.assign(1, points[rng() % points.size()]);
+    while (centers.size() < k) {
+        double total = 0;
+        for (size_t i = 0; i < points.size(); i++) {
+            nearest[i] = min(nearest[i], distance2(points[i], centers.back()));
+            total += nearest[i];
+        }
+        if (total == 0) {
+            break; // fewer distinct points than clusters
+        }
+        double pick = uniform_real_distribution<double>(0, total)(rng);
+        size_t chosen = 0;
+        while (chosen + 1 < points.size() && (pick -= nearest[chosen]) >= 0) {
+            chosen++;
+        }
+        centers.push_back(points[chosen]);
+    }
+
+    cluster.assign(points.size(), 0);
+    for (int round = 0; round < KMEANS_ROUNDS; round++) {
+        bool moved = false;
+        for (size_t i = 0; i < points.size(); i++) {
+            unsigned best = 0;
+            for (unsigned c = 1; c < centers.size(); c++) {
+                if (distance2(points[i], centers[c]) < distance2(points[i], centers[best])) {
+                    best = c;
+                }
+            }
+            moved = moved || (round > 0 && best != cluster[i]);
+            cluster[i] = best;
+        }
+        if (round > 0 && !moved) {
+            break;
+        }
+
+        vector<Projected> sums(centers.size(), Projected {});
+        vector<size_t> sizes(centers.size(), 0);
+        for (size_t i = 0; i < points.size(); i++) {
+            for (int dim = 0; dim < BBV_DIMS; dim++) {
+                sums[cluster[i]][dim] += points[i][dim];
+            }
+            sizes[cluster[i]]++;
+        }
+        for (unsigned c = 0; c < centers.size(); c++) {
+            for (int dim = 0; sizes[c] && dim < BBV_DIMS; dim++) {
+                centers[c][dim] = sums[c][dim] / sizes[c];
+            }
+        }
+    }
+}
+
+// Pick the windows to measure by clustering the intervals' basic block
+// vectors: CLUSTER_SAMPLES intervals of each cluster drawn at random,
+// without replacement, each cluster weighted by its share of the
+// instructions. The draw makes the windows a stratified random sample, so
+// their spread gives a valid confidence interval, which windows nearest
+// the centers would not.
+static void chooseSimPoints(const vector<Projected> &bbvs, const vector<uint64_t> &lengths,
+                            unsigned numClusters, uint64_t window,
+                            vector<SampleWindow> &windows, vector<Stratum> &strata) {
+    vector<Projected> centers;
+    vector<unsigned> cluster;
+    kmeans(bbvs, min<size_t>(numClusters, bbvs.size()), centers, cluster);
+
+    uint64_t total = 0;
+    for (uint64_t length : lengths) {
+        total += length;
+    }
+    vector<vector<size_t>> members(centers.size());
+    for (size_t i = 0; i < bbvs.size(); i++) {
+        members[cluster[i]].push_back(i);
+    }
+
+    mt19937_64 rng(1);
+    for (unsigned c = 0; c < centers.size(); c++) {
+        if (members[c].empty()) {
+            continue;
+        }
+        shuffle(members[c].begin(), members[c].end(), rng);
+        Stratum stratum;
+        for (size_t i : members[c]) {
+            stratum.weight += (double)lengths[i] / total;
+        }
+        stratum.population = members[c].size();
+        strata.push_back(stratum);
+
+        for (size_t j = 0; j < members[c].size() && j < CLUSTER_SAMPLES; j++) {
+            SampleWindow sample;
+            sample.start = members[c][j] * window;
+            sample.length = lengths[members[c][j]];
+            sample.stratum = strata.size() - 1;
+            windows.push_back(sample);
+        }
+    }
+    sort(windows.begin(), windows.end(), [](const SampleWindow &a, const SampleWindow &b) {
+        return a.start < b.start;
+    });
+}
+
+// Two-sided 95% quantile of Student's t distribution
+static double tQuantile(size_t df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    return df <= 30 ? table[df - 1] : 1.960;
+}
+
+// Stratified estimate of an event's rate per instruction and the half
+// width of its 95% confidence interval, NAN when the windows do not tell.
+// The degrees of freedom are Satterthwaite's, since with few windows per
+// stratum the variance of one stratum can dominate the rest.
+static void estimateRate(const vector<Stratum> &strata, int event, double &rate, double &halfWidth) {
+    rate = 0;
+    double variance = 0;
+    double dfDenominator = 0;
+    for (const Stratum &stratum : strata) {
+        vector<double> rates;
+        for (const SampleWindow *window : stratum.windows) {
+            if (window->instructions > 0) {
+                rates.push_back((double)window->events[event] / window->instructions);
+            }
+        }
+        if (rates.empty()) {
+            continue;
+        }
+        double mean = 0;
+        for (double r : rates) {
+            mean += r / rates.size();
+        }
+        rate += stratum.weight * mean;
+
+        // a stratum measured completely has no sampling error
+        double unsampled = max(0.0, 1.0 - rates.size() / stratum.population);
+        if (rates.size() > 1 && unsampled > 0) {
+            double spread = 0;
+            for (double r : rates) {
+                spread += (r - mean) * (r - mean) / (rates.size() - 1);
+            }
+            double part = stratum.weight * stratum.weight * unsampled * spread / rates.size();
+            variance += part;
+            dfDenominator += part * part / (rates.size() - 1);
+        } else if (unsampled > 0) {
+            variance = NAN;
+        }
+    }
+    if (isnan(variance) || variance == 0) {
+        halfWidth = variance; // strata measured completely have no error
+    } else {
+        size_t df = max<size_t>(1, (size_t)(variance * variance / dfDenominator));
+        halfWidth = tQuantile(df) * sqrt(variance);
+    }
+}
+
+int runSampled(const char *programFile, SimEngine engine, const SampleConfig &config, uint64_t maxInsts) {
+    uint64_t window = max<uint64_t>(config.window, 1);
+    vector<SampleWindow> windows;
+    vector<Stratum> strata;
+
+    CacheHierarchy caches;
+    if (config.cacheSpec && !caches.configure(config.cacheSpec)) {
+        return -1;
+    }
+
+    Profile profile; // blocks profiled for clustering point into it
+    Simulator sim(engine);
+    if (!sim.load(programFile)) {
+        fprintf(stderr, "%s: failed to load\n", programFile);
+        return -1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    double profileSeconds = 0;
+    uint64_t totalInsts = 0;
+    SimStatus finalStatus = SIM_RUNNING; // how the whole program ended
+    if (config.clusters > 0) {
+        vector<Projected> bbvs;
+        vector<uint64_t> lengths;
+        finalStatus = profileIntervals(sim, profile, window, maxInsts, bbvs, lengths);
+        totalInsts = sim.stats.instructions;
+        if (bbvs.empty()) {
+            fprintf(stderr, "%s: no instructions to sample\n", programFile);
+            return -1;
+        }
+        chooseSimPoints(bbvs, lengths, config.clusters, window, windows, strata);
+        sim.reset();
+        profileSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+    } else {
+        vector<uint64_t> offsets = config.offsets;
+        sort(offsets.begin(), offsets.end());
+        strata.resize(1);
+        for (uint64_t offset : offsets) {
+            if (!windows.empty() && offset < windows.back().start + window) {
+                fprintf(stderr, "Sample offset %lu overlaps the window at %lu\n", offset, windows.back().start);
+                return -1;
+            }
+            SampleWindow sample;
+            sample.start = offset;
+            sample.length = window;
+            windows.push_back(sample);
+        }
+    }
+
+    // fast-forward to each window on the chosen engine, then run it
+    // through the stages. With caches, the last CACHE_WARMUP instructions
+    // before it go through them on the staged engine first.
+    double detailedSeconds = 0;
+    SimStatus status = SIM_RUNNING;
+    size_t measured = 0;
+    for (SampleWindow &sample : windows) {
+        if (sample.start >= maxInsts) {
+            break;
+        }
+        uint64_t warmFrom = config.cacheSpec ? max<uint64_t>(sample.start, CACHE_WARMUP) - CACHE_WARMUP : sample.start;
+        if (warmFrom > sim.stats.instructions) {
+            status = sim.run(warmFrom - sim.stats.instructions);
+        }
+        if (status == SIM_RUNNING && sample.start > sim.stats.instructions) {
+            sim.caches = &caches;
+            status = sim.run(sample.start - sim.stats.instructions);
+            sim.caches = nullptr;
+        }
+        if (status != SIM_RUNNING) {
+            break;
+        }
+        auto detailedStart = chrono::steady_clock::now();
+        sample.length = min(sample.length, maxInsts - sample.start);
+        status = simDetailed(sim, config.cacheSpec ? &caches : nullptr, sample);
+        detailedSeconds += chrono::duration<double>(chrono::steady_clock::now() - detailedStart).count();
+        strata[sample.stratum].windows.push_back(&sample);
+        measured++;
+        if (status != SIM_RUNNING) {
+            break;
+        }
+    }
+    if (config.clusters == 0) {
+        if (status == SIM_RUNNING && sim.stats.instructions < maxInsts) {
+            status = sim.run(maxInsts - sim.stats.instructions);
+        }
+        totalInsts = sim.stats.instructions;
+        finalStatus = status;
+        strata[0].weight = 1;
+        strata[0].population = (double)totalInsts / window;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t detailedInsts = 0;
+    for (size_t i = 0; i < measured; i++) {
+        const SampleWindow &sample = windows[i];
+        detailedInsts += sample.instructions;
+        if (config.clusters > 0) {
+            printf("Sampled: window at instruction %lu, %lu instructions, cluster %zu of weight %.4f\n",
+                   sample.start, sample.instructions, sample.stratum, strata[sample.stratum].weight);
+        } else {
+            printf("Sampled: window at instruction %lu, %lu instructions\n", sample.start, sample.instructions);
+        }
+    }
+    if (measured < windows.size()) {
+        printf("Sampled: %zu windows past the end of the program skipped\n", windows.size() - measured);
+    }
+    printf("Sampled: %lu instructions, %lu in %zu detailed windows (%.2f%%)\n",
+           totalInsts, detailedInsts, measured, totalInsts ? 100.0 * detailedInsts / totalInsts : 0.0);
+    if (config.clusters > 0) {
+        printf("Sampled: %.3f s profiling, %.3f s fast-forward, %.3f s detailed\n",
+               profileSeconds, seconds - detailedSeconds, detailedSeconds);
+    } else {
+        printf("Sampled: %.3f s fast-forward, %.3f s detailed\n", seconds - detailedSeconds, detailedSeconds);
+    }
+
+    for (int level = 0; config.cacheSpec && level < 3; level++) {
+        if (const Cache *cache = caches.level(level)) {
+            printf("Sampled: %s %s, warmed up over %d instructions before each window\n",
+                   cache->name, cache->config.describe().c_str(), CACHE_WARMUP);
+        }
+    }
+
+    // rates per 1000 instructions and whole-program totals, each with the
+    // half width of its 95% confidence interval
+    for (int event = 0; event < NUM_EVENTS && measured > 0; event++) {
+        if (event >= EVENT_L1I_MISSES && !(config.cacheSpec && caches.level(event - EVENT_L1I_MISSES))) {
+            continue;
+        }
+        double rate, halfWidth;
+        estimateRate(strata, event, rate, halfWidth);
+        if (isnan(halfWidth)) {
+            printf("Sampled: %s: %.2f per 1000 instructions, %.0f in total, no confidence interval\n",
+                   eventNames[event], rate * 1000, rate * totalInsts);
+        } else {
+            printf("Sampled: %s: %.2f +- %.2f per 1000 instructions, %.0f +- %.0f in total\n",
+                   eventNames[event], rate * 1000, halfWidth * 1000, rate * totalInsts, halfWidth * totalInsts);
+        }
+    }
+
+    return finalStatus == SIM_HALT ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+#include "sim.h"
+
+using namespace std;
+
+// Instructions between two checks of run()'s loop detector
+#define LOOP_CHECK_INTERVAL (1 << 16)
+
+// --------------------------------------------------------------------------
+// Simulator context
+// --------------------------------------------------------------------------
+
+Simulator::Simulator(SimEngine engine) : myMem(new PagedMemory()), engine(engine) {}
+
+Simulator::~Simulator() {
+    if (jit) {
+        jitRelease(jit);
+    }
+    delete myMem;
+}
+
+bool Simulator::load(const char *programFile) {
+    this->programFile = programFile;
+    loaded = false;
+
+    // nothing decoded from an earlier program applies
+    dropBlocks();
+    codeModified = false;
+
+    delete myMem;
+    myMem = new PagedMemory();
+    if (!initMemory(programFile, myMem, entryPC)) {
+        return false;
+    }
+    myMem->snapshot();
+    entryRegs = REGS();
+    entryStats = SimStats();
+    loaded = true;
+    return reset();
+}
+
+bool Simulator::reset() {
+    if (!loaded) {
+        return false;
+    }
+
+    // blocks decoded from modified code are no good for the original, the
+    // rest carry over with their marks, since the code under them is as
+    // it was. Stores to code not yet acted on count as modifying it, and
+    // so do blocks decoded from code stored or restored before they were.
+    if (myMem->codeWritten()) {
+        invalidateCode();
+    }
+    if (codeModified || myMem->changedCodeMarked()) {
+        dropBlocks();
+        codeModified = false;
+    }
+    myMem->restore();
+
+    regData = entryRegs;
+    PC = entryPC;
+    stats = entryStats;
+    loopCheck = LoopCheck();
+    return true;
+}
+
+void Simulator::dropBlocks() {
+    if (jit) {
+        jitInvalidate(jit);
+    }
+    blockCache.clear();
+    codePages.clear();
+    myMem->unmarkCode();
+}
+
+SimStatus Simulator::step(uint64_t n) {
+    uint64_t budget = n;
+    SimStatus status = SIM_RUNNING;
+    // profiling and tracing need the JIT's blocks to come back to the
+    // dispatcher, so the threaded engine runs them instead
+    SimEngine running = caches || addressOut ? ENGINE_STAGED :
+                        (profile || traceOut) && engine == ENGINE_JIT ? ENGINE_THREADED : engine;
+    while (status == SIM_RUNNING && budget > 0) {
+        switch (running) {
+            case ENGINE_THREADED:
+                status = traceOut ? simThreaded<PagedMemory, true>(*this, myMem, budget) :
+                                    simThreaded(*this, myMem, budget);
+                break;
+            case ENGINE_JIT:      status = simJit(*this, budget); break;
+            default:              status = simBlock(*this, budget); break;
+        }
+    }
+    stats.instructions += n - budget;
+    return status;
+}
+
+SimStatus Simulator::run(uint64_t maxInsts) {
+    // Brent's cycle detection over the state every LOOP_CHECK_INTERVAL
+    // instructions: compare with a saved snapshot, and move the snapshot
+    // up at power-of-two numbers of checks. Sampling at a fixed interval
+    // is itself a deterministic step, so any cycle shows up this way.
+    LoopCheck &loop = loopCheck;
+
+    uint64_t executed = 0;
+    while (executed < maxInsts) {
+        uint64_t before = stats.instructions;
+        SimStatus status = step(min<uint64_t>(maxInsts - executed, LOOP_CHECK_INTERVAL - loop.sinceCheck));
+        executed += stats.instructions - before;
+        loop.sinceCheck += stats.instructions - before;
+        if (status != SIM_RUNNING) {
+            return status;
+        }
+        if (loop.sinceCheck < LOOP_CHECK_INTERVAL) {
+            continue;
+        }
+        loop.sinceCheck = 0;
+
+        if (++loop.checks == loop.nextSave) {
+            loop.savedRegs = regData;
+            loop.savedPC = PC;
+            myMem->watchStores();
+            loop.nextSave *= 2;
+        } else if (!myMem->storesSinceWatch() && PC == loop.savedPC &&
+                   memcmp(regData.registers, loop.savedRegs.registers, sizeof(regData.registers)) == 0) {
+            return SIM_LOOP;
+        }
+    }
+    return SIM_RUNNING;
+}
+
+void Simulator::invalidateCode(vector<uint64_t> *written) {
+    vector<uint64_t> stores;
+    myMem->takeCodeWrites(stores);
+    if (written) {
+        *written = stores;
+    }
+
+    // a store is at most 8 bytes, anything it overlaps goes
+    vector<uint64_t> dropped;
+    for (uint64_t address : stores) {
+        auto page = codePages.find(address >> PAGE_BITS);
+        if (page == codePages.end()) {
+            continue;
+        }
+        vector<uint64_t> &startPCs = page->second;
+        for (size_t i = 0; i < startPCs.size();) {
+            auto cached = blockCache.find(startPCs[i]);
+            bool overlaps = cached == blockCache.end() ||
+                (address + 8 > cached->first && address < cached->first + 4 * cached->second.insts.size());
+            if (overlaps) {
+                dropped.push_back(startPCs[i]);
+                startPCs[i] = startPCs.back();
+                startPCs.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    if (dropped.empty()) {
+        return; // the words belonged to blocks dropped earlier
+    }
+
+    // host code jumps straight between blocks, so all of it goes
+    if (jit) {
+        jitInvalidate(jit);
+    }
+    for (uint64_t startPC : dropped) {
+        blockCache.erase(startPC);
+    }
+
+    // links and traces of the surviving blocks may lead into dropped ones
+    for (auto &cached : blockCache) {
+        DecodedBlock &block = cached.second;
+        block.taken = nullptr;
+        block.notTaken = nullptr;
+        block.loopCount = 0;
+        block.trace.clear();
+    }
+    codeModified = true;
+}
+
+void Simulator::dump() {
+    ::dump(regData, myMem);
+}
+
+bool Simulator::dump(const string &outputPrefix) {
+    string regFile = outputPrefix + ".reg_state.out";
+    string memFile = outputPrefix + ".mem_state.out";
+    FILE *regOut = fopen(regFile.c_str(), "w");
+    FILE *memOut = fopen(memFile.c_str(), "w");
+    if (regOut) {
+        writeRegisterState(regOut, regData);
+        fclose(regOut);
+    }
+    if (memOut) {
+        writeMemoryState(memOut, myMem);
+        fclose(memOut);
+    }
+    return regOut && memOut;
+}
@@ -0,0 +1,436 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Cache sweeps
+// --------------------------------------------------------------------------
+
+// Time slots the stack distance tree starts with; it grows to twice the
+// lines live when it fills
+#define STACK_DISTANCE_SLOTS (1 << 20)
+
+// Mattson's stack distance analysis of fully associative LRU caches of one
+// line size. An access's distance is the number of other lines used since
+// its line was last used; it hits in every cache of more lines than that.
+// Each line's last use marks one time slot of a Fenwick tree, so counting
+// the lines used since is a difference of two prefix sums.
+class StackDistance
+{
+    public:
+        // Distances from maxLines up all count as misses
+        StackDistance(unsigned lineBits, uint64_t maxLines)
+            : lineBits(lineBits), tree(STACK_DISTANCE_SLOTS + 1), distances(maxLines) {}
+
+        void access(uint64_t address) {
+            uint64_t line = address >> lineBits;
+            accesses++;
+            if (now + 1 == tree.size()) {
+                compact();
+            }
+            now++;
+            auto last = lastUse.find(line);
+            if (last == lastUse.end()) {
+                lastUse[line] = now;
+                beyond++;
+            } else {
+                uint64_t distance = prefix(now - 1) - prefix(last->second);
+                if (distance < distances.size()) {
+                    distances[distance]++;
+                } else {
+                    beyond++;
+                }
+                add(last->second, -1);
+                last->second = now;
+            }
+            add(now, 1);
+        }
+
+        // Misses of a cache of this many lines, at most maxLines
+        uint64_t misses(uint64_t lines) const {
+            uint64_t total = beyond;
+            for (uint64_t distance = lines; distance < distances.size(); distance++) {
+                total += distances[distance];
+            }
+            return total;
+        }
+
+        const unsigned lineBits;
+        uint64_t accesses = 0;
+
+    private:
+        unordered_map<uint64_t, uint64_t> lastUse; // line -> time slot
+        vector<uint32_t> tree;                     // Fenwick tree over time slots
+        uint64_t now = 0;
+        vector<uint64_t> distances; // accesses at each distance below maxLines
+        uint64_t beyond = 0;        // first uses and longer distances
+
+        void add(uint64_t slot, int delta) {
+            for (; slot < tree.size(); slot += slot & -slot) {
+                tree[slot] += delta;
+            }
+        }
+
+        uint64_t prefix(uint64_t slot) const {
+            uint64_t sum = 0;
+            for (; slot > 0; slot -= slot & -slot) {
+                sum += tree[slot];
+            }
+            return sum;
+        }
+
+        // Renumber the last uses 1, 2, ... in order, dropping the slots of
+        // earlier uses
+        void compact() {
+            vector<pair<uint64_t, uint64_t>> uses; // time slot, line
+            uses.reserve(lastUse.size());
+            for (const auto &use : lastUse) {
+                uses.emplace_back(use.second, use.first);
+            }
+            sort(uses.begin(), uses.end());
+            for (size_t i = 0; i < uses.size(); i++) {
+                lastUse[uses[i].second] = i + 1;
+            }
+            now = uses.size();
+            tree.assign(max<size_t>(tree.size(), 2 * uses.size() + 1), 0);
+            for (uint64_t slot = 1; slot < tree.size(); slot++) {
+                tree[slot] += slot <= now;
+                uint64_t parent = slot + (slot & -slot);
+                if (parent < tree.size()) {
+                    tree[parent] += tree[slot];
+                }
+            }
+        }
+};
+
+// One cache of the sweep. ways is 0 for a fully associative LRU cache,
+// which the StackDistance of its line size answers for.
+struct SweepPoint {
+    uint64_t size;
+    unsigned ways;
+    unsigned lineSize;
+    unique_ptr<Cache> cache;
+    StackDistance *stack = nullptr;
+};
+
+// Feed every access of the stream to some of the models, an access
+// straddling two lines going to both
+static void sweepWorker(AddressStream &stream, unsigned reader, vector<Cache *> caches,
+                        vector<StackDistance *> stacks) {
+    while (shared_ptr<const vector<uint64_t>> chunk = stream.next(reader)) {
+        for (Cache *cache : caches) {
+            for (uint64_t entry : *chunk) {
+                uint64_t address = entry >> 3;
+                uint64_t last = address + (1 << ((entry >> 1) & 3)) - 1;
+                cache->access(address, entry & 1);
+                if ((address ^ last) >> cache->lineBits) {
+                    cache->access(last, entry & 1);
+                }
+            }
+        }
+        for (StackDistance *stack : stacks) {
+            for (uint64_t entry : *chunk) {
+                uint64_t address = entry >> 3;
+                uint64_t last = address + (1 << ((entry >> 1) & 3)) - 1;
+                stack->access(address);
+                if ((address ^ last) >> stack->lineBits) {
+                    stack->access(last);
+                }
+            }
+        }
+    }
+}
+
+// Split a comma-separated list
+static vector<string> splitList(const string &text) {
+    vector<string> items;
+    size_t start = 0;
+    while (true) {
+        size_t comma = text.find(',', start);
+        items.push_back(text.substr(start, comma - start));
+        if (comma == string::npos) {
+            return items;
+        }
+        start = comma + 1;
+    }
+}
+
+// A byte count with an optional k or m suffix, 0 if malformed
+static uint64_t parseBytes(const string &text) {
+    char *end;
+    uint64_t bytes = strtoull(text.c_str(), &end, 0);
+    if (*end == 'k' || *end == 'K') {
+        bytes <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        bytes <<= 20;
+        end++;
+    }
+    return *end == '\0' ? bytes : 0;
+}
+
+static bool isPowerOfTwo(uint64_t n) {
+    return n && !(n & (n - 1));
+}
+
+// Every combination of the sizes, ways and line sizes a spec lists, see
+// runSweep
+static bool parseSweep(const string &spec, vector<SweepPoint> &points, CacheReplacement &replacement) {
+    vector<string> parts;
+    size_t start = 0;
+    while (true) {
+        size_t colon = spec.find(':', start);
+        parts.push_back(spec.substr(start, colon - start));
+        if (colon == string::npos) {
+            break;
+        }
+        start = colon + 1;
+    }
+    replacement = REPLACE_LRU;
+    if (parts.size() == 4 && (parts[3] == "lru" || parts[3] == "plru")) {
+        replacement = parts[3] == "lru" ? REPLACE_LRU : REPLACE_PLRU;
+        parts.pop_back();
+    }
+    if (parts.size() != 3) {
+        fprintf(stderr, "Bad sweep %s: expected SIZES:WAYS:LINES[:lru|plru]\n", spec.c_str());
+        return false;
+    }
+
+    vector<uint64_t> sizes;
+    for (const string &item : splitList(parts[0])) {
+        size_t dash = item.find('-');
+        uint64_t low = parseBytes(item.substr(0, dash));
+        uint64_t high = dash == string::npos ? low : parseBytes(item.substr(dash + 1));
+        if (!isPowerOfTwo(low) || !isPowerOfTwo(high) || high < low) {
+            fprintf(stderr, "Bad sweep size %s: expected a power of two or a range of them\n", item.c_str());
+            return false;
+        }
+        for (uint64_t size = low; size <= high; size *= 2) {
+            sizes.push_back(size);
+        }
+    }
+    vector<unsigned> ways;
+    for (const string &item : splitList(parts[1])) {
+        unsigned n = item == "full" ? 0 : atoi(item.c_str());
+        if (item != "full" && (!isPowerOfTwo(n) || (replacement == REPLACE_PLRU && n > 64))) {
+            fprintf(stderr, "Bad sweep ways %s: expected a power of two or full\n", item.c_str());
+            return false;
+        }
+        ways.push_back(n);
+    }
+    vector<unsigned> lineSizes;
+    for (const string &item : splitList(parts[2])) {
+        unsigned n = atoi(item.c_str());
+        if (!isPowerOfTwo(n) || n < 8) {
+            fprintf(stderr, "Bad sweep line size %s: expected a power of two of at least 8\n", item.c_str());
+            return false;
+        }
+        lineSizes.push_back(n);
+    }
+
+    sort(sizes.begin(), sizes.end());
+    sizes.erase(unique(sizes.begin(), sizes.end()), sizes.end());
+    for (unsigned lineSize : lineSizes) {
+        for (uint64_t size : sizes) {
+            for (unsigned n : ways) {
+                if (size >= (uint64_t)max(n, 1u) * lineSize) {
+                    points.push_back({size, n, lineSize, nullptr, nullptr});
+                }
+            }
+        }
+    }
+    if (points.empty()) {
+        fprintf(stderr, "Bad sweep %s: no size holds a set of lines\n", spec.c_str());
+        return false;
+    }
+    return true;
+}
+
+static string sizeText(uint64_t size) {
+    char text[32];
+    if (size % (1 << 20) == 0) {
+        snprintf(text, sizeof(text), "%lu MB", size >> 20);
+    } else if (size % (1 << 10) == 0) {
+        snprintf(text, sizeof(text), "%lu KB", size >> 10);
+    } else {
+        snprintf(text, sizeof(text), "%lu B", size);
+    }
+    return text;
+}
+
+int runSweep(const char *programFile, const char *spec, unsigned numThreads, uint64_t maxInsts,
+             const char *csvFile) {
+    vector<SweepPoint> points;
+    CacheReplacement replacement;
+    if (!parseSweep(strcmp(spec, "default") == 0 ? SWEEP_DEFAULT : spec, points, replacement)) {
+        return -1;
+    }
+
+    // one stack distance analysis per line size covers every fully
+    // associative point of that line size
+    vector<unique_ptr<StackDistance>> stacks;
+    vector<Cache *> caches;
+    for (SweepPoint &point : points) {
+        if (point.ways > 0) {
+            CacheConfig config;
+            config.size = point.size;
+            config.ways = point.ways;
+            config.lineSize = point.lineSize;
+            config.replacement = replacement;
+            point.cache.reset(new Cache("sweep", config, nullptr));
+            caches.push_back(point.cache.get());
+            continue;
+        }
+        unsigned lineBits = __builtin_ctz(point.lineSize);
+        for (auto &stack : stacks) {
+            if (stack->lineBits == lineBits) {
+                point.stack = stack.get();
+            }
+        }
+        if (!point.stack) {
+            uint64_t maxLines = 0;
+            for (const SweepPoint &other : points) {
+                if (other.ways == 0 && other.lineSize == point.lineSize) {
+                    maxLines = max(maxLines, other.size / other.lineSize);
+                }
+            }
+            stacks.emplace_back(new StackDistance(lineBits, maxLines));
+            point.stack = stacks.back().get();
+        }
+    }
+
+    // deal the models out round robin, the stack distances first as they
+    // cost the most per access
+    size_t models = caches.size() + stacks.size();
+    if (numThreads == 0) {
+        numThreads = max(1u, thread::hardware_concurrency());
+    }
+    numThreads = min<size_t>(numThreads, models);
+    vector<vector<Cache *>> workerCaches(numThreads);
+    vector<vector<StackDistance *>> workerStacks(numThreads);
+    for (size_t i = 0; i < models; i++) {
+        if (i < stacks.size()) {
+            workerStacks[i % numThreads].push_back(stacks[i].get());
+        } else {
+            workerCaches[i % numThreads].push_back(caches[i - stacks.size()]);
+        }
+    }
+
+    Simulator sim;
+    if (!sim.load(programFile)) {
+        fprintf(stderr, "Failed to initialize memory with program binary.\n");
+        return -1;
+    }
+    AddressStream stream(numThreads);
+    vector<thread> workers;
+    for (unsigned i = 0; i < numThreads; i++) {
+        workers.emplace_back(sweepWorker, ref(stream), i, workerCaches[i], workerStacks[i]);
+    }
+
+    auto start = chrono::steady_clock::now();
+    sim.addressOut = &stream;
+    SimStatus status = sim.run(maxInsts);
+    stream.close();
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("Sweep: %lu instructions, %zu caches on %u threads in %.3f s\n", sim.stats.instructions,
+           points.size(), numThreads, seconds);
+
+    // a miss rate table per line size, sizes down and ways across
+    vector<unsigned> lineSizes, ways;
+    vector<uint64_t> sizes;
+    for (const SweepPoint &point : points) {
+        lineSizes.push_back(point.lineSize);
+        ways.push_back(point.ways ? point.ways : UINT32_MAX); // full last
+        sizes.push_back(point.size);
+    }
+    for (auto *list : {&lineSizes, &ways}) {
+        sort(list->begin(), list->end());
+        list->erase(unique(list->begin(), list->end()), list->end());
+    }
+    sort(sizes.begin(), sizes.end());
+    sizes.erase(unique(sizes.begin(), sizes.end()), sizes.end());
+
+    FILE *csv = nullptr;
+    if (csvFile) {
+        csv = fopen(csvFile, "w");
+        if (!csv) {
+            fprintf(stderr, "Cannot write %s\n", csvFile);
+            return -1;
+        }
+        fprintf(csv, "size,ways,line,replacement,accesses,misses,miss_rate\n");
+    }
+    for (unsigned lineSize : lineSizes) {
+        uint64_t accesses = 0;
+        for (const SweepPoint &point : points) {
+            if (point.lineSize == lineSize) {
+                accesses = point.cache ? point.cache->stats.reads + point.cache->stats.writes
+                                       : point.stack->accesses;
+            }
+        }
+        printf("Sweep: %u B lines, %s: %lu line accesses by loads and stores\n", lineSize,
+               replacement == REPLACE_LRU ? "LRU" : "PLRU (full: LRU)", accesses);
+        printf("Sweep: %10s", "size");
+        for (unsigned n : ways) {
+            if (n == UINT32_MAX) {
+                printf(" %8s", "full");
+            } else {
+                printf(" %4u-way", n);
+            }
+        }
+        printf("\n");
+
+        for (uint64_t size : sizes) {
+            printf("Sweep: %10s", sizeText(size).c_str());
+            for (unsigned n : ways) {
+                const SweepPoint *found = nullptr;
+                for (const SweepPoint &point : points) {
+                    if (point.lineSize == lineSize && point.size == size &&
+                        (point.ways ? point.ways : UINT32_MAX) == n) {
+                        found = &point;
+                    }
+                }
+                if (!found) {
+                    printf(" %8s", "-");
+                    continue;
+                }
+                uint64_t misses = found->cache ? found->cache->stats.readMisses + found->cache->stats.writeMisses
+                                               : found->stack->misses(size / lineSize);
+                double rate = accesses ? 100.0 * misses / accesses : 0.0;
+                printf(" %7.2f%%", rate);
+                if (csv) {
+                    fprintf(csv, "%lu,%s,%u,%s,%lu,%lu,%.6f\n", size,
+                            found->ways ? to_string(found->ways).c_str() : "full", lineSize,
+                            found->ways && replacement == REPLACE_PLRU ? "plru" : "lru", accesses, misses,
+                            rate / 100);
+                }
+            }
+            printf("\n");
+        }
+    }
+    if (csv && fclose(csv) != 0) {
+        fprintf(stderr, "Cannot write %s\n", csvFile);
+    }
+
+    switch (status) {
+        case SIM_HALT:
+            return 0;
+        case SIM_ILLEGAL:
+            fprintf(stderr, "Illegal instruction encountered at PC: 0x%lx\n", sim.PC);
+            return EXIT_ILLEGAL;
+        case SIM_LOOP:
+            fprintf(stderr, "Infinite loop detected at PC: 0x%lx after %lu instructions\n", sim.PC,
+                    sim.stats.instructions);
+            return EXIT_LOOP;
+        default:
+            fprintf(stderr, "Instruction limit of %lu reached at PC: 0x%lx\n", maxInsts, sim.PC);
+            return EXIT_MAX_INSTS;
+    }
+}
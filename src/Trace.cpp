@@ -0,0 +1,315 @@
+#include "Trace.h"
+
+#include <string.h>
+#include <chrono>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Instruction traces
+// --------------------------------------------------------------------------
+
+// A trace file is this magic followed by chunks, each a ChunkHeader and
+// the records one buffer published, compressed. A stream's records are
+// encoded against the ones before it in the same stream, so chunks of
+// different streams can interleave freely.
+#define TRACE_MAGIC "RVTRACE1"
+
+struct ChunkHeader {
+    uint32_t stream;
+    uint32_t records;
+    uint32_t bytes;
+};
+
+// Most records the writer takes from a buffer at once, so a full ring gets
+// space back before the writer has compressed all of it
+#define TRACE_DRAIN_RECORDS (TRACE_RING_RECORDS / 4)
+
+// How long the writer sleeps when no buffer has anything new
+#define TRACE_IDLE_MICROSECONDS 100
+
+// An encoded record starts with a tag byte: the record's flags in the low
+// bits, then which of the optional fields follow. The fields, in order:
+//   jump:     PC minus the next sequential PC, zigzag varint
+//   new inst: the instruction, 4 bytes, if the table has another at PC
+//   rd:       rdValue minus rd's previous value, zigzag varint
+//   mem:      memAddress minus the previous one, zigzag varint, then
+//             memValue as a varint unless it is rdValue cut to size
+#define TAG_FLAGS    7
+#define TAG_JUMP     8
+#define TAG_NEW_INST 16
+#define TAG_MEM_RD   32 // memValue is what the load wrote to rd
+
+TraceCodec::TraceCodec() {
+    memset(cachePC, 0xff, sizeof(cachePC));
+    memset(cacheInst, 0, sizeof(cacheInst));
+}
+
+// Longest encoding of one record: the tag, three varints of up to 10 bytes
+// (jump, rd, address), the instruction and one more varint (value)
+#define TRACE_MAX_ENCODED (1 + 10 + 4 + 10 + 10 + 10)
+
+static void putVarint(uint8_t *&out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+}
+
+static bool getVarint(const vector<uint8_t> &in, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+        uint8_t byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(uint64_t delta) {
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ -(value & 1);
+}
+
+// Mask of the bytes a load or store accesses, from its funct3
+static uint64_t accessMask(uint32_t instruction) {
+    unsigned size = 1 << ((instruction >> 12) & 0b11);
+    return size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+}
+
+static unsigned rdOf(uint32_t instruction) {
+    return (instruction >> 7) & 0x1f;
+}
+
+// Append the record at out, at most TRACE_MAX_ENCODED bytes
+static void encodeRecord(TraceCodec &codec, const TraceRecord &rec, uint8_t *&out) {
+    size_t slot = (rec.PC >> 2) & (TRACE_INST_CACHE - 1);
+    bool hasMem = rec.flags & (TRACE_READS_MEM | TRACE_WRITES_MEM);
+    bool memFromRd = (rec.flags & TRACE_READS_MEM) && (rec.flags & TRACE_WRITES_RD) &&
+                     rec.memValue == (rec.rdValue & accessMask(rec.instruction));
+
+    uint8_t tag = rec.flags & TAG_FLAGS;
+    if (rec.PC != codec.nextPC) {
+        tag |= TAG_JUMP;
+    }
+    if (codec.cachePC[slot] != rec.PC || codec.cacheInst[slot] != rec.instruction) {
+        tag |= TAG_NEW_INST;
+    }
+    if (memFromRd) {
+        tag |= TAG_MEM_RD;
+    }
+    *out++ = tag;
+
+    if (tag & TAG_JUMP) {
+        putVarint(out, zigzag(rec.PC - codec.nextPC));
+    }
+    if (tag & TAG_NEW_INST) {
+        memcpy(out, &rec.instruction, 4); // little-endian host
+        out += 4;
+        codec.cachePC[slot] = rec.PC;
+        codec.cacheInst[slot] = rec.instruction;
+    }
+    if (rec.flags & TRACE_WRITES_RD) {
+        uint64_t &reg = codec.regs[rdOf(rec.instruction)];
+        putVarint(out, zigzag(rec.rdValue - reg));
+        reg = rec.rdValue;
+    }
+    if (hasMem) {
+        putVarint(out, zigzag(rec.memAddress - codec.lastAddress));
+        codec.lastAddress = rec.memAddress;
+        if (!memFromRd) {
+            putVarint(out, rec.memValue);
+        }
+    }
+    codec.nextPC = rec.PC + 4;
+}
+
+static bool decodeRecord(TraceCodec &codec, const vector<uint8_t> &in, size_t &pos, TraceRecord &rec) {
+    if (pos >= in.size()) {
+        return false;
+    }
+    uint8_t tag = in[pos++];
+    uint64_t value;
+
+    rec.flags = tag & TAG_FLAGS;
+    rec.PC = codec.nextPC;
+    if (tag & TAG_JUMP) {
+        if (!getVarint(in, pos, value)) {
+            return false;
+        }
+        rec.PC += unzigzag(value);
+    }
+    size_t slot = (rec.PC >> 2) & (TRACE_INST_CACHE - 1);
+    if (tag & TAG_NEW_INST) {
+        if (pos + 4 > in.size()) {
+            return false;
+        }
+        codec.cachePC[slot] = rec.PC;
+        codec.cacheInst[slot] = in[pos] | in[pos + 1] << 8 | in[pos + 2] << 16 | (uint32_t)in[pos + 3] << 24;
+        pos += 4;
+    } else if (codec.cachePC[slot] != rec.PC) {
+        return false;
+    }
+    rec.instruction = codec.cacheInst[slot];
+
+    rec.rdValue = 0;
+    if (rec.flags & TRACE_WRITES_RD) {
+        if (!getVarint(in, pos, value)) {
+            return false;
+        }
+        uint64_t &reg = codec.regs[rdOf(rec.instruction)];
+        reg += unzigzag(value);
+        rec.rdValue = reg;
+    }
+    rec.memAddress = 0;
+    rec.memValue = 0;
+    if (rec.flags & (TRACE_READS_MEM | TRACE_WRITES_MEM)) {
+        if (!getVarint(in, pos, value)) {
+            return false;
+        }
+        codec.lastAddress += unzigzag(value);
+        rec.memAddress = codec.lastAddress;
+        if (tag & TAG_MEM_RD) {
+            rec.memValue = rec.rdValue & accessMask(rec.instruction);
+        } else if (!getVarint(in, pos, rec.memValue)) {
+            return false;
+        }
+    }
+    codec.nextPC = rec.PC + 4;
+    return true;
+}
+
+void TraceBuffer::waitForSpace() {
+    flush();
+    while ((freeUntil = consumed.load(memory_order_acquire) + TRACE_RING_RECORDS) == next) {
+        this_thread::yield();
+    }
+}
+
+bool TraceWriter::open(const char *traceFile) {
+    out = fopen(traceFile, "wb");
+    if (!out) {
+        return false;
+    }
+    failed = fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, out) != 1;
+    bytes = strlen(TRACE_MAGIC);
+    writerThread = thread(&TraceWriter::run, this);
+    return true;
+}
+
+TraceBuffer *TraceWriter::addBuffer() {
+    lock_guard<mutex> guard(buffersLock);
+    buffers.emplace_back(new TraceBuffer());
+    codecs.emplace_back(new TraceCodec());
+    return buffers.back().get();
+}
+
+bool TraceWriter::close() {
+    if (!out) {
+        return false;
+    }
+    stopping.store(true, memory_order_release);
+    writerThread.join();
+    failed = fclose(out) != 0 || failed;
+    out = nullptr;
+    return !failed;
+}
+
+void TraceWriter::run() {
+    vector<uint8_t> chunk;
+    while (true) {
+        // whatever was published before close() was called gets written
+        // on the last round
+        bool stop = stopping.load(memory_order_acquire);
+        bool wrote = false;
+        {
+            lock_guard<mutex> guard(buffersLock);
+            for (size_t i = 0; i < buffers.size(); i++) {
+                while (drain(i, *buffers[i], *codecs[i], chunk)) {
+                    wrote = true;
+                }
+            }
+        }
+        if (stop) {
+            break;
+        }
+        if (!wrote) {
+            this_thread::sleep_for(chrono::microseconds(TRACE_IDLE_MICROSECONDS));
+        }
+    }
+}
+
+// Compress and write what the buffer published since the last time, at
+// most TRACE_DRAIN_RECORDS of it. Returns false if there was nothing.
+bool TraceWriter::drain(uint32_t stream, TraceBuffer &buffer, TraceCodec &codec, vector<uint8_t> &chunk) {
+    uint64_t start = buffer.consumed.load(memory_order_relaxed);
+    uint64_t end = min<uint64_t>(buffer.published.load(memory_order_acquire), start + TRACE_DRAIN_RECORDS);
+    if (start == end) {
+        return false;
+    }
+
+    if (chunk.size() < TRACE_DRAIN_RECORDS * TRACE_MAX_ENCODED) {
+        chunk.resize(TRACE_DRAIN_RECORDS * TRACE_MAX_ENCODED);
+    }
+    uint8_t *encoded = chunk.data();
+    for (uint64_t i = start; i < end; i++) {
+        encodeRecord(codec, buffer.records[i & (TRACE_RING_RECORDS - 1)], encoded);
+    }
+    uint32_t size = encoded - chunk.data();
+    buffer.consumed.store(end, memory_order_release);
+
+    ChunkHeader header = {stream, (uint32_t)(end - start), size};
+    failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+             fwrite(chunk.data(), size, 1, out) != 1 || failed;
+    records += end - start;
+    bytes += sizeof(header) + size;
+    return true;
+}
+
+TraceReader::~TraceReader() {
+    if (in) {
+        fclose(in);
+    }
+}
+
+bool TraceReader::open(const char *traceFile) {
+    in = fopen(traceFile, "rb");
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    return in && fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool TraceReader::next(TraceRecord &rec, uint32_t &stream) {
+    while (chunkRecords == 0) {
+        ChunkHeader header;
+        size_t got = fread(&header, 1, sizeof(header), in);
+        if (got != sizeof(header)) {
+            failed = got != 0; // a clean end falls between chunks
+            return false;
+        }
+        chunk.resize(header.bytes);
+        if (fread(chunk.data(), 1, chunk.size(), in) != chunk.size()) {
+            failed = true;
+            return false;
+        }
+        pos = 0;
+        chunkStream = header.stream;
+        chunkRecords = header.records;
+        if (!codecs[chunkStream]) {
+            codecs[chunkStream].reset(new TraceCodec());
+        }
+    }
+
+    if (!decodeRecord(*codecs[chunkStream], chunk, pos, rec)) {
+        failed = true;
+        return false;
+    }
+    stream = chunkStream;
+    chunkRecords--;
+    return true;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Records one ring buffer holds, a power of two
+#define TRACE_RING_RECORDS (1 << 16)
+
+// Records the simulation thread writes before it makes them visible to the
+// writer thread, a power of two dividing TRACE_RING_RECORDS
+#define TRACE_PUBLISH 1024
+
+// Entries of the direct-mapped table of instructions seen at each PC, which
+// spares the trace the raw instruction on every trip around a loop
+#define TRACE_INST_CACHE 4096
+
+// What a TraceRecord holds besides the PC and instruction
+#define TRACE_WRITES_RD  1 // rdValue went to rd, which is not x0
+#define TRACE_READS_MEM  2 // memAddress and memValue of a load
+#define TRACE_WRITES_MEM 4 // memAddress and memValue of a store
+
+// One executed instruction. memValue is the bytes accessed, zero-extended.
+struct TraceRecord {
+    uint64_t PC;
+    uint64_t rdValue;
+    uint64_t memAddress;
+    uint64_t memValue;
+    uint32_t instruction;
+    uint32_t flags;
+};
+
+// The ring one simulation thread appends its records to. Only that thread
+// calls record() and flush(); the TraceWriter it came from drains the ring
+// in the background. A full ring makes record() wait for the writer.
+class TraceBuffer
+{
+    public:
+        TraceBuffer() : records(TRACE_RING_RECORDS) {}
+
+        TraceBuffer(const TraceBuffer &) = delete;
+        TraceBuffer &operator=(const TraceBuffer &) = delete;
+
+        void record(const TraceRecord &rec) {
+            if (next == freeUntil) {
+                waitForSpace();
+            }
+            records[next & (TRACE_RING_RECORDS - 1)] = rec;
+            if ((++next & (TRACE_PUBLISH - 1)) == 0) {
+                published.store(next, std::memory_order_release);
+            }
+        }
+
+        // Make every record so far visible to the writer
+        void flush() { published.store(next, std::memory_order_release); }
+
+    private:
+        friend class TraceWriter;
+
+        std::vector<TraceRecord> records;
+        uint64_t next = 0;                      // records appended
+        uint64_t freeUntil = TRACE_RING_RECORDS; // next can go this far without waiting
+        std::atomic<uint64_t> published {0};    // records the writer may take
+        std::atomic<uint64_t> consumed {0};     // records the writer is done with
+
+        void waitForSpace();
+};
+
+// State the encoder and decoder of one stream keep in step: the encoding
+// leaves out whatever follows from the records before
+struct TraceCodec {
+    uint64_t nextPC = 0;
+    uint64_t lastAddress = 0;
+    uint64_t regs[32] = {0};
+    uint64_t cachePC[TRACE_INST_CACHE];
+    uint32_t cacheInst[TRACE_INST_CACHE];
+
+    TraceCodec();
+};
+
+// Owns a trace file and the thread that writes it. Every TraceBuffer handed
+// out is a stream of its own in the file; the thread takes what each has
+// published, compresses it and appends it as a chunk.
+class TraceWriter
+{
+    public:
+        TraceWriter() = default;
+        ~TraceWriter() { close(); }
+
+        TraceWriter(const TraceWriter &) = delete;
+        TraceWriter &operator=(const TraceWriter &) = delete;
+
+        // Create the file and start the writer thread
+        bool open(const char *traceFile);
+
+        // A new stream for one simulation thread, valid until close()
+        TraceBuffer *addBuffer();
+
+        // Write out whatever the buffers published, then stop. The
+        // simulation threads must have flushed their buffers.
+        bool close();
+
+        uint64_t records = 0; // written so far
+        uint64_t bytes = 0;   // file size so far
+
+    private:
+        FILE *out = nullptr;
+        std::thread writerThread;
+        std::atomic<bool> stopping {false};
+        bool failed = false;
+
+        std::mutex buffersLock;
+        std::vector<std::unique_ptr<TraceBuffer>> buffers;
+        std::vector<std::unique_ptr<TraceCodec>> codecs;
+
+        void run();
+        bool drain(uint32_t stream, TraceBuffer &buffer, TraceCodec &codec, std::vector<uint8_t> &chunk);
+};
+
+// Reads a trace file back a record at a time
+class TraceReader
+{
+    public:
+        TraceReader() = default;
+        ~TraceReader();
+
+        TraceReader(const TraceReader &) = delete;
+        TraceReader &operator=(const TraceReader &) = delete;
+
+        bool open(const char *traceFile);
+
+        // The next record and the stream it is from; false at the end of
+        // the trace, or if it is cut short or corrupt (see failed)
+        bool next(TraceRecord &rec, uint32_t &stream);
+
+        bool failed = false;
+
+    private:
+        FILE *in = nullptr;
+        std::vector<uint8_t> chunk;
+        size_t pos = 0;
+        uint32_t chunkStream = 0;
+        uint32_t chunkRecords = 0; // left in the chunk
+        std::map<uint32_t, std::unique_ptr<TraceCodec>> codecs;
+};
@@ -0,0 +1,60 @@
+#include <string>
+
+#include "RegisterInfo.h"
+#include "Trace.h"
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Trace reader
+// --------------------------------------------------------------------------
+
+// Print a trace written by sim --trace as text, one instruction per line:
+// PC, raw instruction, disassembly, then the register written and the
+// memory loaded (->) or stored (<-). Lines of streams other than the first
+// start with the stream number.
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+        return -1;
+    }
+
+    TraceReader reader;
+    if (!reader.open(argv[1])) {
+        fprintf(stderr, "\tError open trace %s\n", argv[1]);
+        return -1;
+    }
+
+    TraceRecord rec;
+    uint32_t stream;
+    uint64_t records = 0;
+    while (reader.next(rec, stream)) {
+        if (stream != 0) {
+            printf("[%u] ", stream);
+        }
+        string text = disassembleInstruction(rec.instruction);
+        size_t last = text.find_last_not_of(' ');
+        text = last == string::npos ? "" : text.substr(0, last + 1);
+        printf("0x%08lx: %08x %s", rec.PC, rec.instruction, text.c_str());
+        if (rec.flags && text.size() < 24) {
+            printf("%*s", (int)(24 - text.size()), "");
+        }
+        if (rec.flags & TRACE_WRITES_RD) {
+            printf("  x%u = 0x%016lx", (rec.instruction >> 7) & 0x1f, rec.rdValue);
+        }
+        if (rec.flags & TRACE_READS_MEM) {
+            printf("  [0x%lx] -> 0x%lx", rec.memAddress, rec.memValue);
+        }
+        if (rec.flags & TRACE_WRITES_MEM) {
+            printf("  [0x%lx] <- 0x%lx", rec.memAddress, rec.memValue);
+        }
+        printf("\n");
+        records++;
+    }
+
+    if (reader.failed) {
+        fprintf(stderr, "\tError reading trace %s after %lu records\n", argv[1], records);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,376 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Ahead-of-time translation to C++
+// --------------------------------------------------------------------------
+
+// sim --translate decodes every word of a program's .text section with the
+// simulator's own decoder and writes a C++ file with one function per basic
+// block. Blocks branch to each other by index; jalr targets, and anything
+// else only known at run time, are looked up in a table of block start
+// PCs sorted for binary search. Built against the simulator sources (make
+// translated PROG=...), the file becomes an executable that loads the same
+// program for its data, runs the translated code on the Simulator's
+// registers and memory, and writes the same dump files.
+//
+// Halt and illegal instructions are never translated, and neither is code
+// outside .text. When the translated code reaches a PC without a block,
+// runTranslated hands that block to simBlock instead, so halts, illegal
+// instructions and code found only at run time behave exactly as in sim.
+// The same goes for code the program modifies: the words of every
+// translated block are marked like those of a decoded block, and a store to
+// one disables the block, leaving what is there now to simBlock.
+
+// Destination register, or nullptr when the result goes to x0
+static const char *destReg(const Instruction &inst, char *buf, size_t size) {
+    if (inst.rd == 0) {
+        return nullptr;
+    }
+    snprintf(buf, size, "R[%d]", inst.rd);
+    return buf;
+}
+
+// C++ expression for an ALU instruction's result, empty if it is not one
+static string aluExpression(const Instruction &inst) {
+    char a[16], b[32];
+    snprintf(a, sizeof(a), "R[%d]", inst.rs1);
+    if (inst.readsRs2) {
+        snprintf(b, sizeof(b), "R[%d]", inst.rs2);
+    } else {
+        snprintf(b, sizeof(b), "0x%lxULL", inst.imm);
+    }
+
+    char expr[128];
+    switch (inst.id) {
+        case INSC_ADD: case INSC_ADDI: snprintf(expr, sizeof(expr), "%s + %s", a, b); break;
+        case INSC_SUB:   snprintf(expr, sizeof(expr), "%s - %s", a, b); break;
+        case INSC_AND: case INSC_ANDI: snprintf(expr, sizeof(expr), "%s & %s", a, b); break;
+        case INSC_OR:  case INSC_ORI:  snprintf(expr, sizeof(expr), "%s | %s", a, b); break;
+        case INSC_XOR: case INSC_XORI: snprintf(expr, sizeof(expr), "%s ^ %s", a, b); break;
+        case INSC_SLT: case INSC_SLTI:
+            snprintf(expr, sizeof(expr), "(int64_t)%s < (int64_t)%s", a, b); break;
+        case INSC_SLTU: case INSC_SLTIU:
+            snprintf(expr, sizeof(expr), "%s < %s", a, b); break;
+        case INSC_SLL: case INSC_SLLI:
+            snprintf(expr, sizeof(expr), "%s << (%s & 0x3f)", a, b); break;
+        case INSC_SRL: case INSC_SRLI:
+            snprintf(expr, sizeof(expr), "%s >> (%s & 0x3f)", a, b); break;
+        case INSC_SRA: case INSC_SRAI:
+            snprintf(expr, sizeof(expr), "(uint64_t)((int64_t)%s >> (%s & 0x3f))", a, b); break;
+        case INSC_ADDW: case INSC_ADDIW:
+            snprintf(expr, sizeof(expr), "(uint64_t)(int64_t)(int32_t)(%s + %s)", a, b); break;
+        case INSC_SUBW:
+            snprintf(expr, sizeof(expr), "(uint64_t)(int64_t)(int32_t)(%s - %s)", a, b); break;
+        case INSC_SLLW: case INSC_SLLIW:
+            snprintf(expr, sizeof(expr), "(uint64_t)(int64_t)(int32_t)(%s << (%s & 0x1f))", a, b); break;
+        case INSC_SRLW: case INSC_SRLIW:
+            snprintf(expr, sizeof(expr), "(uint64_t)(int64_t)(int32_t)((uint32_t)%s >> (%s & 0x1f))", a, b); break;
+        case INSC_SRAW: case INSC_SRAIW:
+            snprintf(expr, sizeof(expr), "(uint64_t)((int64_t)(int32_t)%s >> (%s & 0x1f))", a, b); break;
+        case INSC_LUI:
+            snprintf(expr, sizeof(expr), "0x%lxULL", inst.imm); break;
+        case INSC_AUIPC:
+            snprintf(expr, sizeof(expr), "0x%lxULL", inst.PC + inst.imm); break;
+        default:
+            return "";
+    }
+    return expr;
+}
+
+static const char *branchCondition(InscId id) {
+    switch (id) {
+        case INSC_BEQ:  return "R[%d] == R[%d]";
+        case INSC_BNE:  return "R[%d] != R[%d]";
+        case INSC_BLT:  return "(int64_t)R[%d] < (int64_t)R[%d]";
+        case INSC_BGE:  return "(int64_t)R[%d] >= (int64_t)R[%d]";
+        case INSC_BLTU: return "R[%d] < R[%d]";
+        default:        return "R[%d] >= R[%d]"; // INSC_BGEU
+    }
+}
+
+static const char *sizeName(MemEntrySize size) {
+    switch (size) {
+        case BYTE_SIZE: return "BYTE_SIZE";
+        case HALF_SIZE: return "HALF_SIZE";
+        case WORD_SIZE: return "WORD_SIZE";
+        default:        return "DOUBLE_SIZE";
+    }
+}
+
+class CppTranslator
+{
+    public:
+        CppTranslator(FILE *out, const map<uint64_t, int> &blockIndex) : out(out), blockIndex(blockIndex) {}
+
+        // Continue at a PC known at translation time
+        void emitGoto(uint64_t target) {
+            auto found = blockIndex.find(target);
+            if (found != blockIndex.end()) {
+                fprintf(out, "return %d; /* 0x%lx */", found->second, target);
+            } else {
+                fprintf(out, "PC = 0x%lxULL; return -1;", target);
+            }
+        }
+
+        void emitInstruction(const Instruction &inst) {
+            string text = disassembleInstruction(inst.instruction);
+            size_t first = text.find_first_not_of(' ');
+            text = first == string::npos ? "" : text.substr(first, text.find_last_not_of(' ') - first + 1);
+            fprintf(out, "    // 0x%08lx: %s\n", inst.PC, text.c_str());
+
+            char destBuf[16];
+            const char *dest = destReg(inst, destBuf, sizeof(destBuf));
+            MemEntrySize size = (MemEntrySize)(1 << (inst.funct3 & 0b11));
+
+            if (inst.doesArithLogic) {
+                if (dest) {
+                    fprintf(out, "    %s = %s;\n", dest, aluExpression(inst).c_str());
+                }
+            } else if (inst.readsMem) {
+                if (dest) {
+                    static const char *const signedCast[] = {"", "(int8_t)", "(int16_t)", "", "(int32_t)"};
+                    bool isSigned = !(inst.funct3 & 0b100) && size != DOUBLE_SIZE;
+                    fprintf(out, "    { uint64_t value; mem->getMemValue(R[%d] + 0x%lxULL, value, %s); ",
+                            inst.rs1, inst.imm, sizeName(size));
+                    fprintf(out, "%s = %s; }\n", dest, isSigned ?
+                            (string("(uint64_t)(int64_t)") + signedCast[size] + "value").c_str() : "value");
+                }
+            } else if (inst.writesMem) {
+                fprintf(out, "    mem->setMemValue(R[%d] + 0x%lxULL, R[%d], %s);\n",
+                        inst.rs1, inst.imm, inst.rs2, sizeName(size));
+            } else if (inst.id == INSC_JAL) {
+                if (dest) {
+                    fprintf(out, "    %s = 0x%lxULL;\n", dest, inst.PC + 4);
+                }
+                fprintf(out, "    ");
+                emitGoto(inst.PC + inst.imm);
+                fprintf(out, "\n");
+            } else if (inst.id == INSC_JALR) {
+                fprintf(out, "    PC = (R[%d] + 0x%lxULL) & ~1ULL;\n", inst.rs1, inst.imm);
+                if (dest) {
+                    fprintf(out, "    %s = 0x%lxULL;\n", dest, inst.PC + 4);
+                }
+                fprintf(out, "    return -1;\n");
+            } else {
+                fprintf(out, "    if (");
+                fprintf(out, branchCondition(inst.id), inst.rs1, inst.rs2);
+                fprintf(out, ") { ");
+                emitGoto(inst.PC + inst.imm);
+                fprintf(out, " }\n    ");
+                emitGoto(inst.PC + 4);
+                fprintf(out, "\n");
+            }
+        }
+
+    private:
+        FILE *out;
+        const map<uint64_t, int> &blockIndex;
+};
+
+static void writeEscaped(FILE *out, const char *text) {
+    for (; *text; text++) {
+        if (*text == '\\' || *text == '"') {
+            fputc('\\', out);
+        }
+        fputc(*text, out);
+    }
+}
+
+int translateProgram(const char *programFile, const char *outputFile) {
+    uint64_t start, end;
+    Simulator sim;
+    if (!findCode(programFile, start, end) || !sim.load(programFile)) {
+        fprintf(stderr, "Failed to read program %s\n", programFile);
+        return -1;
+    }
+    start = (start + 3) & ~3ULL;
+    end &= ~3ULL;
+
+    // decode all of .text
+    vector<Instruction> code;
+    for (uint64_t PC = start; PC < end; PC += 4) {
+        Instruction inst;
+        simFetch(PC, sim.myMem, inst);
+        simDecode(inst);
+        code.push_back(inst);
+    }
+
+    // blocks start at the entry point, at branch and jump targets, and
+    // after every branch, jump, halt or illegal instruction
+    set<uint64_t> leaders = {sim.PC, start};
+    for (const Instruction &inst : code) {
+        if (isControlFlow(inst) || inst.isHalt || !inst.isLegal) {
+            leaders.insert(inst.PC + 4);
+        }
+        if (inst.isLegal && (inst.id == INSC_JAL || inst.opcode == OP_STRBYT)) {
+            leaders.insert(inst.PC + inst.imm);
+        }
+    }
+
+    // only leaders inside .text that start with a translatable instruction
+    // get a block; the rest are left to the interpreter
+    auto instAt = [&](uint64_t PC) -> const Instruction* {
+        return (PC >= start && PC < end && !(PC & 3)) ? &code[(PC - start) / 4] : nullptr;
+    };
+    map<uint64_t, int> blockIndex;
+    for (uint64_t leader : leaders) {
+        const Instruction *inst = instAt(leader);
+        if (inst && inst->isLegal && !inst->isHalt) {
+            int index = blockIndex.size();
+            blockIndex[leader] = index;
+        }
+    }
+
+    FILE *out = fopen(outputFile, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write %s\n", outputFile);
+        return -1;
+    }
+
+    fprintf(out, "// Translated from %s by sim --translate. Build it with\n", programFile);
+    fprintf(out, "//     make translated PROG=<this file without .cpp>\n");
+    fprintf(out, "// and run it with the program to load data from, by default the one\n");
+    fprintf(out, "// it was translated from.\n\n");
+    fprintf(out, "#include \"sim.h\"\n\n");
+
+    CppTranslator translator(out, blockIndex);
+    vector<uint64_t> blockEnds;
+    for (auto &block : blockIndex) {
+        fprintf(out, "static int block_%lx(uint64_t *R, PagedMemory *mem, uint64_t &PC) {\n", block.first);
+        uint64_t PC = block.first;
+        while (true) {
+            const Instruction *inst = instAt(PC);
+            if (!inst) {
+                fprintf(out, "    PC = 0x%lxULL; return -1; // end of .text\n", PC);
+                break;
+            }
+            if (!inst->isLegal || inst->isHalt) {
+                fprintf(out, "    PC = 0x%lxULL; return -1; // %s\n", PC,
+                        inst->isHalt ? "halt" : "illegal instruction");
+                break;
+            }
+            translator.emitInstruction(*inst);
+            PC += 4;
+            if (isControlFlow(*inst)) {
+                break;
+            }
+            if (leaders.count(PC)) {
+                fprintf(out, "    ");
+                translator.emitGoto(PC);
+                fprintf(out, "\n");
+                break;
+            }
+        }
+        fprintf(out, "}\n\n");
+        blockEnds.push_back(PC); // past the last instruction translated
+    }
+
+    fprintf(out, "static const uint64_t blockPCs[] = {\n");
+    for (auto &block : blockIndex) {
+        fprintf(out, "    0x%lxULL,\n", block.first);
+    }
+    fprintf(out, "};\n\nstatic const uint64_t blockEnds[] = {\n");
+    for (uint64_t end : blockEnds) {
+        fprintf(out, "    0x%lxULL,\n", end);
+    }
+    fprintf(out, "};\n\nstatic const TranslatedBlock blocks[] = {\n");
+    for (auto &block : blockIndex) {
+        fprintf(out, "    block_%lx,\n", block.first);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main(int argc, char **argv) {\n");
+    fprintf(out, "    TranslatedProgram program = {blockPCs, blockEnds, blocks, %zu};\n", blockIndex.size());
+    fprintf(out, "    return runTranslated(argc > 1 ? argv[1] : \"");
+    writeEscaped(out, programFile);
+    fprintf(out, "\", program);\n}\n");
+
+    bool ok = !ferror(out);
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Cannot write %s\n", outputFile);
+        return -1;
+    }
+    printf("Translated %zu instructions into %zu blocks in %s\n", code.size(), blockIndex.size(), outputFile);
+    return 0;
+}
+
+// Index of the translated block starting at PC, -1 if there is none
+static int findBlock(const TranslatedProgram &program, uint64_t PC) {
+    const uint64_t *end = program.blockPCs + program.numBlocks;
+    const uint64_t *found = lower_bound(program.blockPCs, end, PC);
+    return (found != end && *found == PC) ? found - program.blockPCs : -1;
+}
+
+int runTranslated(const char *programFile, const TranslatedProgram &program) {
+    Simulator sim;
+    if (!sim.load(programFile)) {
+        fprintf(stderr, "Failed to initialize memory with program binary.\n");
+        return -1;
+    }
+
+    uint64_t *R = sim.regData.registers;
+    PagedMemory *mem = sim.myMem;
+
+    // the translated instructions are marked like decoded ones, so stores
+    // to them are recorded; the blocks they overlap are never run again
+    vector<bool> valid(program.numBlocks, true);
+    for (size_t i = 0; i < program.numBlocks; i++) {
+        mem->markCode(program.blockPCs[i], program.blockEnds[i] - program.blockPCs[i]);
+    }
+    auto validBlock = [&](uint64_t PC) {
+        int index = findBlock(program, PC);
+        return index >= 0 && valid[index] ? index : -1;
+    };
+
+    uint64_t PC = sim.PC;
+    int next = validBlock(PC);
+    SimStatus status = SIM_RUNNING;
+    vector<uint64_t> stores;
+    while (status == SIM_RUNNING) {
+        if (mem->codeWritten()) {
+            // blocks don't overlap, so a store of at most 8 bytes reaches
+            // into the one starting at or below it and any starting within
+            sim.invalidateCode(&stores);
+            for (uint64_t address : stores) {
+                const uint64_t *end = program.blockPCs + program.numBlocks;
+                const uint64_t *block = upper_bound(program.blockPCs, end, address);
+                if (block != program.blockPCs && address < program.blockEnds[block - 1 - program.blockPCs]) {
+                    valid[block - 1 - program.blockPCs] = false;
+                }
+                for (; block != end && *block < address + 8; block++) {
+                    valid[block - program.blockPCs] = false;
+                }
+            }
+        }
+        if (next >= 0 && valid[next]) {
+            next = program.blocks[next](R, mem, PC);
+            continue;
+        }
+        if (next >= 0) {
+            // a direct branch into a disabled block
+            PC = program.blockPCs[next];
+        }
+        next = validBlock(PC);
+        if (next < 0) {
+            // no translation here, interpret one block
+            uint64_t budget = UINT64_MAX;
+            sim.PC = PC;
+            status = simBlock(sim, budget);
+            PC = sim.PC;
+            next = validBlock(PC);
+        }
+    }
+
+    sim.dump();
+    if (status == SIM_ILLEGAL) {
+        fprintf(stderr, "Illegal instruction encountered at PC: 0x%lx\n", sim.PC);
+        exit(EXIT_ILLEGAL);
+    }
+    return 0;
+}
@@ -2,12 +2,9 @@
 
 using namespace std;
 
-constexpr int NUM_OPCODE = 128; // 7 bit opcode
+constexpr int NUM_OPCODE = 32; // opcode[6:2], every RV64I opcode ends in 0b11
 constexpr int NUM_FUNCT3 = 8; //  3 bit funct 3 fields
-constexpr int NUM_FUNCT7 = 128; // 7 bit funct 7 fields
-
-InscDecode decodeNon7[NUM_OPCODE][NUM_FUNCT3]; // a table to store the opcode and fuct3 functions
-InscDecode decode7[NUM_OPCODE][NUM_FUNCT3][NUM_FUNCT7]; // a table to store the R format commands
+constexpr int NUM_FUNCT7_VARIANTS = 32; // funct7 variants that actually exist
 
 // RV64I without csr, environment, or fence instructions
 
@@ -19,615 +16,332 @@ InscDecode decode7[NUM_OPCODE][NUM_FUNCT3][NUM_FUNCT7]; // a table to store the
 // U  type: | imm[31:12]                        | rd          | opcode |
 // UJ type: | imm[20|10:1|11|19:12]             | rd          | opcode |
 
-// initialize memory with program binary
-bool initMemory(char *programFile, MemoryStore *myMem) {
-    // open instruction file
-    ifstream infile;
-    infile.open(programFile, ios::binary | ios::in);
-
-    if (!infile.is_open()) {
-        fprintf(stderr, "\tError open input file\n");
-        return false;
-    }
-
-    // get length of the file and read instruction file into a buffer
-    infile.seekg(0, ios::end);
-    int length = infile.tellg();
-    infile.seekg (0, ios::beg);
+// dump registers and memory
+void dump(REGS &regData, MemoryStore *myMem) {
 
-    char *buf = new char[length];
-    infile.read(buf, length);
-    infile.close();
+    dumpRegisterState(regData.reg);
 
-    int memLength = length / sizeof(buf[0]);
-    int i;
-    for (i = 0; i < memLength; i++) {
-        myMem->setMemValue(i * BYTE_SIZE, buf[i], BYTE_SIZE);
+    // dumpMemoryState only accepts the store from createMemoryStore(),
+    // so other backends are copied into one first
+    MemoryStore *dumpMem = createMemoryStore();
+    for (uint64_t address = 0; address < MEMORY_SIZE; address += DOUBLE_SIZE) {
+        uint64_t value;
+        myMem->getMemValue(address, value, DOUBLE_SIZE);
+        dumpMem->setMemValue(address, value, DOUBLE_SIZE);
     }
-
-    return true;
+    dumpMemoryState(dumpMem);
+    delete dumpMem;
 }
 
-// dump registers and memory
-void dump(MemoryStore *myMem) {
-
-    dumpRegisterState(regData.reg);
-    dumpMemoryState(myMem);
+// Same formats as dumpRegisterState and dumpMemoryState, but to any file,
+// so simulations running side by side each get their own
+static const char *const registerNames[REG_SIZE] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1",
+    "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+};
+
+void writeRegisterState(FILE *out, const REGS &regData) {
+    fprintf(out, "---------------------\nBegin Register Values\n---------------------\n");
+    for (int i = 1; i < REG_SIZE; i++) {
+        fprintf(out, "$%s = 0x%016lx\n", registerNames[i], regData.registers[i]);
+        // blank line after tp, t2, s1, a7 and s11
+        if (i == 4 || i == 7 || i == 9 || i == 17 || i == 27) {
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "---------------------\nEnd Register Values\n---------------------\n");
 }
 
-// TODO All functions below (except main) are incomplete.
-// Only ADDI is implemented. Your task is to complete these functions.
+void writeMemoryState(FILE *out, MemoryStore *myMem) {
+    fprintf(out, "---------------------\nBegin Memory State\n---------------------\n");
+    for (uint64_t address = 0; address < DUMP_MEMORY_BYTES; address += 20) {
+        fprintf(out, "0x%08lx: ", address);
+        for (uint64_t word = address; word < address + 20; word += 4) {
+            uint64_t value;
+            myMem->getMemValue(word, value, WORD_SIZE);
+            fprintf(out, "0x%02lx%02lx%02lx%02lx ", value & 0xff, (value >> 8) & 0xff,
+                    (value >> 16) & 0xff, value >> 24);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "---------------------\nEnd Memory State\n---------------------\n");
+}
 
 // Get raw instruction bits from memory
-Instruction simFetch(uint64_t PC, MemoryStore *myMem) {
+void simFetch(uint64_t PC, MemoryStore *myMem, Instruction &inst) {
     // fetch current instruction
     uint64_t instruction;
     myMem->getMemValue(PC, instruction, WORD_SIZE);
-    instruction = (uint32_t)instruction;
 
-    Instruction inst;
     inst.PC = PC;
-    inst.instruction = instruction;
-    return inst;
+    inst.instruction = (uint32_t)instruction;
 }
 
-static void InstDecode() {
-    decodeNon7[OP_INTIMM][FUNCT3_ADD] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAddi
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_SLL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSlli
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_SET] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSlti
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_STU] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSltiu
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_XOR] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeXori
-    };
-
-    decode7[OP_INTIMM][FUNCT3_SHIFT][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSrli
-    };
-
-    decode7[OP_INTIMM][FUNCT3_SHIFT][FUNCT7_SA] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSrai
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_OR] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeOri
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_ADD] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAddi
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_ADD] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAddi
-    };
-
-    decodeNon7[OP_INTIMM][FUNCT3_AND] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAndi
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_BYT] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLb
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_HLW] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLh
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_WRD] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLw
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_DBL] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLd
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_BYU] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLbu
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_HWU] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLhu
-    };
-
-    decodeNon7[OP_OFFIMM][FUNCT3_WDU] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = true,
-        .writesMem = false,
-        .execution = executeLwu
-    };
-
-    decode7[OP_WORIMM][FUNCT3_SLL][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSlliw
-    };
-
-    decode7[OP_WORIMM][FUNCT3_SHIFT][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSrliw
-    };
-
-    decode7[OP_WORIMM][FUNCT3_SHIFT][FUNCT7_SA] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSraiw
-    };
-
-    decodeNon7[OP_LNKREG][FUNCT3_JAL] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeJalr
-    };
-
-    decode7[OP_REGFMT][FUNCT3_ADD][FUNCT7_ADD] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAdd
-    };
-
-    decode7[OP_REGFMT][FUNCT3_SUB][FUNCT7_SUB] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSub
-    };
-
-    decode7[OP_REGFMT][FUNCT3_SLL][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSll
-    };
-
-    decode7[OP_REGFMT][FUNCT3_SET][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSlt
-    };
-
-    decode7[OP_REGFMT][FUNCT3_STU][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSltu
-    };
-
-    decode7[OP_REGFMT][FUNCT3_XOR][FUNCT7_XOR] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeXor
-    };
-
-    decode7[OP_REGFMT][FUNCT3_SHIFT][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSrl
-    };
-
-    decode7[OP_REGFMT][FUNCT3_SHIFT][FUNCT7_SA] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSra
-    };
-
-    decode7[OP_REGFMT][FUNCT3_OR][FUNCT7_OR] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeOr
-    };
-
-    decode7[OP_REGFMT][FUNCT3_AND][FUNCT7_AND] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAnd
-    };
-
-    decode7[OP_REGWRD][FUNCT3_ADD][FUNCT7_ADD] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAddw
-    };
+// Per-instruction execution handlers. Each one is invoked by the stage that
+// owns its instruction class: control flow in simNextPCResolution, ALU and
+// upper-immediate ops in simArithLogic, loads/stores in simAddrGen.
+static void executeAdd(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val + ex.op2Val; };
+static void executeAddw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend(ex.op1Val + ex.op2Val, 32); };
+static void executeAddi(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val + inst.imm; };
+static void executeAddiw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend(ex.op1Val + inst.imm, 32); };
+static void executeAnd(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val & ex.op2Val; };
+static void executeAndi(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val & inst.imm; };
+static void executeAuipc(const Instruction& inst, InFlight& ex){ ex.arithResult = inst.PC + inst.imm; };
+static void executeBeq(const Instruction& inst, InFlight& ex){ if (ex.op1Val == ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeBge(const Instruction& inst, InFlight& ex){ if ((int64_t)ex.op1Val >= (int64_t)ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeBgeu(const Instruction& inst, InFlight& ex){ if (ex.op1Val >= ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeBlt(const Instruction& inst, InFlight& ex){ if ((int64_t)ex.op1Val < (int64_t)ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeBltu(const Instruction& inst, InFlight& ex){ if (ex.op1Val < ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeBne(const Instruction& inst, InFlight& ex){ if (ex.op1Val != ex.op2Val) ex.nextPC = inst.PC + inst.imm; };
+static void executeJal(const Instruction& inst, InFlight& ex){ ex.arithResult = inst.PC + 4; ex.nextPC = inst.PC + inst.imm; };
+static void executeJalr(const Instruction& inst, InFlight& ex){ ex.arithResult = inst.PC + 4; ex.nextPC = (ex.op1Val + inst.imm) & ~1ULL; };
+static void executeLb(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLbu(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLd(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLh(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLhu(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLui(const Instruction& inst, InFlight& ex){ ex.arithResult = inst.imm; };
+static void executeLw(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeLwu(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeOr(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val | ex.op2Val; };
+static void executeOri(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val | inst.imm; };
+static void executeSb(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeSd(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeSh(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeSll(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val << (ex.op2Val & 0x3f); };
+static void executeSllw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend(ex.op1Val << (ex.op2Val & 0x1f), 32); };
+static void executeSlli(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val << (inst.imm & 0x3f); };
+static void executeSlliw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend(ex.op1Val << (inst.imm & 0x1f), 32); };
+static void executeSlt(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)ex.op1Val < (int64_t)ex.op2Val; };
+static void executeSlti(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)ex.op1Val < (int64_t)inst.imm; };
+static void executeSltiu(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val < inst.imm; };
+static void executeSltu(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val < ex.op2Val; };
+static void executeSra(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)ex.op1Val >> (ex.op2Val & 0x3f); };
+static void executeSraw(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)(int32_t)ex.op1Val >> (ex.op2Val & 0x1f); };
+static void executeSrai(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)ex.op1Val >> (inst.imm & 0x3f); };
+static void executeSraiw(const Instruction& inst, InFlight& ex){ ex.arithResult = (int64_t)(int32_t)ex.op1Val >> (inst.imm & 0x1f); };
+static void executeSrl(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val >> (ex.op2Val & 0x3f); };
+static void executeSrlw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend((uint32_t)ex.op1Val >> (ex.op2Val & 0x1f), 32); };
+static void executeSrli(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val >> (inst.imm & 0x3f); };
+static void executeSrliw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend((uint32_t)ex.op1Val >> (inst.imm & 0x1f), 32); };
+static void executeSub(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val - ex.op2Val; };
+static void executeSubw(const Instruction& inst, InFlight& ex){ ex.arithResult = signExtend(ex.op1Val - ex.op2Val, 32); };
+static void executeSw(const Instruction& inst, InFlight& ex){ ex.memAddress = ex.op1Val + inst.imm; };
+static void executeXor(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val ^ ex.op2Val; };
+static void executeXori(const Instruction& inst, InFlight& ex){ ex.arithResult = ex.op1Val ^ inst.imm; };
+
+// Two-level decode table, built at compile time. The primary table is dense
+// over opcode[6:2]/funct3 (4 KB). Groups where funct7 picks the instruction
+// point at a short run of variants in the secondary table instead.
+struct DecodeTables {
+    InscDecode primary[NUM_OPCODE * NUM_FUNCT3];
+    InscDecode funct7Variants[NUM_FUNCT7_VARIANTS];
+    int numFunct7Variants = 0;
+};
+
+constexpr int decodeIndex(uint64_t opcode, uint64_t funct3) {
+    return (opcode >> 2) * NUM_FUNCT3 + funct3;
+}
 
-    decode7[OP_REGFMT][FUNCT3_SUB][FUNCT7_SUB] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSubw
-    };
+constexpr InscDecode makeDecode(InscId id, bool doesArithLogic, bool writesRd,
+                                bool readsRs1, bool readsRs2,
+                                bool readsMem, bool writesMem,
+                                ExecHandler execution) {
+    InscDecode decode{};
+    decode.isLegal = true;
+    decode.id = id;
+    decode.doesArithLogic = doesArithLogic;
+    decode.writesRd = writesRd;
+    decode.readsRs1 = readsRs1;
+    decode.readsRs2 = readsRs2;
+    decode.readsMem = readsMem;
+    decode.writesMem = writesMem;
+    decode.execution = execution;
+    return decode;
+}
 
-    decode7[OP_REGFMT][FUNCT3_SLL][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSllw
-    };
+// Resource usage of each instruction class
+constexpr InscDecode regOp(InscId id, ExecHandler fn)    { return makeDecode(id, true,  true,  true,  true,  false, false, fn); }
+constexpr InscDecode immOp(InscId id, ExecHandler fn)    { return makeDecode(id, true,  true,  true,  false, false, false, fn); }
+constexpr InscDecode upperOp(InscId id, ExecHandler fn)  { return makeDecode(id, true,  true,  false, false, false, false, fn); }
+constexpr InscDecode loadOp(InscId id, ExecHandler fn)   { return makeDecode(id, false, true,  true,  false, true,  false, fn); }
+constexpr InscDecode storeOp(InscId id, ExecHandler fn)  { return makeDecode(id, false, false, true,  true,  false, true,  fn); }
+constexpr InscDecode branchOp(InscId id, ExecHandler fn) { return makeDecode(id, false, false, true,  true,  false, false, fn); }
+constexpr InscDecode jumpOp(InscId id, ExecHandler fn, bool readsRs1) {
+    return makeDecode(id, false, true, readsRs1, false, false, false, fn);
+}
 
-    decode7[OP_REGFMT][FUNCT3_SHIFT][FUNCT7_SL] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSrlw
-    };
+constexpr void addDecode(DecodeTables &tables, uint64_t opcode, uint64_t funct3, InscDecode decode) {
+    tables.primary[decodeIndex(opcode, funct3)] = decode;
+}
 
-    decode7[OP_REGFMT][FUNCT3_SHIFT][FUNCT7_SA] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = true,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeSraw
-    };
+// Variants of one opcode/funct3 group must be added back to back
+constexpr void addDecode(DecodeTables &tables, uint64_t opcode, uint64_t funct3, uint64_t funct7, InscDecode decode) {
+    InscDecode &group = tables.primary[decodeIndex(opcode, funct3)];
+    if (group.funct7Count == 0) {
+        group.funct7Base = tables.numFunct7Variants;
+    }
+    group.funct7Count++;
 
-    decodeNon7[OP_STRFMT][FUNCT3_BYT] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = true,
-        .execution = executeSb
-    };
+    decode.funct7 = funct7;
+    tables.funct7Variants[tables.numFunct7Variants++] = decode;
+}
 
-    decodeNon7[OP_STRFMT][FUNCT3_HLW] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = true,
-        .execution = executeSh
-    };
+constexpr DecodeTables buildDecodeTables() {
+    DecodeTables tables{};
+
+    addDecode(tables, OP_INTIMM, FUNCT3_ADD, immOp(INSC_ADDI, executeAddi));
+    addDecode(tables, OP_INTIMM, FUNCT3_SLL, FUNCT7_SL, immOp(INSC_SLLI, executeSlli));
+    addDecode(tables, OP_INTIMM, FUNCT3_SET, immOp(INSC_SLTI, executeSlti));
+    addDecode(tables, OP_INTIMM, FUNCT3_STU, immOp(INSC_SLTIU, executeSltiu));
+    addDecode(tables, OP_INTIMM, FUNCT3_XOR, immOp(INSC_XORI, executeXori));
+    addDecode(tables, OP_INTIMM, FUNCT3_SHIFT, FUNCT7_SL, immOp(INSC_SRLI, executeSrli));
+    addDecode(tables, OP_INTIMM, FUNCT3_SHIFT, FUNCT7_SA, immOp(INSC_SRAI, executeSrai));
+    addDecode(tables, OP_INTIMM, FUNCT3_OR, immOp(INSC_ORI, executeOri));
+    addDecode(tables, OP_INTIMM, FUNCT3_AND, immOp(INSC_ANDI, executeAndi));
+
+    addDecode(tables, OP_OFFIMM, FUNCT3_BYT, loadOp(INSC_LB, executeLb));
+    addDecode(tables, OP_OFFIMM, FUNCT3_HLW, loadOp(INSC_LH, executeLh));
+    addDecode(tables, OP_OFFIMM, FUNCT3_WRD, loadOp(INSC_LW, executeLw));
+    addDecode(tables, OP_OFFIMM, FUNCT3_DBL, loadOp(INSC_LD, executeLd));
+    addDecode(tables, OP_OFFIMM, FUNCT3_BYU, loadOp(INSC_LBU, executeLbu));
+    addDecode(tables, OP_OFFIMM, FUNCT3_HWU, loadOp(INSC_LHU, executeLhu));
+    addDecode(tables, OP_OFFIMM, FUNCT3_WDU, loadOp(INSC_LWU, executeLwu));
+
+    addDecode(tables, OP_WORIMM, FUNCT3_ADD, immOp(INSC_ADDIW, executeAddiw));
+    addDecode(tables, OP_WORIMM, FUNCT3_SLL, FUNCT7_SL, immOp(INSC_SLLIW, executeSlliw));
+    addDecode(tables, OP_WORIMM, FUNCT3_SHIFT, FUNCT7_SL, immOp(INSC_SRLIW, executeSrliw));
+    addDecode(tables, OP_WORIMM, FUNCT3_SHIFT, FUNCT7_SA, immOp(INSC_SRAIW, executeSraiw));
+
+    addDecode(tables, OP_LNKREG, FUNCT3_JAL, jumpOp(INSC_JALR, executeJalr, true));
+
+    addDecode(tables, OP_REGFMT, FUNCT3_ADD, FUNCT7_ADD, regOp(INSC_ADD, executeAdd));
+    addDecode(tables, OP_REGFMT, FUNCT3_SUB, FUNCT7_SUB, regOp(INSC_SUB, executeSub));
+    addDecode(tables, OP_REGFMT, FUNCT3_SLL, FUNCT7_SL, regOp(INSC_SLL, executeSll));
+    addDecode(tables, OP_REGFMT, FUNCT3_SET, FUNCT7_SL, regOp(INSC_SLT, executeSlt));
+    addDecode(tables, OP_REGFMT, FUNCT3_STU, FUNCT7_SL, regOp(INSC_SLTU, executeSltu));
+    addDecode(tables, OP_REGFMT, FUNCT3_XOR, FUNCT7_XOR, regOp(INSC_XOR, executeXor));
+    addDecode(tables, OP_REGFMT, FUNCT3_SHIFT, FUNCT7_SL, regOp(INSC_SRL, executeSrl));
+    addDecode(tables, OP_REGFMT, FUNCT3_SHIFT, FUNCT7_SA, regOp(INSC_SRA, executeSra));
+    addDecode(tables, OP_REGFMT, FUNCT3_OR, FUNCT7_OR, regOp(INSC_OR, executeOr));
+    addDecode(tables, OP_REGFMT, FUNCT3_AND, FUNCT7_AND, regOp(INSC_AND, executeAnd));
+
+    addDecode(tables, OP_REGWRD, FUNCT3_ADD, FUNCT7_ADD, regOp(INSC_ADDW, executeAddw));
+    addDecode(tables, OP_REGWRD, FUNCT3_SUB, FUNCT7_SUB, regOp(INSC_SUBW, executeSubw));
+    addDecode(tables, OP_REGWRD, FUNCT3_SLL, FUNCT7_SL, regOp(INSC_SLLW, executeSllw));
+    addDecode(tables, OP_REGWRD, FUNCT3_SHIFT, FUNCT7_SL, regOp(INSC_SRLW, executeSrlw));
+    addDecode(tables, OP_REGWRD, FUNCT3_SHIFT, FUNCT7_SA, regOp(INSC_SRAW, executeSraw));
+
+    addDecode(tables, OP_STRFMT, FUNCT3_BYT, storeOp(INSC_SB, executeSb));
+    addDecode(tables, OP_STRFMT, FUNCT3_HLW, storeOp(INSC_SH, executeSh));
+    addDecode(tables, OP_STRFMT, FUNCT3_WRD, storeOp(INSC_SW, executeSw));
+    addDecode(tables, OP_STRFMT, FUNCT3_DBL, storeOp(INSC_SD, executeSd));
+
+    addDecode(tables, OP_STRBYT, FUNCT3_BEQ, branchOp(INSC_BEQ, executeBeq));
+    addDecode(tables, OP_STRBYT, FUNCT3_BNE, branchOp(INSC_BNE, executeBne));
+    addDecode(tables, OP_STRBYT, FUNCT3_BLT, branchOp(INSC_BLT, executeBlt));
+    addDecode(tables, OP_STRBYT, FUNCT3_BGE, branchOp(INSC_BGE, executeBge));
+    addDecode(tables, OP_STRBYT, FUNCT3_BLU, branchOp(INSC_BLTU, executeBltu));
+    addDecode(tables, OP_STRBYT, FUNCT3_BGU, branchOp(INSC_BGEU, executeBgeu));
+
+    // U/UJ formats have no funct3, simDecode leaves it at 0
+    addDecode(tables, OP_ADDIMM, 0, upperOp(INSC_AUIPC, executeAuipc));
+    addDecode(tables, OP_LDUIMM, 0, upperOp(INSC_LUI, executeLui));
+    addDecode(tables, OP_JMPLNK, 0, jumpOp(INSC_JAL, executeJal, false));
+
+    return tables;
+}
 
-    decodeNon7[OP_STRFMT][FUNCT3_WRD] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = true,
-        .execution = executeSw
-    };
+constexpr DecodeTables decodeTables = buildDecodeTables();
 
-    decodeNon7[OP_STRFMT][FUNCT3_DBL] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = true,
-        .execution = executeSd
-    };
+// Handler of every InscId, so a decoded Instruction needs only its id
+struct HandlerTable {
+    ExecHandler byId[NUM_INSC];
+};
 
-    decodeNon7[OP_STRBYT][FUNCT3_BEQ] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBeq
-    };
+constexpr HandlerTable buildHandlerTable() {
+    HandlerTable handlers{};
+    for (const InscDecode &decode : decodeTables.primary) {
+        if (decode.isLegal) {
+            handlers.byId[decode.id] = decode.execution;
+        }
+    }
+    for (const InscDecode &decode : decodeTables.funct7Variants) {
+        if (decode.isLegal) {
+            handlers.byId[decode.id] = decode.execution;
+        }
+    }
+    return handlers;
+}
 
-    decodeNon7[OP_STRBYT][FUNCT3_BNE] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBne
-    };
+constexpr HandlerTable handlerTable = buildHandlerTable();
+static const ExecHandler *const handlers = handlerTable.byId;
 
-    decodeNon7[OP_STRBYT][FUNCT3_BLT] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBlt
-    };
+static_assert(sizeof(decodeTables.primary) <= 4096, "primary decode table should stay within 4 KB");
 
-    decodeNon7[OP_STRBYT][FUNCT3_BGE] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBge
-    };
+// Look up the decode entry for an instruction, nullptr if it is illegal
+static const InscDecode *lookupDecode(const Instruction &inst) {
+    if ((inst.opcode & 0b11) != 0b11) {
+        return nullptr;
+    }
 
-    decodeNon7[OP_STRBYT][FUNCT3_BLU] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBlt
-    };
+    const InscDecode &group = decodeTables.primary[decodeIndex(inst.opcode, inst.funct3)];
+    if (group.funct7Count == 0) {
+        return group.isLegal ? &group : nullptr;
+    }
 
-    decodeNon7[OP_STRBYT][FUNCT3_BGU] = {
-        .isLegal = true,
-        .doesArithLogic = true,
-        .writesRd = false,
-        .readsRs1 = true,
-        .readsRs2 = true,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeBgeu
-    };
+    for (int i = group.funct7Base; i < group.funct7Base + group.funct7Count; i++) {
+        if (decodeTables.funct7Variants[i].funct7 == inst.funct7) {
+            return &decodeTables.funct7Variants[i];
+        }
+    }
+    return nullptr;
+}
 
-    decodeNon7[OP_ADDIMM][0] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = false,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeAuipc
-    };
+// Sign-extend the low `bits` bits of value to 64 bits
+uint64_t signExtend(uint64_t value, int bits) {
+    uint64_t mask = 1ULL << (bits - 1);
+    value &= (bits == 64) ? ~0ULL : ((1ULL << bits) - 1);
+    return (value ^ mask) - mask;
+}
 
-    decodeNon7[OP_LDUIMM][0] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = false,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeLui
-    };
+// Extract bits [hi:lo] of value
+uint64_t extractBits(uint64_t value, int hi, int lo) {
+    return (value >> lo) & ((1ULL << (hi - lo + 1)) - 1);
+}
 
-    decodeNon7[OP_JMPLNK][0] = {
-        .isLegal = true,
-        .doesArithLogic = false,
-        .writesRd = true,
-        .readsRs1 = false,
-        .readsRs2 = false,
-        .readsMem = false,
-        .writesMem = false,
-        .execution = executeJal
-    };
+// Assemble the sign-extended immediate for the instruction's format
+static uint64_t decodeImmediate(uint64_t instruction, uint64_t opcode) {
+    switch (opcode) {
+        case OP_INTIMM:
+        case OP_OFFIMM:
+        case OP_WORIMM:
+        case OP_LNKREG:
+            return signExtend(extractBits(instruction, 31, 20), 12);
+        case OP_STRFMT:
+            return signExtend(extractBits(instruction, 31, 25) << 5 |
+                              extractBits(instruction, 11, 7), 12);
+        case OP_STRBYT:
+            return signExtend(extractBits(instruction, 31, 31) << 12 |
+                              extractBits(instruction, 7, 7) << 11 |
+                              extractBits(instruction, 30, 25) << 5 |
+                              extractBits(instruction, 11, 8) << 1, 13);
+        case OP_ADDIMM:
+        case OP_LDUIMM:
+            return signExtend(instruction & 0xfffff000, 32);
+        case OP_JMPLNK:
+            return signExtend(extractBits(instruction, 31, 31) << 20 |
+                              extractBits(instruction, 19, 12) << 12 |
+                              extractBits(instruction, 20, 20) << 11 |
+                              extractBits(instruction, 30, 21) << 1, 21);
+        default:
+            return 0;
+    }
 }
 
 // Determine instruction opcode, funct, reg names, and what resources to use
-Instruction simDecode(Instruction inst) {
-    // Fill in the decode table ahead of time
-    InstDecode();
-
+void simDecode(Instruction &inst) {
     inst.opcode = inst.instruction & 0b1111111;
 
     if (inst.opcode != OP_STRFMT && inst.opcode != OP_STRBYT) {
@@ -650,53 +364,95 @@ Instruction simDecode(Instruction inst) {
         inst.rs2 = inst.instruction >> 20 & 0b11111;
     }
 
-    if (inst.opcode == OP_REGFMT || inst.opcode == OP_REGWRD) 
+    // Shift immediates keep their funct7 in the upper immediate bits
+    bool isShiftImm = (inst.opcode == OP_INTIMM || inst.opcode == OP_WORIMM) &&
+                      (inst.funct3 == FUNCT3_SLL || inst.funct3 == FUNCT3_SHIFT);
+
+    if (inst.opcode == OP_REGFMT || inst.opcode == OP_REGWRD || isShiftImm) 
     {
         inst.funct7 = inst.instruction >> 25 & 0b1111111;
     }
-    
+    if (inst.opcode == OP_INTIMM && isShiftImm) {
+        inst.funct7 &= 0b1111110; // bit 25 is shamt[5] on RV64
+    }
+
+    inst.imm = decodeImmediate(inst.instruction, inst.opcode);
 
     if (inst.instruction == 0xfeedfeed) {
         inst.isHalt = true;
-        return inst; // halt instruction
+        inst.id = INSC_HALT;
+        return; // halt instruction
     }
     if (inst.instruction == 0x00000013) {
-        inst.isNop = true;
-        return inst; // NOP instruction
+        inst.isNop = true; // NOP instruction, decoded as addi x0, x0, 0
     }
     //inst.isLegal = true; // assume legal unless proven otherwise
 
-    if (inst.opcode == OP_REGFMT || inst.opcode == OP_REGWRD) 
-    {
-        InscDecode decode = decode7[inst.opcode][inst.funct3][inst.funct7];
-        inst.isLegal = decode.isLegal;
-        inst.doesArithLogic = decode.doesArithLogic;
-        inst.writesRd = decode.writesRd;
-        inst.readsRs1 = decode.readsRs1;
-        inst.readsRs2 = decode.readsRs2;
-        inst.readsMem = decode.readsMem;
-        inst.writesMem = decode.writesMem;
-    }
-    else{
-        InscDecode decode = decodeNon7[inst.opcode][inst.funct3];
-        inst.isLegal = decode.isLegal;
-        inst.doesArithLogic = decode.doesArithLogic;
-        inst.writesRd = decode.writesRd;
-        inst.readsRs1 = decode.readsRs1;
-        inst.readsRs2 = decode.readsRs2;
-        inst.readsMem = decode.readsMem;
-        inst.writesMem = decode.writesMem;
+    const InscDecode *decode = lookupDecode(inst);
+    if (decode) {
+        inst.isLegal = decode->isLegal;
+        inst.doesArithLogic = decode->doesArithLogic;
+        inst.writesRd = decode->writesRd;
+        inst.readsRs1 = decode->readsRs1;
+        inst.readsRs2 = decode->readsRs2;
+        inst.readsMem = decode->readsMem;
+        inst.writesMem = decode->writesMem;
+        inst.id = (InscId)decode->id;
     }
-    return inst;
+}
+
+// Recognize an adjacent pair of instructions that compilers emit together
+// and the threaded engine can run as one op. The first of each pair
+// produces the register the second one reads: lui+addi(w) and auipc+jalr
+// build constants and far calls, slli+add scales an index, addi+branch
+// closes a counted loop. Returns INSC_ILLEGAL when the pair does not fuse.
+// Neither half can be a halt or illegal instruction, and nothing in a pair
+// touches memory, so execution never stops between the two.
+static InscId fusePair(const Instruction &first, const Instruction &second) {
+    if (first.rd == 0 || !second.isLegal) {
+        return INSC_ILLEGAL;
+    }
+    bool readsFirst = (second.readsRs1 && second.rs1 == first.rd) ||
+                      (second.readsRs2 && second.rs2 == first.rd);
+    if (!readsFirst) {
+        return INSC_ILLEGAL;
+    }
+
+    switch (first.id) {
+        case INSC_LUI:
+            if (second.id == INSC_ADDI) return INSC_LUI_ADDI;
+            if (second.id == INSC_ADDIW) return INSC_LUI_ADDIW;
+            break;
+        case INSC_AUIPC:
+            if (second.id == INSC_JALR) return INSC_AUIPC_JALR;
+            break;
+        case INSC_SLLI:
+            if (second.id == INSC_ADD) return INSC_SLLI_ADD;
+            break;
+        case INSC_ADDI:
+            switch (second.id) {
+                case INSC_BEQ:  return INSC_ADDI_BEQ;
+                case INSC_BNE:  return INSC_ADDI_BNE;
+                case INSC_BLT:  return INSC_ADDI_BLT;
+                case INSC_BGE:  return INSC_ADDI_BGE;
+                case INSC_BLTU: return INSC_ADDI_BLTU;
+                case INSC_BGEU: return INSC_ADDI_BGEU;
+                default: break;
+            }
+            break;
+        default:
+            break;
+    }
+    return INSC_ILLEGAL;
 }
 
 // Collect reg operands for arith or addr gen
-Instruction simOperandCollection(Instruction inst, REGS regData) {
+void simOperandCollection(const Instruction &inst, InFlight &ex, const REGS &regData) {
 
     if (inst.opcode != OP_ADDIMM &&
         inst.opcode != OP_LDUIMM &&
         inst.opcode != OP_JMPLNK) {
-        inst.op1Val = regData.registers[inst.rs1];
+        ex.op1Val = regData.registers[inst.rs1];
     }
 
     if (inst.opcode == OP_REGFMT ||
@@ -704,152 +460,784 @@ Instruction simOperandCollection(Instruction inst, REGS regData) {
         inst.opcode == OP_STRFMT || 
         inst.opcode == OP_STRBYT) 
     {
-        inst.op2Val = regData.registers[inst.rs2];
+        ex.op2Val = regData.registers[inst.rs2];
     }
-    return inst;
+}
+
+// Does this instruction (possibly) redirect the PC?
+bool isControlFlow(const Instruction &inst) {
+    return inst.opcode == OP_STRBYT ||
+           inst.opcode == OP_JMPLNK ||
+           inst.opcode == OP_LNKREG;
 }
 
 // Resolve next PC whether +4 or branch/jump target
-Instruction simNextPCResolution(Instruction inst) {
+void simNextPCResolution(const Instruction &inst, InFlight &ex) {
 
-    inst.nextPC = inst.PC + 4;
+    ex.nextPC = inst.PC + 4;
 
-    return inst;
+    // branch and jump handlers overwrite nextPC when they redirect
+    if (isControlFlow(inst)) {
+        handlers[inst.id](inst, ex);
+    }
 }
 
-static void executeAdd(Instruction& inst){};
-static void executeAddw(Instruction& inst){};
-static void executeAddi(Instruction& inst){};
-static void executeAddiw(Instruction& inst){};
-static void executeAnd(Instruction& inst){};
-static void executeAndi(Instruction& inst){};
-static void executeAuipc(Instruction& inst){};
-static void executeBeq(Instruction& inst){};
-static void executeBge(Instruction& inst){};
-static void executeBgeu(Instruction& inst){};
-static void executeBlt(Instruction& inst){};
-static void executeBltu(Instruction& inst){};
-static void executeBne(Instruction& inst){};
-static void executeJal(Instruction& inst){};
-static void executeJalr(Instruction& inst){};
-static void executeLb(Instruction& inst){};
-static void executeLbu(Instruction& inst){};
-static void executeLd(Instruction& inst){};
-static void executeLh(Instruction& inst){};
-static void executeLhu(Instruction& inst){};
-static void executeLui(Instruction& inst){};
-static void executeLw(Instruction& inst){};
-static void executeLwu(Instruction& inst){};
-static void executeOr(Instruction& inst){};
-static void executeOri(Instruction& inst){};
-static void executeSb(Instruction& inst){};
-static void executeSd(Instruction& inst){};
-static void executeSh(Instruction& inst){};
-static void executeSll(Instruction& inst){};
-static void executeSllw(Instruction& inst){};
-static void executeSlli(Instruction& inst){};
-static void executeSlliw(Instruction& inst){};
-static void executeSlt(Instruction& inst){};
-static void executeSlti(Instruction& inst){};
-static void executeSltiu(Instruction& inst){};
-static void executeSltu(Instruction& inst){};
-static void executeSra(Instruction& inst){};
-static void executeSraw(Instruction& inst){};
-static void executeSrai(Instruction& inst){};
-static void executeSraiw(Instruction& inst){};
-static void executeSrl(Instruction& inst){};
-static void executeSrlw(Instruction& inst){};
-static void executeSrli(Instruction& inst){};
-static void executeSrliw(Instruction& inst){};
-static void executeSub(Instruction& inst){};
-static void executeSubw(Instruction& inst){};
-static void executeSw(Instruction& inst){};
-static void executeXor(Instruction& inst){};
-static void executeXori(Instruction& inst){};
-
 // Perform arithmetic/logic operations
-Instruction simArithLogic(Instruction inst) {
-    uint64_t imm12  = inst.instruction >> 20 & 0b111111111111;
-    uint64_t sext_imm12 = (imm12 & 0x800) ? (imm12 | 0xFFFFFFFFFFFFF000) : imm12;
-
-    inst.arithResult = inst.op1Val + sext_imm12;
-      
-    return inst;
+void simArithLogic(const Instruction &inst, InFlight &ex) {
+    if (inst.doesArithLogic) {
+        handlers[inst.id](inst, ex);
+    }
 }
 
 // Generate memory address for load/store instructions
-Instruction simAddrGen(Instruction inst) {
-    return inst;
+void simAddrGen(const Instruction &inst, InFlight &ex) {
+    if (inst.readsMem || inst.writesMem) {
+        handlers[inst.id](inst, ex);
+    }
 }
 
 // Perform memory access for load/store instructions
-Instruction simMemAccess(Instruction inst, MemoryStore *myMem) {
-    return inst;
+void simMemAccess(const Instruction &inst, InFlight &ex, MemoryStore *myMem) {
+    // funct3[1:0] encodes the access size, funct3[2] an unsigned load
+    MemEntrySize size = (MemEntrySize)(1 << (inst.funct3 & 0b11));
+
+    if (inst.readsMem) {
+        myMem->getMemValue(ex.memAddress, ex.memResult, size);
+        if (!(inst.funct3 & 0b100)) {
+            ex.memResult = signExtend(ex.memResult, size * 8);
+        }
+    }
+
+    if (inst.writesMem) {
+        myMem->setMemValue(ex.memAddress, ex.op2Val, size);
+    }
 }
 
 // Write back results to registers
-Instruction simCommit(Instruction inst, REGS &regData) {
+void simCommit(const Instruction &inst, const InFlight &ex, REGS &regData) {
 
     // regData here is passed by reference, so changes will be reflected in original
-    if (inst.opcode != OP_STRFMT && inst.opcode != OP_STRBYT) {
-        regData.registers[inst.rd] = inst.arithResult;
+    if (inst.writesRd && inst.rd != 0) {
+        regData.registers[inst.rd] = inst.readsMem ? ex.memResult : ex.arithResult;
     }
-    return inst;
+}
+
+// Run the execution stages of one decoded instruction
+static void simExecute(const Instruction &inst, uint64_t &PC, MemoryStore *myMem, REGS &regData,
+                       InFlight &ex) {
+    simOperandCollection(inst, ex, regData);
+    simNextPCResolution(inst, ex);
+    simArithLogic(inst, ex);
+    simAddrGen(inst, ex);
+    simMemAccess(inst, ex, myMem);
+    simCommit(inst, ex, regData);
+    PC = ex.nextPC;
 }
 
 // Simulate the whole instruction using functions above
 Instruction simInstruction(uint64_t &PC, MemoryStore *myMem, REGS &regData) {
-    Instruction inst = simFetch(PC, myMem);
-    inst = simDecode(inst);
+    InFlight ex;
+    return simInstruction(PC, myMem, regData, ex);
+}
+
+Instruction simInstruction(uint64_t &PC, MemoryStore *myMem, REGS &regData, InFlight &ex) {
+    Instruction inst;
+    simFetch(PC, myMem, inst);
+    simDecode(inst);
     if (!inst.isLegal || inst.isHalt) return inst;
-    inst = simOperandCollection(inst, regData);
-    inst = simNextPCResolution(inst);
-    inst = simArithLogic(inst);
-    inst = simAddrGen(inst);
-    inst = simMemAccess(inst, myMem);
-    inst = simCommit(inst, regData);
-    PC = inst.nextPC;
+    simExecute(inst, PC, myMem, regData, ex);
     return inst;
 }
 
+// Fetch and decode the block starting at PC, or return the cached copy
+DecodedBlock &simDecodeBlock(Simulator &sim, uint64_t PC) {
+    auto cached = sim.blockCache.find(PC);
+    if (cached != sim.blockCache.end()) {
+        return cached->second;
+    }
+
+    DecodedBlock &block = sim.blockCache[PC];
+    block.startPC = PC;
+
+    uint64_t instPC = PC;
+    while (block.insts.size() < MAX_BLOCK_INSTS) {
+        Instruction inst;
+        simFetch(instPC, sim.myMem, inst);
+        simDecode(inst);
+        block.insts.push_back(inst);
+        if (!inst.isLegal || inst.isHalt || isControlFlow(inst)) {
+            break;
+        }
+        instPC += 4;
+    }
+
+    // stores to these words drop the block again
+    for (uint64_t vpn = PC >> PAGE_BITS; vpn <= (instPC + 3) >> PAGE_BITS; vpn++) {
+        sim.codePages[vpn].push_back(PC);
+    }
+    sim.myMem->markCode(PC, instPC + 4 - PC);
+    return block;
+}
+
+// Append what an instruction did to the trace
+static void traceInstruction(TraceBuffer *trace, const Instruction &inst, const InFlight &ex) {
+    TraceRecord rec;
+    rec.PC = inst.PC;
+    rec.instruction = inst.instruction;
+    rec.flags = 0;
+    rec.rdValue = 0;
+    rec.memAddress = 0;
+    rec.memValue = 0;
+    if (inst.writesRd && inst.rd != 0) {
+        rec.flags |= TRACE_WRITES_RD;
+        rec.rdValue = inst.readsMem ? ex.memResult : ex.arithResult;
+    }
+    if (inst.readsMem || inst.writesMem) {
+        unsigned size = 1 << (inst.funct3 & 0b11);
+        uint64_t mask = size == DOUBLE_SIZE ? ~0ULL : (1ULL << (size * 8)) - 1;
+        rec.flags |= inst.readsMem ? TRACE_READS_MEM : TRACE_WRITES_MEM;
+        rec.memAddress = ex.memAddress;
+        rec.memValue = (inst.readsMem ? ex.memResult : ex.op2Val) & mask;
+    }
+    trace->record(rec);
+}
+
+// Simulate one cached block, skipping fetch and decode. Stops early on a
+// halt or illegal instruction, leaving PC pointing at it, or when the
+// budget runs out.
+SimStatus simBlock(Simulator &sim, uint64_t &budget) {
+    if (sim.myMem->codeWritten()) {
+        sim.invalidateCode();
+    }
+    DecodedBlock &block = simDecodeBlock(sim, sim.PC);
+
+    SimStatus status = SIM_RUNNING;
+    size_t executed = 0;
+    for (const Instruction &inst : block.insts) {
+        if (inst.isHalt) { status = SIM_HALT; break; }
+        if (!inst.isLegal) { status = SIM_ILLEGAL; break; }
+        if (budget == 0) break;
+
+        InFlight ex;
+        simExecute(inst, sim.PC, sim.myMem, sim.regData, ex);
+        if (sim.caches) {
+            sim.caches->fetch(inst.PC);
+            if (inst.readsMem || inst.writesMem) {
+                sim.caches->data(ex.memAddress, 1 << (inst.funct3 & 0b11), inst.writesMem);
+            }
+        }
+        if (sim.addressOut && (inst.readsMem || inst.writesMem)) {
+            sim.addressOut->record(ex.memAddress, inst.funct3 & 0b11, inst.writesMem);
+        }
+        if (sim.traceOut) {
+            traceInstruction(sim.traceOut, inst, ex);
+        }
+        budget--;
+        executed++;
+    }
+    if (sim.profile) {
+        profileBlock(sim, block, executed);
+    }
+    return status;
+}
+
+// Translate a cached block into ThreadedOps for simThreaded, whose label
+// addresses are in labels
+static void translateBlock(DecodedBlock &block, const void *const *labels) {
+    const vector<Instruction> &insts = block.insts;
+    for (size_t i = 0; i < insts.size(); i++) {
+        const Instruction &inst = insts[i];
+        ThreadedOp threadedOp;
+        threadedOp.target = labels[inst.id];
+        threadedOp.PC = inst.PC;
+        threadedOp.imm = inst.imm;
+        threadedOp.rd = (inst.writesRd && inst.rd != 0) ? inst.rd : REG_SIZE;
+        threadedOp.rs1 = inst.rs1;
+        threadedOp.rs2 = inst.rs2;
+
+        InscId fused = i + 1 < insts.size() ? fusePair(inst, insts[i + 1]) : INSC_ILLEGAL;
+        if (fused != INSC_ILLEGAL) {
+            const Instruction &second = insts[++i];
+            threadedOp.target = labels[fused];
+            threadedOp.fusedImm = second.imm;
+            threadedOp.fusedRd = (second.writesRd && second.rd != 0) ? second.rd : REG_SIZE;
+            threadedOp.fusedRs1 = second.rs1;
+            threadedOp.fusedRs2 = second.rs2;
+        }
+        block.threaded.push_back(threadedOp);
+    }
+    const Instruction &last = block.insts.back();
+    if (last.isLegal && !last.isHalt && !isControlFlow(last)) {
+        ThreadedOp threadedOp;
+        threadedOp.target = labels[INSC_FALLTHROUGH];
+        threadedOp.PC = last.PC + 4;
+        block.threaded.push_back(threadedOp);
+    }
+}
+
+// Build the trace of a hot loop starting at head: the ops of each block
+// along the path the loop took last time, each block behind a
+// TRACE_BLOCK op that charges its instructions to the budget, and a
+// TRACE_LOOP op back to the start. Every block still ends in its own branch
+// or fallthrough, so when the guest leaves the path the engine just finds
+// the PC is not the one the next TRACE_BLOCK expects and leaves the trace.
+static void buildTrace(DecodedBlock &head, const void *const *labels) {
+    vector<ThreadedOp> trace;
+    DecodedBlock *block = &head;
+    for (int n = 0; n < MAX_TRACE_BLOCKS; n++) {
+        if (block->threaded.empty()) {
+            translateBlock(*block, labels);
+        }
+        ThreadedOp entry;
+        entry.target = labels[INSC_TRACE_BLOCK];
+        entry.PC = block->startPC;
+        entry.imm = block->insts.size();
+        trace.push_back(entry);
+        trace.insert(trace.end(), block->threaded.begin(), block->threaded.end());
+
+        block = block->lastTaken ? block->taken : block->notTaken;
+        if (!block) {
+            return; // ran into a halt or a path not seen yet
+        }
+        if (block == &head) {
+            ThreadedOp loop;
+            loop.target = labels[INSC_TRACE_LOOP];
+            loop.PC = head.startPC;
+            loop.imm = trace.size();
+            trace.push_back(loop);
+            head.trace = move(trace);
+            return;
+        }
+    }
+}
+
+// The block PC leads to from the block just run, through from's links when
+// they already point there. A block that backward branches reach
+// TRACE_THRESHOLD times starts a loop and gets a trace.
+static DecodedBlock &chainBlock(Simulator &sim, DecodedBlock &from, uint64_t PC, const void *const *labels) {
+    from.lastTaken = PC != from.insts.back().PC + 4;
+    DecodedBlock *&link = from.lastTaken ? from.taken : from.notTaken;
+    if (!link || link->startPC != PC) {
+        link = &simDecodeBlock(sim, PC);
+    }
+
+    DecodedBlock &next = *link;
+    if (PC <= from.startPC && next.trace.empty() && ++next.loopCount == TRACE_THRESHOLD) {
+        buildTrace(next, labels);
+    }
+    return next;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // labels as values
+
+// Direct-threaded engine. Each cached block is translated once into
+// ThreadedOps whose target is the label handling that instruction, so the
+// eight stage calls of simBlock become one indirect jump per instruction.
+// The labels run the same execute* handlers as the stages, on a scratch
+// Instruction and InFlight the compiler can keep in registers once they are
+// inlined.
+// The budget is charged a whole block at a time; a block that does not fit
+// in what is left is run through simBlock instead. Pairs found by fusePair
+// become a single op, which is safe because the budget never runs out
+// inside a block. Blocks find their successors through the links
+// chainBlock keeps, and hot loops run from their trace without looking up
+// blocks at all, except while profiling, which counts each block as it
+// ends. With Tracing, every op also records what it did to sim.traceOut,
+// through traceInstruction as in simBlock; traces are left out then too,
+// so the block the op came from is known.
+template <class Memory, bool Tracing>
+SimStatus simThreaded(Simulator &sim, Memory *myMem, uint64_t &budget) {
+    static const void *const labels[NUM_INSC] = {
+        &&do_illegal, &&do_halt, &&do_fallthrough,
+        &&do_add, &&do_addw, &&do_addi, &&do_addiw, &&do_and, &&do_andi,
+        &&do_auipc, &&do_beq, &&do_bge, &&do_bgeu, &&do_blt, &&do_bltu,
+        &&do_bne, &&do_jal, &&do_jalr, &&do_lb, &&do_lbu, &&do_ld, &&do_lh,
+        &&do_lhu, &&do_lui, &&do_lw, &&do_lwu, &&do_or, &&do_ori, &&do_sb,
+        &&do_sd, &&do_sh, &&do_sll, &&do_sllw, &&do_slli, &&do_slliw, &&do_slt,
+        &&do_slti, &&do_sltiu, &&do_sltu, &&do_sra, &&do_sraw, &&do_srai,
+        &&do_sraiw, &&do_srl, &&do_srlw, &&do_srli, &&do_srliw, &&do_sub,
+        &&do_subw, &&do_sw, &&do_xor, &&do_xori,
+        &&do_lui_addi, &&do_lui_addiw, &&do_auipc_jalr, &&do_slli_add,
+        &&do_addi_beq, &&do_addi_bne, &&do_addi_blt, &&do_addi_bge,
+        &&do_addi_bltu, &&do_addi_bgeu,
+        &&do_trace_block, &&do_trace_loop
+    };
+
+    // private register copy, R[REG_SIZE] absorbs writes to x0
+    uint64_t R[REG_SIZE + 1];
+    for (int i = 0; i < REG_SIZE; i++) {
+        R[i] = sim.regData.registers[i];
+    }
+
+    uint64_t PC = sim.PC;
+    Instruction scratch;
+    InFlight ex;
+    SimStatus status;
+    DecodedBlock *block = nullptr;
+    const ThreadedOp *op = nullptr;
+    bool inTrace = false;
+    uint64_t value;
+
+#define NEXT() op++; goto *op->target
+
+// The instruction at atPC ran, leaving what it did in ex
+#define TRACE_STEP(atPC)                                    \
+    if (Tracing) {                                          \
+        traceInstruction(sim.traceOut, block->insts[((atPC) - block->startPC) / 4], ex); \
+    }
+
+// One value-producing instruction at atPC, writing R[dest]
+#define VALUE_STEP(handler, atPC, dest, src1, src2, immediate) \
+    scratch.PC = atPC;                                      \
+    ex.op1Val = R[src1];                                    \
+    ex.op2Val = R[src2];                                    \
+    scratch.imm = immediate;                                \
+    handler(scratch, ex);                                   \
+    R[dest] = ex.arithResult;                               \
+    TRACE_STEP(atPC)
+
+// One branch or jump at atPC, ending the block
+#define CONTROL_STEP(handler, atPC, dest, src1, src2, immediate) \
+    scratch.PC = atPC;                                      \
+    ex.op1Val = R[src1];                                    \
+    ex.op2Val = R[src2];                                    \
+    scratch.imm = immediate;                                \
+    ex.nextPC = atPC + 4;                                   \
+    handler(scratch, ex);                                   \
+    R[dest] = ex.arithResult;                               \
+    TRACE_STEP(atPC)                                        \
+    PC = ex.nextPC;                                         \
+    goto next_block
+
+#define VALUE_OP(handler)                                   \
+    VALUE_STEP(handler, op->PC, op->rd, op->rs1, op->rs2, op->imm); \
+    NEXT()
+
+#define LOAD_OP(handler, size, isSigned)                    \
+    ex.op1Val = R[op->rs1];                                 \
+    scratch.imm = op->imm;                                  \
+    handler(scratch, ex);                                   \
+    myMem->getMemValue(ex.memAddress, value, size);         \
+    ex.memResult = isSigned ? signExtend(value, size * 8) : value; \
+    R[op->rd] = ex.memResult;                               \
+    TRACE_STEP(op->PC)                                      \
+    NEXT()
+
+#define STORE_OP(handler, size)                             \
+    ex.op1Val = R[op->rs1];                                 \
+    ex.op2Val = R[op->rs2];                                 \
+    scratch.imm = op->imm;                                  \
+    handler(scratch, ex);                                   \
+    myMem->setMemValue(ex.memAddress, ex.op2Val, size);     \
+    TRACE_STEP(op->PC)                                      \
+    NEXT()
+
+#define CONTROL_OP(handler)                                 \
+    CONTROL_STEP(handler, op->PC, op->rd, op->rs1, op->rs2, op->imm)
+
+// Fused pairs: the first instruction, then the second one at PC + 4
+#define FUSED_VALUE_OP(first, second)                       \
+    VALUE_STEP(first, op->PC, op->rd, op->rs1, op->rs2, op->imm); \
+    VALUE_STEP(second, op->PC + 4, op->fusedRd, op->fusedRs1, op->fusedRs2, op->fusedImm); \
+    NEXT()
+
+#define FUSED_CONTROL_OP(first, second)                     \
+    VALUE_STEP(first, op->PC, op->rd, op->rs1, op->rs2, op->imm); \
+    CONTROL_STEP(second, op->PC + 4, op->fusedRd, op->fusedRs1, op->fusedRs2, op->fusedImm)
+
+next_block:
+    if (sim.profile && block) {
+        // the block ran to its end, which is where PC went
+        sim.PC = PC;
+        profileBlock(sim, *block, block->insts.size());
+    }
+    if (sim.myMem->codeWritten()) {
+        // simBlock drops the stale blocks before running the next one
+        goto partial_block;
+    }
+    if (inTrace) {
+        // stay in the trace while the guest follows its path
+        op++;
+        if (op->PC == PC) {
+            goto *op->target;
+        }
+        inTrace = false;
+    }
+    block = block ? &chainBlock(sim, *block, PC, labels) : &simDecodeBlock(sim, PC);
+    if (!block->trace.empty() && !sim.profile && !Tracing) {
+        inTrace = true;
+        op = block->trace.data();
+        block = nullptr; // a trace is left without knowing which block it was in
+        goto *op->target;
+    }
+    if (block->insts.size() > budget) {
+        goto partial_block;
+    }
+    budget -= block->insts.size();
+    if (block->threaded.empty()) {
+        translateBlock(*block, labels);
+    }
+    op = block->threaded.data();
+    goto *op->target;
+
+do_fallthrough:
+    PC = op->PC;
+    goto next_block;
+
+do_trace_block:
+    if (op->imm > budget) {
+        PC = op->PC;
+        goto partial_block;
+    }
+    budget -= op->imm;
+    NEXT();
+
+do_trace_loop:
+    op -= op->imm;
+    goto *op->target;
+
+do_halt:
+    status = SIM_HALT;
+    goto stop;
+
+do_illegal:
+    status = SIM_ILLEGAL;
+
+stop:
+    // the block was charged for the halt or illegal instruction ending it
+    budget++;
+    PC = op->PC;
+    if (sim.profile) {
+        profileBlock(sim, *block, block->insts.size() - 1);
+    }
+    goto leave;
+
+partial_block:
+    status = SIM_RUNNING;
+
+leave:
+    for (int i = 0; i < REG_SIZE; i++) {
+        sim.regData.registers[i] = R[i];
+    }
+    sim.PC = PC;
+    if (status == SIM_RUNNING) {
+        status = simBlock(sim, budget);
+    }
+    return status;
+
+do_add:   VALUE_OP(executeAdd);
+do_addw:  VALUE_OP(executeAddw);
+do_addi:  VALUE_OP(executeAddi);
+do_addiw: VALUE_OP(executeAddiw);
+do_and:   VALUE_OP(executeAnd);
+do_andi:  VALUE_OP(executeAndi);
+do_auipc: VALUE_OP(executeAuipc);
+do_lui:   VALUE_OP(executeLui);
+do_or:    VALUE_OP(executeOr);
+do_ori:   VALUE_OP(executeOri);
+do_sll:   VALUE_OP(executeSll);
+do_sllw:  VALUE_OP(executeSllw);
+do_slli:  VALUE_OP(executeSlli);
+do_slliw: VALUE_OP(executeSlliw);
+do_slt:   VALUE_OP(executeSlt);
+do_slti:  VALUE_OP(executeSlti);
+do_sltiu: VALUE_OP(executeSltiu);
+do_sltu:  VALUE_OP(executeSltu);
+do_sra:   VALUE_OP(executeSra);
+do_sraw:  VALUE_OP(executeSraw);
+do_srai:  VALUE_OP(executeSrai);
+do_sraiw: VALUE_OP(executeSraiw);
+do_srl:   VALUE_OP(executeSrl);
+do_srlw:  VALUE_OP(executeSrlw);
+do_srli:  VALUE_OP(executeSrli);
+do_srliw: VALUE_OP(executeSrliw);
+do_sub:   VALUE_OP(executeSub);
+do_subw:  VALUE_OP(executeSubw);
+do_xor:   VALUE_OP(executeXor);
+do_xori:  VALUE_OP(executeXori);
+
+do_lb:  LOAD_OP(executeLb, BYTE_SIZE, true);
+do_lbu: LOAD_OP(executeLbu, BYTE_SIZE, false);
+do_lh:  LOAD_OP(executeLh, HALF_SIZE, true);
+do_lhu: LOAD_OP(executeLhu, HALF_SIZE, false);
+do_lw:  LOAD_OP(executeLw, WORD_SIZE, true);
+do_lwu: LOAD_OP(executeLwu, WORD_SIZE, false);
+do_ld:  LOAD_OP(executeLd, DOUBLE_SIZE, false);
+
+do_sb: STORE_OP(executeSb, BYTE_SIZE);
+do_sh: STORE_OP(executeSh, HALF_SIZE);
+do_sw: STORE_OP(executeSw, WORD_SIZE);
+do_sd: STORE_OP(executeSd, DOUBLE_SIZE);
+
+do_beq:  CONTROL_OP(executeBeq);
+do_bne:  CONTROL_OP(executeBne);
+do_blt:  CONTROL_OP(executeBlt);
+do_bge:  CONTROL_OP(executeBge);
+do_bltu: CONTROL_OP(executeBltu);
+do_bgeu: CONTROL_OP(executeBgeu);
+do_jal:  CONTROL_OP(executeJal);
+do_jalr: CONTROL_OP(executeJalr);
+
+do_lui_addi:   FUSED_VALUE_OP(executeLui, executeAddi);
+do_lui_addiw:  FUSED_VALUE_OP(executeLui, executeAddiw);
+do_slli_add:   FUSED_VALUE_OP(executeSlli, executeAdd);
+do_auipc_jalr: FUSED_CONTROL_OP(executeAuipc, executeJalr);
+do_addi_beq:   FUSED_CONTROL_OP(executeAddi, executeBeq);
+do_addi_bne:   FUSED_CONTROL_OP(executeAddi, executeBne);
+do_addi_blt:   FUSED_CONTROL_OP(executeAddi, executeBlt);
+do_addi_bge:   FUSED_CONTROL_OP(executeAddi, executeBge);
+do_addi_bltu:  FUSED_CONTROL_OP(executeAddi, executeBltu);
+do_addi_bgeu:  FUSED_CONTROL_OP(executeAddi, executeBgeu);
+
+#undef NEXT
+#undef TRACE_STEP
+#undef VALUE_STEP
+#undef CONTROL_STEP
+#undef VALUE_OP
+#undef LOAD_OP
+#undef STORE_OP
+#undef CONTROL_OP
+#undef FUSED_VALUE_OP
+#undef FUSED_CONTROL_OP
+}
+
+#pragma GCC diagnostic pop
+
+template SimStatus simThreaded<MemoryStore>(Simulator &sim, MemoryStore *myMem, uint64_t &budget);
+template SimStatus simThreaded<PagedMemory>(Simulator &sim, PagedMemory *myMem, uint64_t &budget);
+template SimStatus simThreaded<PagedMemory, true>(Simulator &sim, PagedMemory *myMem, uint64_t &budget);
+
+// Translated programs (make translated) bring their own main
+#ifndef SIM_NO_MAIN
 int main(int argc, char** argv) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <instruction_file>\n", argv[0]);
+    // --fast selects the direct-threaded engine, --jit the x86-64 translator,
+    // otherwise blocks go through the staged pipeline
+    // --batch runs every program in a manifest instead, on --threads
+    // workers (default: one per core) that switch jobs every --slice
+    // instructions. --max-insts stops runaway guests.
+    // --translate writes the program out as C++ to the -o file instead.
+    // --lanes runs the program once per line of an inputs file, in lockstep.
+    // --checkpoint saves the state after N instructions to a file and goes
+    // on; --resume starts from such a file instead of a program.
+    // --sample-at measures only --window instructions from each of a list
+    // of offsets in detail, --simpoints instead clusters basic block vectors
+    // into that many groups and measures windows drawn at random from each.
+    // --trace records every instruction to a binary file, see tracedump.
+    // It runs --jit as --fast, and costs several times --fast's run time
+    // when the thread compressing the trace has no core of its own.
+    // --profile prints where the guest spent its instructions and writes
+    // the full counts to a JSON file. It runs --jit as --fast.
+    // --cache looks every fetch, load and store up in a model of L1
+    // instruction and data caches and an L2, and prints their counts. With
+    // --sample-at or --simpoints only the windows are looked up, after a
+    // warm-up, and their misses extrapolated to the whole program.
+    // --sweep measures the miss rates of many data caches at once, on
+    // --threads workers, writing them to the -o CSV file if one is given.
+    // --bench runs the program N times and reports its throughput, adding
+    // a line to the -o CSV file if one is given.
+    SimEngine engine = ENGINE_STAGED;
+    char *programFile = nullptr;
+    char *manifestFile = nullptr;
+    char *translateFile = nullptr;
+    char *outputFile = nullptr;
+    char *inputsFile = nullptr;
+    char *checkpointFile = nullptr;
+    char *resumeFile = nullptr;
+    char *traceFile = nullptr;
+    char *profileFile = nullptr;
+    char *cacheSpec = nullptr;
+    char *sweepSpec = nullptr;
+    uint64_t checkpointAt = 0;
+    unsigned numThreads = 0;
+    uint64_t maxInsts = UINT64_MAX;
+    uint64_t sliceInsts = BATCH_SLICE;
+    SampleConfig sampleConfig;
+    bool sampled = false;
+    unsigned benchRuns = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            engine = ENGINE_THREADED;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            engine = ENGINE_JIT;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifestFile = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) {
+            sliceInsts = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--max-insts") == 0 && i + 1 < argc) {
+            maxInsts = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--translate") == 0 && i + 1 < argc) {
+            translateFile = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc) {
+            inputsFile = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 2 < argc) {
+            checkpointAt = strtoull(argv[++i], nullptr, 0);
+            checkpointFile = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+            resumeFile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileFile = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheSpec = argv[++i];
+        } else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) {
+            sweepSpec = argv[++i];
+        } else if (strcmp(argv[i], "--sample-at") == 0 && i + 1 < argc) {
+            // comma-separated instruction offsets
+            for (char *offset = strtok(argv[++i], ","); offset; offset = strtok(nullptr, ",")) {
+                sampleConfig.offsets.push_back(strtoull(offset, nullptr, 0));
+            }
+            sampled = true;
+        } else if (strcmp(argv[i], "--simpoints") == 0 && i + 1 < argc) {
+            sampleConfig.clusters = atoi(argv[++i]);
+            sampled = sampleConfig.clusters > 0;
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            sampleConfig.window = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            benchRuns = atoi(argv[++i]);
+        } else if (!programFile) {
+            programFile = argv[i];
+        } else {
+            programFile = nullptr;
+            break;
+        }
+    }
+
+    if (benchRuns > 0 && programFile && !manifestFile && !translateFile && !inputsFile && !resumeFile &&
+        !traceFile && !profileFile && !cacheSpec && !sweepSpec && !sampled) {
+        return runBench(programFile, engine, benchRuns, maxInsts, outputFile);
+    }
+
+    if (sweepSpec && programFile && !manifestFile && !translateFile && !inputsFile && !resumeFile &&
+        !traceFile && !profileFile && !cacheSpec && !sampled && !benchRuns) {
+        return runSweep(programFile, sweepSpec, numThreads, maxInsts, outputFile);
+    }
+
+    if (translateFile && outputFile && !programFile && !manifestFile) {
+        return translateProgram(translateFile, outputFile);
+    }
+
+    if (manifestFile && !programFile && !translateFile && !traceFile && !profileFile && !cacheSpec) {
+        return runBatch(manifestFile, engine, numThreads, maxInsts, sliceInsts);
+    }
+
+    if (inputsFile && programFile && !manifestFile && !translateFile && !traceFile && !profileFile &&
+        !cacheSpec) {
+        return runLanes(programFile, inputsFile, maxInsts);
+    }
+
+    if (sampled && programFile && !manifestFile && !translateFile && !inputsFile && !resumeFile &&
+        !traceFile && !profileFile) {
+        sampleConfig.cacheSpec = cacheSpec;
+        return runSampled(programFile, engine, sampleConfig, maxInsts);
+    }
+
+    if (!programFile == !resumeFile || manifestFile || translateFile || inputsFile || sampled || benchRuns ||
+        sweepSpec) {
+        fprintf(stderr, "Usage: %s [--fast | --jit] [--max-insts N] [--checkpoint N <file>]\n"
+                        "           [--trace <file>] [--profile <json file>] [--cache <levels | default>]\n"
+                        "           <program.elf | instruction_file | --resume <file>>\n", argv[0]);
+        fprintf(stderr, "       %s [--fast | --jit] [--max-insts N] --batch <manifest> [--threads N] [--slice N]\n", argv[0]);
+        fprintf(stderr, "       %s [--fast | --jit] [--max-insts N] <--sample-at N,N,... | --simpoints K>\n"
+                        "           [--window N] [--cache <levels | default>] <program.elf | instruction_file>\n", argv[0]);
+        fprintf(stderr, "       %s [--fast | --jit] [--max-insts N] --bench N [-o <results.csv>]\n"
+                        "           <program.elf | instruction_file>\n", argv[0]);
+        fprintf(stderr, "       %s [--max-insts N] --sweep <SIZES:WAYS:LINES[:lru|plru] | default> [--threads N]\n"
+                        "           [-o <results.csv>] <program.elf | instruction_file>\n", argv[0]);
+        fprintf(stderr, "       %s [--max-insts N] --lanes <inputs> <program.elf | instruction_file>\n", argv[0]);
+        fprintf(stderr, "       %s --translate <program.elf | instruction_file> -o <program.cpp>\n", argv[0]);
         return -1;
     }
 
-    // initialize memory store with buffer contents
-    MemoryStore *myMem = createMemoryStore();
-    if (!initMemory(argv[1], myMem)) {
+    // initialize memory, registers and program counter
+    Simulator sim(engine);
+    if (resumeFile ? !sim.loadCheckpoint(resumeFile) : !sim.load(programFile)) {
         fprintf(stderr, "Failed to initialize memory with program binary.\n");
         return -1;
     }
 
-    // initialize registers and program counter
-    regData.reg = {};
-    PC = 0;
-    bool err = false;
-    
+    // tracing runs the simulation with a background thread writing the
+    // trace out
+    TraceWriter traceWriter;
+    if (traceFile) {
+        if (!traceWriter.open(traceFile)) {
+            fprintf(stderr, "Cannot write trace %s\n", traceFile);
+            return -1;
+        }
+        sim.traceOut = traceWriter.addBuffer();
+    }
+    Profile profile;
+    if (profileFile) {
+        sim.profile = &profile;
+    }
+    CacheHierarchy caches;
+    if (cacheSpec) {
+        if (!caches.configure(cacheSpec)) {
+            return -1;
+        }
+        sim.caches = &caches;
+    }
+
     // start simulation
-    while (!err) {
-        Instruction inst = simInstruction(PC, myMem, regData);
-        if (inst.isHalt) {
-            // Normal dump and exit
-            dump(myMem);
-            return 0;
+    SimStatus status = SIM_RUNNING;
+    uint64_t startInsts = sim.stats.instructions;
+    if (checkpointFile && checkpointAt < maxInsts) {
+        status = sim.run(checkpointAt);
+        if (status != SIM_RUNNING) {
+            fprintf(stderr, "Stopped before instruction %lu, no checkpoint written\n", checkpointAt);
+        } else if (!sim.saveCheckpoint(checkpointFile)) {
+            fprintf(stderr, "Cannot write checkpoint %s\n", checkpointFile);
         }
-        if (!inst.isLegal) {
-            fprintf(stderr, "Illegal instruction encountered at PC: 0x%lx\n", inst.PC);
-            err = true;
+    }
+    if (status == SIM_RUNNING) {
+        status = sim.run(maxInsts - (sim.stats.instructions - startInsts));
+    }
+    if (traceFile) {
+        sim.traceOut->flush();
+        if (!traceWriter.close()) {
+            fprintf(stderr, "Cannot write trace %s\n", traceFile);
         }
     }
+    if (profileFile) {
+        printProfile(stdout, profile, PROFILE_HOT_SPOTS);
+        if (!writeProfileJson(profileFile, profile, programFile ? programFile : resumeFile)) {
+            fprintf(stderr, "Cannot write profile %s\n", profileFile);
+        }
+    }
+    if (cacheSpec) {
+        caches.print(stdout);
+    }
+    if (status == SIM_HALT) {
+        // Normal dump and exit
+        sim.dump();
+        return 0;
+    }
 
     // dump and exit with error
-    dump(myMem);
-    exit(127);
+    int exitCode;
+    switch (status) {
+        case SIM_ILLEGAL:
+            fprintf(stderr, "Illegal instruction encountered at PC: 0x%lx\n", sim.PC);
+            exitCode = EXIT_ILLEGAL;
+            break;
+        case SIM_LOOP:
+            fprintf(stderr, "Infinite loop detected at PC: 0x%lx after %lu instructions\n",
+                    sim.PC, sim.stats.instructions);
+            exitCode = EXIT_LOOP;
+            break;
+        default:
+            fprintf(stderr, "Instruction limit of %lu reached at PC: 0x%lx\n", maxInsts, sim.PC);
+            exitCode = EXIT_MAX_INSTS;
+            break;
+    }
+    sim.dump();
+    exit(exitCode);
     return -1;
 }
-
-
-
+#endif
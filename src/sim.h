@@ -1,11 +1,18 @@
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "Cache.h"
 #include "MemoryStore.h"
+#include "PagedMemory.h"
 #include "RegisterInfo.h"
+#include "Trace.h"
 
 // --------------------------------------------------------------------------
 // Reg data structure
@@ -16,16 +23,10 @@ union REGS {
     uint64_t registers[REG_SIZE] {0};
 };
 
-union REGS regData;
-
-uint64_t PC;
-
 // --------------------------------------------------------------------------
 // Decode constants
 // --------------------------------------------------------------------------
 
-// TODO Complete these enums, add more if necessary
-
 enum OPCODES {
     // I-type opcodes
     OP_INTIMM  = 0b0010011, // Integer ALU immediate instructions addi, slli, slti, sltiu, xori, srli, srai, ori, andi
@@ -92,51 +93,104 @@ enum RI_FUNCT7 {
 
 };
 
+// Every instruction the decoder recognizes, plus the pseudo-ops the threaded
+// engine needs. Keep in sync with the label table in simThreaded.
+enum InscId {
+    INSC_ILLEGAL = 0,
+    INSC_HALT,
+    INSC_FALLTHROUGH, // end of a block cut at MAX_BLOCK_INSTS
+    INSC_ADD, INSC_ADDW, INSC_ADDI, INSC_ADDIW, INSC_AND, INSC_ANDI,
+    INSC_AUIPC, INSC_BEQ, INSC_BGE, INSC_BGEU, INSC_BLT, INSC_BLTU,
+    INSC_BNE, INSC_JAL, INSC_JALR, INSC_LB, INSC_LBU, INSC_LD, INSC_LH,
+    INSC_LHU, INSC_LUI, INSC_LW, INSC_LWU, INSC_OR, INSC_ORI, INSC_SB,
+    INSC_SD, INSC_SH, INSC_SLL, INSC_SLLW, INSC_SLLI, INSC_SLLIW, INSC_SLT,
+    INSC_SLTI, INSC_SLTIU, INSC_SLTU, INSC_SRA, INSC_SRAW, INSC_SRAI,
+    INSC_SRAIW, INSC_SRL, INSC_SRLW, INSC_SRLI, INSC_SRLIW, INSC_SUB,
+    INSC_SUBW, INSC_SW, INSC_XOR, INSC_XORI,
+    // adjacent pairs the threaded engine runs as one op, see fusePair
+    INSC_LUI_ADDI, INSC_LUI_ADDIW, INSC_AUIPC_JALR, INSC_SLLI_ADD,
+    INSC_ADDI_BEQ, INSC_ADDI_BNE, INSC_ADDI_BLT, INSC_ADDI_BGE,
+    INSC_ADDI_BLTU, INSC_ADDI_BGEU,
+    // trace bookkeeping, see buildTrace
+    INSC_TRACE_BLOCK, INSC_TRACE_LOOP,
+    NUM_INSC
+};
+
 // --------------------------------------------------------------------------
 // Bit-level manipulation helpers
 // --------------------------------------------------------------------------
 
-// TODO You may wish to declare some helper functions for bit extractions
-// and sign extensions
+// Sign-extend the low `bits` bits of value to 64 bits
+uint64_t signExtend(uint64_t value, int bits);
+
+// Extract bits [hi:lo] of value
+uint64_t extractBits(uint64_t value, int hi, int lo);
 
 // --------------------------------------------------------------------------
 // Utilities
 // --------------------------------------------------------------------------
 
-// initialize memory with program binary
-bool initMemory(char *programFile, MemoryStore *myMem);
+// initialize memory with a RISC-V ELF file or a flat program binary, and
+// set the PC execution starts at
+bool initMemory(const char *programFile, PagedMemory *myMem, uint64_t &entryPC);
+
+// find the address range of a program's code: the .text section of an ELF
+// file, or all of a flat binary
+bool findCode(const char *programFile, uint64_t &start, uint64_t &end);
 
 // dump registers and memory
-void dump(MemoryStore *myMem);
+void dump(REGS &regData, MemoryStore *myMem);
+
+// Bytes of memory from address 0 that a memory dump covers
+#define DUMP_MEMORY_BYTES 500
+
+// write registers or memory in the same format as the dump
+void writeRegisterState(FILE *out, const REGS &regData);
+void writeMemoryState(FILE *out, MemoryStore *myMem);
 
 // --------------------------------------------------------------------------
 // Simulation functions
 // --------------------------------------------------------------------------
 
-// The simulator maintains the following struct as it simulates 
-// RISC-V instructions. Feel free to add more fields if needed.
+// A decoded instruction, packed into 32 bytes: the register and funct
+// fields are a few bits wide, the flags are single bits. Decoded blocks
+// store these, and nothing in one changes once simDecode has filled it in.
 struct Instruction {
-    uint64_t PC = 0;
-    uint64_t instruction = 0; // raw instruction binary
-
-    bool     isHalt = false;
-    bool     isLegal = false;
-    bool     isNop = false;
-
-    bool     readsMem = false;
-    bool     writesMem = false;
-    bool     doesArithLogic = false;
-    bool     writesRd = false;
-    bool     readsRs1 = false;
-    bool     readsRs2 = false;
-
-    uint64_t opcode = 0;
-    uint64_t funct3 = 0;
-    uint64_t funct7 = 0;
-    uint64_t rd = 0;
-    uint64_t rs1 = 0;
-    uint64_t rs2 = 0;
+    uint64_t PC;
+    uint64_t imm;         // sign-extended immediate
+    uint32_t instruction; // raw instruction binary
+    InscId   id;
+
+    uint8_t  opcode;
+    uint8_t  funct3;
+    uint8_t  funct7;
+    uint8_t  rd;
+    uint8_t  rs1;
+    uint8_t  rs2;
+
+    bool     isHalt         : 1;
+    bool     isLegal        : 1;
+    bool     isNop          : 1;
+    bool     readsMem       : 1;
+    bool     writesMem      : 1;
+    bool     doesArithLogic : 1;
+    bool     writesRd       : 1;
+    bool     readsRs1       : 1;
+    bool     readsRs2       : 1;
+
+    // bit-fields cannot have default member initializers before C++20
+    Instruction() : PC(0), imm(0), instruction(0), id(INSC_ILLEGAL),
+                    opcode(0), funct3(0), funct7(0), rd(0), rs1(0), rs2(0),
+                    isHalt(false), isLegal(false), isNop(false),
+                    readsMem(false), writesMem(false), doesArithLogic(false),
+                    writesRd(false), readsRs1(false), readsRs2(false) {}
+};
+
+static_assert(sizeof(Instruction) <= 32, "decoded instruction should stay within 32 bytes");
 
+// Values one instruction produces on its way through the stages. The
+// stages fill it in place next to the decoded Instruction they execute.
+struct InFlight {
     uint64_t nextPC = 0;
 
     uint64_t op1Val = 0;
@@ -147,48 +201,455 @@ struct Instruction {
     uint64_t memResult = 0;
 };
 
-struct InscDecode{
-    bool isLegal       = false;
-    bool doesArithLogic= false;
-    bool writesRd      = false;
-    bool readsRs1      = false;
-    bool readsRs2      = false;
-    bool readsMem      = false;
-    bool writesMem     = false;
+// Execution handler of one instruction, see the execute* functions
+typedef void (*ExecHandler)(const Instruction&, InFlight&);
 
-    void (*execution)(Instruction&) = nullptr;
+// One decode table entry. Flags are packed into bits so an entry stays at
+// 16 bytes and the whole primary table fits in 4 KB.
+struct InscDecode{
+    bool isLegal        : 1;
+    bool doesArithLogic : 1;
+    bool writesRd       : 1;
+    bool readsRs1       : 1;
+    bool readsRs2       : 1;
+    bool readsMem       : 1;
+    bool writesMem      : 1;
+
+    uint8_t funct7Base;  // first funct7 variant of this opcode/funct3 group
+    uint8_t funct7Count; // 0 when funct7 doesn't select the instruction
+    uint8_t funct7;      // funct7 matched by a variant entry
+    uint8_t id;          // InscId of the instruction
+
+    ExecHandler execution;
 };
 
-// The following functions are the core of the simulator. Your task is to
-// complete these functions in sim.cpp. Do not modify their signatures.
-// However, feel free to declare more functions if needed.
+// The following functions are the core of the simulator, implemented in
+// sim.cpp. They used to take and return whole Instructions. Fetch and
+// decode now fill in the Instruction they are given, and the later stages
+// read it and work in place on the InFlight values next to it, so nothing
+// is copied per stage. Keep to these signatures when adding stages, and
+// feel free to declare more functions if needed.
 
 // There is no strict rule on what each function should do, but the
 // following comments give suggestions.
 
 // Get raw instruction bits from memory
-Instruction simFetch(uint64_t PC, MemoryStore *myMem);
+void simFetch(uint64_t PC, MemoryStore *myMem, Instruction &inst);
 
 // Determine instruction opcode, funct, reg names, and what resources to use
-Instruction simDecode(Instruction inst);
+void simDecode(Instruction &inst);
 
 // Collect reg operands for arith or addr gen
-Instruction simOperandCollection(Instruction inst, REGS regData);
+void simOperandCollection(const Instruction &inst, InFlight &ex, const REGS &regData);
 
 // Resolve next PC whether +4 or branch/jump target
-Instruction simNextPCResolution(Instruction inst);
+void simNextPCResolution(const Instruction &inst, InFlight &ex);
 
 // Perform arithmetic/logic operations
-Instruction simArithLogic(Instruction inst);
+void simArithLogic(const Instruction &inst, InFlight &ex);
 
 // Generate memory address for load/store instructions
-Instruction simAddrGen(Instruction inst);
+void simAddrGen(const Instruction &inst, InFlight &ex);
 
 // Perform memory access for load/store instructions
-Instruction simMemAccess(Instruction inst, MemoryStore *myMem);
+void simMemAccess(const Instruction &inst, InFlight &ex, MemoryStore *myMem);
 
 // Write back results to registers
-Instruction simCommit(Instruction inst, REGS &regData);
+void simCommit(const Instruction &inst, const InFlight &ex, REGS &regData);
 
 // Simulate the whole instruction using functions above
-Instruction simInstruction(uint64_t &PC, MemoryStore *myMem, REGS &regData);
\ No newline at end of file
+Instruction simInstruction(uint64_t &PC, MemoryStore *myMem, REGS &regData);
+
+// The same, leaving what the instruction did (its memory address, for one)
+// in ex
+Instruction simInstruction(uint64_t &PC, MemoryStore *myMem, REGS &regData, InFlight &ex);
+
+// Does this instruction (possibly) redirect the PC?
+bool isControlFlow(const Instruction &inst);
+
+// --------------------------------------------------------------------------
+// Decoded block cache
+// --------------------------------------------------------------------------
+
+// Longest straight-line run decoded into a single block
+#define MAX_BLOCK_INSTS 64
+
+// Times a backward branch must reach a block before the threaded engine
+// builds a trace of the loop starting there
+#define TRACE_THRESHOLD 64
+
+// Most blocks one trace strings together
+#define MAX_TRACE_BLOCKS 16
+
+// Compact form of one instruction for the threaded engine. target is the
+// address of the handler label, so dispatch is a single indirect jump. A
+// fused op covers two adjacent instructions; the fused* fields are the
+// operands of the second one, which sits at PC + 4.
+struct ThreadedOp {
+    const void *target = nullptr;
+    uint64_t PC = 0;
+    uint64_t imm = 0;
+    uint64_t fusedImm = 0;
+    uint8_t rd = 0; // REG_SIZE (a scratch slot) when the result goes to x0
+    uint8_t rs1 = 0;
+    uint8_t rs2 = 0;
+    uint8_t fusedRd = 0;
+    uint8_t fusedRs1 = 0;
+    uint8_t fusedRs2 = 0;
+};
+
+struct BlockProfile; // see Profiling below
+
+// A straight-line run of decoded instructions starting at startPC and ending
+// at the first branch, jump, halt or illegal instruction. Blocks are decoded
+// once and cached by start PC, so loops skip fetch and decode on every trip.
+struct DecodedBlock {
+    uint64_t startPC = 0;
+    std::vector<Instruction> insts;
+    std::vector<ThreadedOp> threaded; // filled the first time simThreaded runs the block
+
+    // Successors the threaded engine has resolved, so it can skip the cache
+    // lookup next time. taken is the branch or jump target (the most recent
+    // one for jalr), notTaken the next instruction in memory.
+    DecodedBlock *taken = nullptr;
+    DecodedBlock *notTaken = nullptr;
+    bool lastTaken = false;   // which of the two ran last time
+    uint64_t loopCount = 0;   // backward branches that reached this block
+    std::vector<ThreadedOp> trace; // loop trace starting here, once it got hot
+
+    uint64_t execCount = 0;   // times the JIT dispatcher ran this block
+    void *jitCode = nullptr;  // host code once the block got hot
+    uint64_t jitInsts = 0;    // instructions jitCode covers
+
+    BlockProfile *profile = nullptr; // counts of its runs when profiling
+};
+
+typedef std::unordered_map<uint64_t, DecodedBlock> BlockCache;
+
+// --------------------------------------------------------------------------
+// Simulator context
+// --------------------------------------------------------------------------
+
+// Why a call into an engine returned
+enum SimStatus {
+    SIM_RUNNING = 0, // stopped on the instruction budget, can be resumed
+    SIM_HALT,        // PC is at the halt instruction
+    SIM_ILLEGAL,     // PC is at an illegal instruction
+    SIM_LOOP         // run() saw the guest repeat a state, it never halts
+};
+
+// Exit statuses of sim other than 0 for a normal halt. 124 to 127 are
+// taken by timeout(1) and the shell, and 128 + N by a signal N, so a run
+// stopped by sim itself is told apart from one an external timeout killed.
+#define EXIT_MAX_INSTS 100 // --max-insts reached
+#define EXIT_LOOP      101 // stuck in an infinite loop
+#define EXIT_ILLEGAL   127 // illegal instruction
+
+enum SimEngine {
+    ENGINE_STAGED,   // cached blocks through the eight stages
+    ENGINE_THREADED, // direct-threaded interpreter
+    ENGINE_JIT       // x86-64 translation of hot blocks
+};
+
+struct SimStats {
+    uint64_t instructions = 0; // retired, not counting the final halt
+};
+
+struct JitState; // Jit.cpp
+struct Profile;  // see Profiling below
+
+// Everything needed to resume a simulation, see Simulator::checkpoint
+struct Checkpoint {
+    REGS regData;
+    uint64_t PC = 0;
+    SimStats stats;
+    MemCheckpoint mem;
+};
+
+// One simulated hart: its registers, PC, memory, decoded blocks and
+// statistics. Nothing is shared between instances, so a process can host as
+// many independent simulations as it likes.
+class Simulator
+{
+    public:
+        REGS regData;
+        uint64_t PC = 0;
+        PagedMemory *myMem = nullptr;
+        BlockCache blockCache;
+        SimEngine engine;
+        SimStats stats;
+        JitState *jit = nullptr; // created the first time the JIT runs
+
+        // Where every retired instruction is recorded, if anywhere. The
+        // staged and threaded engines record them; the JIT's engine runs
+        // as the threaded one meanwhile. Flush it before reading the trace.
+        TraceBuffer *traceOut = nullptr;
+
+        // Where execution counts go, if anywhere. The staged and threaded
+        // engines count once per block, the threaded one without its
+        // traces; the JIT's engine runs as the threaded one meanwhile.
+        // Blocks keep pointing into the profile, so set it before the
+        // first run.
+        Profile *profile = nullptr;
+
+        // Where fetches, loads and stores are looked up, if anywhere. The
+        // staged engine does the lookups, so it runs while this is set.
+        CacheHierarchy *caches = nullptr;
+
+        // Where the address of every load and store goes, if anywhere, for
+        // cache models on other threads. The staged engine records them.
+        AddressStream *addressOut = nullptr;
+
+        explicit Simulator(SimEngine engine = ENGINE_STAGED);
+        ~Simulator();
+
+        Simulator(const Simulator &) = delete;
+        Simulator &operator=(const Simulator &) = delete;
+
+        // Load a program and reset to its entry point
+        bool load(const char *programFile);
+
+        // Back to the state right after load: the memory pages the guest
+        // stored to restored from the snapshot taken at load, zeroed
+        // registers, PC at the entry point and no stats. Decoded blocks are
+        // kept unless the guest modified its code.
+        bool reset();
+
+        // Execute up to n instructions. Returns SIM_RUNNING if all n ran.
+        SimStatus step(uint64_t n);
+
+        // Execute until a halt or illegal instruction, or until maxInsts
+        // instructions have run (SIM_RUNNING). Every so often the PC and
+        // registers are compared with an earlier snapshot; if they match
+        // and nothing was stored in between, the guest can only repeat
+        // itself forever and SIM_LOOP is returned. The snapshots carry
+        // over between calls, so a guest run a slice at a time is still
+        // caught.
+        SimStatus run(uint64_t maxInsts = UINT64_MAX);
+
+        // Write reg_state.out and mem_state.out
+        void dump();
+
+        // Write <outputPrefix>.reg_state.out and <outputPrefix>.mem_state.out
+        bool dump(const std::string &outputPrefix);
+
+        // Take a checkpoint of the registers, PC, stats and memory. Memory
+        // pages are shared with the running simulation until either side
+        // stores to them, so this takes microseconds and holding many
+        // checkpoints costs only the pages that diverged.
+        void checkpoint(Checkpoint &cp);
+
+        // Go back to a checkpoint taken from this or any other Simulator.
+        // reset() still returns to the state after load.
+        void restore(const Checkpoint &cp);
+
+        // Write the current state to a file, or load one as if it were a
+        // program: reset() then returns to the state in the file. The pages
+        // in a checkpoint file are mapped rather than read.
+        bool saveCheckpoint(const char *checkpointFile);
+        bool loadCheckpoint(const char *checkpointFile);
+
+        // Drop the cached blocks the guest has stored to since they were
+        // decoded. The engines call this between blocks once
+        // myMem->codeWritten(), so a store to code takes effect from the
+        // next block on, as if each block ended in a fence.i. The addresses
+        // of those stores also go to written, if given, for code cached
+        // outside the Simulator.
+        void invalidateCode(std::vector<uint64_t> *written = nullptr);
+
+        // Start PCs of the cached blocks on each code page, filled in by
+        // simDecodeBlock
+        std::unordered_map<uint64_t, std::vector<uint64_t>> codePages;
+
+    private:
+        std::string programFile;
+        uint64_t entryPC = 0;
+        REGS entryRegs;            // zeros unless from a checkpoint file
+        SimStats entryStats;
+        bool loaded = false;       // load() succeeded
+        bool codeModified = false; // blocks were dropped since load()
+
+        // run()'s loop detector, see Simulator.cpp
+        struct LoopCheck {
+            REGS savedRegs;
+            uint64_t savedPC = 0;
+            uint64_t checks = 0;
+            uint64_t nextSave = 1;
+            uint64_t sinceCheck = 0; // instructions since the last check
+        } loopCheck;
+
+        // Throw away decoded blocks, code marks and JIT code
+        void dropBlocks();
+};
+
+// Fetch and decode the block starting at PC, or return the cached copy
+DecodedBlock &simDecodeBlock(Simulator &sim, uint64_t PC);
+
+// The engines below run from sim.PC, counting every retired instruction
+// against budget. They return SIM_RUNNING once the budget is spent (or,
+// for simBlock, at the end of the block), leaving PC at the next
+// instruction to execute.
+
+// Simulate at most one block from the cache through the stages
+SimStatus simBlock(Simulator &sim, uint64_t &budget);
+
+// Simulate cached blocks with the direct-threaded engine. Memory is either
+// the MemoryStore interface or a concrete backend such as PagedMemory,
+// whose loads and stores then get inlined into the engine. With Tracing
+// it records every retired instruction to sim.traceOut.
+template <class Memory, bool Tracing = false>
+SimStatus simThreaded(Simulator &sim, Memory *myMem, uint64_t &budget);
+
+// Simulate cached blocks, translating hot ones to x86-64 host code
+SimStatus simJit(Simulator &sim, uint64_t &budget);
+
+// Release the JIT's code buffer and bookkeeping
+void jitRelease(JitState *jit);
+
+// Throw away all host code, before cached blocks go away
+void jitInvalidate(JitState *jit);
+
+// --------------------------------------------------------------------------
+// Batch mode
+// --------------------------------------------------------------------------
+
+// Instructions a batch job runs before its worker moves on to the next
+#define BATCH_SLICE (1 << 14)
+
+// Run every program in the manifest on numThreads workers, each job in its
+// own Simulator limited to maxInsts instructions, and print aggregate and
+// per-worker throughput. Each worker interleaves its jobs sliceInsts
+// instructions at a time. Returns 0 if every job halted normally.
+int runBatch(const char *manifestFile, SimEngine engine, unsigned numThreads, uint64_t maxInsts,
+             uint64_t sliceInsts = BATCH_SLICE);
+
+// --------------------------------------------------------------------------
+// Lockstep lanes
+// --------------------------------------------------------------------------
+
+// Run one copy of the program per line of the inputs file, with that line's
+// values in a0, a1, ..., each lane in its own memory and limited to maxInsts
+// instructions. Lanes run in lockstep in vector registers, a gang at a
+// time, and lane N's state goes to <inputs prefix>.N.reg_state.out and
+// .mem_state.out. Returns 0 if every lane halted normally.
+int runLanes(const char *programFile, const char *inputsFile, uint64_t maxInsts);
+
+// --------------------------------------------------------------------------
+// Sampled simulation
+// --------------------------------------------------------------------------
+
+// Instructions in one detailed window unless configured otherwise
+#define SAMPLE_WINDOW 10000
+
+// Which windows of the program runSampled measures in detail: window
+// instructions from each of the given offsets, or, when clusters is set,
+// windows drawn at random from each group found by clustering the basic
+// block vectors of every window-sized interval into that many groups
+struct SampleConfig {
+    uint64_t window = SAMPLE_WINDOW;
+    std::vector<uint64_t> offsets;
+    unsigned clusters = 0;
+    const char *cacheSpec = nullptr; // levels to model, as --cache takes them
+};
+
+// Run the program on the given engine up to each window, and the window
+// itself through the stages one instruction at a time, counting loads,
+// stores, branches and jumps, and the misses of each cache level when
+// config has a cacheSpec. Prints the whole-program estimates of those
+// counts, with 95% confidence intervals, extrapolated from the windows.
+// Clustering first runs the whole program once on the engine, profiling
+// its blocks. Returns 0 if the program halted normally.
+int runSampled(const char *programFile, SimEngine engine, const SampleConfig &config, uint64_t maxInsts);
+
+// --------------------------------------------------------------------------
+// Profiling
+// --------------------------------------------------------------------------
+
+// Execution counts of one decoded block. Blocks can be dropped and decoded
+// again, the counts of every block decoded stay in the Profile.
+struct BlockProfile {
+    std::vector<Instruction> insts; // as decoded
+    uint64_t runs = 0;              // ran to the end
+    uint64_t taken = 0;             // of those, left by a taken branch or jump
+    std::vector<uint64_t> cut;      // cut[k]: runs stopped before insts[k]
+};
+
+struct Profile {
+    std::deque<BlockProfile> blocks;
+};
+
+// PCs the hot spot report lists
+#define PROFILE_HOT_SPOTS 20
+
+// Count one run of block, in which its first `executed` instructions ran.
+// simBlock and simThreaded call this at the end of each block while
+// sim.profile is set.
+void profileBlock(Simulator &sim, DecodedBlock &block, size_t executed);
+
+// Print the top hot spots, the counts per opcode/funct3 class, branch
+// outcomes and loads and stores by size
+void printProfile(FILE *out, const Profile &profile, size_t hotSpots);
+
+// Write the whole profile as JSON for other tools. Returns false if the
+// file could not be written.
+bool writeProfileJson(const char *jsonFile, const Profile &profile, const char *programFile);
+
+// --------------------------------------------------------------------------
+// Benchmarking
+// --------------------------------------------------------------------------
+
+// Run the program `runs` times on the engine, resetting in between, and
+// print the instruction count, the first, best and median wall times, and
+// MIPS, host cycles per guest instruction and peak RSS of the best run.
+// When resultsFile is given the same goes on a line of that CSV file.
+// Returns 0 if every run halted normally after the same instructions.
+int runBench(const char *programFile, SimEngine engine, unsigned runs, uint64_t maxInsts, const char *resultsFile);
+
+// --------------------------------------------------------------------------
+// Cache sweeps
+// --------------------------------------------------------------------------
+
+// Sweep --sweep default stands for: 1 KB to 1 MB, direct-mapped to 8-way
+// and fully associative, 64-byte lines
+#define SWEEP_DEFAULT "1k-1m:1,2,4,8,full:64"
+
+// Run the program once and measure the miss rate of its loads and stores in
+// every cache a spec describes: SIZES:WAYS:LINES[:lru|plru], each a
+// comma-separated list, sizes also as ranges of powers of two (1k-1m), ways
+// also as "full". Each set-associative cache is a Cache model, the fully
+// associative ones of a line size share one stack distance analysis (always
+// LRU). The models run on numThreads worker threads (0: one per core),
+// which all read the one stream of addresses the simulation records. Prints
+// a table of miss rates per line size, and writes every point to csvFile if
+// given. Returns 0 if the program halted normally.
+int runSweep(const char *programFile, const char *spec, unsigned numThreads, uint64_t maxInsts,
+             const char *csvFile);
+
+// --------------------------------------------------------------------------
+// Ahead-of-time translation
+// --------------------------------------------------------------------------
+
+// Write the program's code out as C++ with one function per basic block
+// (sim --translate). Returns 0 on success.
+int translateProgram(const char *programFile, const char *outputFile);
+
+// A translated block runs on the guest registers and memory and returns the
+// index of the block to run next, or -1 after setting PC when the next PC
+// has to be looked up.
+typedef int (*TranslatedBlock)(uint64_t *R, PagedMemory *mem, uint64_t &PC);
+
+// Everything a translated program is made of. blockPCs is sorted, and
+// blocks[i] was translated from the instructions in [blockPCs[i],
+// blockEnds[i]).
+struct TranslatedProgram {
+    const uint64_t *blockPCs;
+    const uint64_t *blockEnds;
+    const TranslatedBlock *blocks;
+    size_t numBlocks;
+};
+
+// main of a translated program: load programFile for its data, run the
+// translated code, interpreting whatever has no translation, and dump. A
+// store to the instructions of a translated block disables it from the
+// next block on, and the interpreter runs that code from then on.
+int runTranslated(const char *programFile, const TranslatedProgram &program);
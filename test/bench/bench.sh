@@ -0,0 +1,44 @@
+#!/bin/sh
+# Run every kernel in test/bench on each engine (make bench) and keep the
+# results in test/bench/results/<commit>.csv, with -dirty added to the name
+# when the sources differ from the commit. Given a commit whose results are
+# there, print how MIPS changed since then.
+#
+# Usage: test/bench/bench.sh <runs> [<base commit>]
+
+runs=${1:-5}
+base=$2
+dir=test/bench/results
+
+commit=$(git rev-parse --short HEAD 2>/dev/null)
+if [ -z "$commit" ]; then
+    commit=unknown
+elif ! git diff --quiet HEAD -- src test/bench Makefile; then
+    commit=$commit-dirty
+fi
+results=$dir/$commit.csv
+mkdir -p $dir
+rm -f $results
+
+for kernel in test/bench/*.bin; do
+    for engine in "" --fast --jit; do
+        ./sim $engine --bench $runs -o $results $kernel || exit 1
+    done
+done
+
+echo
+awk -F, 'FNR == 1 { printf "%-24s %-9s %12s %10s %14s %12s\n", "program", "engine", "instructions", "MIPS", "cycles/inst", "peak RSS KB"; next }
+         { printf "%-24s %-9s %12d %10.2f %14.2f %12d\n", $1, $2, $3, $8, $9, $10 }' $results
+echo "Results in $results"
+
+if [ -n "$base" ]; then
+    if [ ! -f $dir/$base.csv ]; then
+        echo "No results for $base in $dir" >&2
+        exit 1
+    fi
+    echo
+    awk -F, 'NR == FNR { if (FNR > 1) mips[$1 "," $2] = $8; next }
+             FNR == 1 { printf "%-24s %-9s %10s %10s %8s\n", "program", "engine", "base MIPS", "MIPS", "change"; next }
+             ($1 "," $2) in mips { printf "%-24s %-9s %10.2f %10.2f %+7.1f%%\n", $1, $2, mips[$1 "," $2], $8, 100 * ($8 / mips[$1 "," $2] - 1) }' \
+        $dir/$base.csv $results
+fi
@@ -0,0 +1,69 @@
+# Open-addressing hash table of 65536 slots with linear probing. Inserts
+# 40000 keys from xorshift64, then looks up those keys and 40000 that were
+# never inserted, eight times over.
+# Result: a0 = hits = 320000, a1 = sum of the values found = 0x17d75cf00
+
+_start:
+	li   s0, 0x1000000      # s0 = table, slots of key and value
+	li   s1, 0xffff         # s1 = slot mask
+	li   s2, 40000          # s2 = keys
+
+	li   t0, 88172645463325252
+	li   t1, 0              # t1 = value, the key's index
+insert:
+	jal  ra, next
+	jal  ra, probe
+	sd   t0, 0(t2)
+	sd   t1, 8(t2)
+	addi t1, t1, 1
+	bltu t1, s2, insert
+
+	li   a0, 0
+	li   a1, 0
+	li   s3, 8              # s3 = rounds left
+round:
+	li   t0, 88172645463325252
+	slli t1, s2, 1          # t1 = lookups left, inserted keys first
+lookup:
+	jal  ra, next
+	jal  ra, probe
+	ld   t3, 0(t2)
+	beqz t3, miss
+	addi a0, a0, 1
+	ld   t3, 8(t2)
+	add  a1, a1, t3
+miss:
+	addi t1, t1, -1
+	bnez t1, lookup
+	addi s3, s3, -1
+	bnez s3, round
+
+.word 0xfeedfeed
+
+# t0 = next xorshift64 value after t0
+next:
+	slli t3, t0, 13
+	xor  t0, t0, t3
+	srli t3, t0, 7
+	xor  t0, t0, t3
+	slli t3, t0, 17
+	xor  t0, t0, t3
+	ret
+
+# t2 = address of key t0's slot, or of the empty slot it would go in
+probe:
+	srli t3, t0, 32
+	xor  t3, t3, t0
+	srli t4, t3, 16
+	xor  t3, t3, t4
+1:
+	and  t3, t3, s1
+	slli t2, t3, 4
+	add  t2, t2, s0
+	ld   t4, 0(t2)
+	beq  t4, t0, 2f
+	beqz t4, 2f
+	addi t3, t3, 1
+	j    1b
+2:
+	ret
@@ -0,0 +1,139 @@
+# A stack-machine bytecode interpreter. The dispatch is a chain of compares,
+# as a switch compiles to without a jump table, so every bytecode costs a
+# run of mostly not-taken branches. The bytecode at 0x1000 runs a loop of
+# 20 bytecodes 59904 times.
+# Result: a0 = acc when the loop ends = 0x14ec00
+
+# Bytecodes; the operand, if any, is the next byte
+#   0 HALT            a0 = top of the stack
+#   1 PUSH n          push n, sign-extended
+#   2 ADD  3 SUB      pop b, pop a, push a + b or a - b
+#   4 DUP             push the top again
+#   5 XOR  6 AND      pop b, pop a, push a ^ b or a & b
+#   7 SHL1            top = top << 1
+#   8 LOAD v          push variable v
+#   9 STORE v         pop into variable v
+#  10 JNZ d           pop, and if it is not zero move the bytecode PC by d
+
+_start:
+	li   s1, 0x1000         # s1 = bytecode PC
+	li   s2, 0x200000       # s2 = top of the stack, which grows up
+	li   s3, 0x300000       # s3 = variables, a doubleword each
+dispatch:
+	lbu  t0, 0(s1)
+	addi s1, s1, 1
+	addi t1, t0, -8
+	beqz t1, op_load
+	addi t1, t0, -9
+	beqz t1, op_store
+	addi t1, t0, -1
+	beqz t1, op_push
+	addi t1, t0, -2
+	beqz t1, op_add
+	addi t1, t0, -3
+	beqz t1, op_sub
+	addi t1, t0, -4
+	beqz t1, op_dup
+	addi t1, t0, -5
+	beqz t1, op_xor
+	addi t1, t0, -6
+	beqz t1, op_and
+	addi t1, t0, -7
+	beqz t1, op_shl1
+	addi t1, t0, -10
+	beqz t1, op_jnz
+	ld   a0, -8(s2)         # HALT, or a bytecode the machine lacks
+
+.word 0xfeedfeed
+
+op_push:
+	lb   t2, 0(s1)
+	addi s1, s1, 1
+	sd   t2, 0(s2)
+	addi s2, s2, 8
+	j    dispatch
+op_add:
+	ld   t2, -16(s2)
+	ld   t3, -8(s2)
+	add  t2, t2, t3
+	sd   t2, -16(s2)
+	addi s2, s2, -8
+	j    dispatch
+op_sub:
+	ld   t2, -16(s2)
+	ld   t3, -8(s2)
+	sub  t2, t2, t3
+	sd   t2, -16(s2)
+	addi s2, s2, -8
+	j    dispatch
+op_dup:
+	ld   t2, -8(s2)
+	sd   t2, 0(s2)
+	addi s2, s2, 8
+	j    dispatch
+op_xor:
+	ld   t2, -16(s2)
+	ld   t3, -8(s2)
+	xor  t2, t2, t3
+	sd   t2, -16(s2)
+	addi s2, s2, -8
+	j    dispatch
+op_and:
+	ld   t2, -16(s2)
+	ld   t3, -8(s2)
+	and  t2, t2, t3
+	sd   t2, -16(s2)
+	addi s2, s2, -8
+	j    dispatch
+op_shl1:
+	ld   t2, -8(s2)
+	slli t2, t2, 1
+	sd   t2, -8(s2)
+	j    dispatch
+op_load:
+	lbu  t2, 0(s1)
+	addi s1, s1, 1
+	slli t2, t2, 3
+	add  t2, t2, s3
+	ld   t3, 0(t2)
+	sd   t3, 0(s2)
+	addi s2, s2, 8
+	j    dispatch
+op_store:
+	lbu  t2, 0(s1)
+	addi s1, s1, 1
+	slli t2, t2, 3
+	add  t2, t2, s3
+	addi s2, s2, -8
+	ld   t3, 0(s2)
+	sd   t3, 0(t2)
+	j    dispatch
+op_jnz:
+	lb   t2, 0(s1)
+	addi s1, s1, 1
+	addi s2, s2, -8
+	ld   t3, 0(s2)
+	beqz t3, dispatch
+	add  s1, s1, t2
+	j    dispatch
+
+# i = 117 << 9, acc = 0, b = 1
+# do {
+#     acc = (acc ^ i) + b
+#     b = ((b << 1) & i) + 1
+#     i = i - 1
+# } while (i != 0)
+# halt with acc
+.org 0x1000
+	.byte 1, 117                    #  0: PUSH 117
+	.byte 7, 7, 7, 7, 7, 7, 7, 7, 7 #  2: SHL1 x 9
+	.byte 9, 0                      # 11: STORE i
+	.byte 1, 0, 9, 1                # 13: PUSH 0, STORE acc
+	.byte 1, 1, 9, 2                # 17: PUSH 1, STORE b
+	.byte 8, 1, 8, 0, 5             # 21: LOAD acc, LOAD i, XOR
+	.byte 8, 2, 2, 9, 1             # 26: LOAD b, ADD, STORE acc
+	.byte 8, 2, 7, 8, 0, 6          # 31: LOAD b, SHL1, LOAD i, AND
+	.byte 1, 1, 2, 9, 2             # 37: PUSH 1, ADD, STORE b
+	.byte 8, 0, 1, 1, 3, 4, 9, 0    # 42: LOAD i, PUSH 1, SUB, DUP, STORE i
+	.byte 10, 225                   # 50: JNZ -31, back to 21
+	.byte 8, 1, 0                   # 52: LOAD acc, HALT
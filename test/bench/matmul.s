@@ -0,0 +1,88 @@
+# Multiplies two 64x64 matrices of doublewords, three times over. RV64I has no multiply, so
+# each product goes through a shift-and-add subroutine, as compiled code
+# calls __muldi3.
+# Result: a0 = sum of the elements of the product = 0x690000
+
+_start:
+	li   s0, 0x100000       # s0 = A
+	li   s1, 0x110000       # s1 = B
+	li   s2, 0x120000       # s2 = C
+	li   s3, 4096           # elements per matrix
+
+	li   t0, 0              # A[k] = k & 15, B[k] = (k >> 3) & 7
+init:
+	slli t1, t0, 3
+	andi t2, t0, 15
+	add  t3, s0, t1
+	sd   t2, 0(t3)
+	srli t2, t0, 3
+	andi t2, t2, 7
+	add  t3, s1, t1
+	sd   t2, 0(t3)
+	addi t0, t0, 1
+	bltu t0, s3, init
+
+	li   s8, 3              # s8 = products left
+product:
+	li   s4, 0              # s4 = i
+rows:
+	li   s5, 0              # s5 = j
+cols:
+	li   s7, 0              # s7 = sum
+	li   s6, 0              # s6 = k
+dot:
+	slli t0, s4, 9          # A[i][k]
+	slli t1, s6, 3
+	add  t0, t0, t1
+	add  t0, t0, s0
+	ld   a1, 0(t0)
+	slli t0, s6, 9          # B[k][j]
+	slli t1, s5, 3
+	add  t0, t0, t1
+	add  t0, t0, s1
+	ld   a2, 0(t0)
+	jal  ra, mul
+	add  s7, s7, a0
+	addi s6, s6, 1
+	li   t0, 64
+	bltu s6, t0, dot
+
+	slli t0, s4, 9          # C[i][j] = sum
+	slli t1, s5, 3
+	add  t0, t0, t1
+	add  t0, t0, s2
+	sd   s7, 0(t0)
+	addi s5, s5, 1
+	li   t0, 64
+	bltu s5, t0, cols
+	addi s4, s4, 1
+	bltu s4, t0, rows
+	addi s8, s8, -1
+	bnez s8, product
+
+	li   a0, 0              # a0 = sum of C
+	mv   t0, s2
+	slli t1, s3, 3
+	add  t1, t1, s2
+total:
+	ld   t2, 0(t0)
+	add  a0, a0, t2
+	addi t0, t0, 8
+	bltu t0, t1, total
+
+.word 0xfeedfeed
+
+# a0 = a1 * a2
+mul:
+	li   a0, 0
+	beqz a2, 2f
+1:
+	andi t6, a2, 1
+	beqz t6, 3f
+	add  a0, a0, a1
+3:
+	slli a1, a1, 1
+	srli a2, a2, 1
+	bnez a2, 1b
+2:
+	ret
@@ -0,0 +1,41 @@
+# Copies a 256 KB buffer 200 times, four doublewords per trip around the
+# loop. The buffers span more pages than the TLB covers.
+# Result: a0 = last doubleword copied = 0x0123456789af4de8
+
+_start:
+	li   s0, 0x100000       # s0 = source
+	li   s1, 0x200000       # s1 = destination
+	li   s2, 0x40000        # s2 = bytes per copy
+
+	mv   t0, s0             # fill the source with a pattern
+	add  t1, s0, s2
+	li   t2, 0x0123456789abcdef
+fill:
+	sd   t2, 0(t0)
+	addi t2, t2, 7
+	addi t0, t0, 8
+	bltu t0, t1, fill
+
+	li   s3, 200            # s3 = copies left
+copy:
+	mv   t0, s0
+	mv   t1, s1
+	add  t2, s0, s2
+inner:
+	ld   t3, 0(t0)
+	ld   t4, 8(t0)
+	ld   t5, 16(t0)
+	ld   t6, 24(t0)
+	sd   t3, 0(t1)
+	sd   t4, 8(t1)
+	sd   t5, 16(t1)
+	sd   t6, 24(t1)
+	addi t0, t0, 32
+	addi t1, t1, 32
+	bltu t0, t2, inner
+	addi s3, s3, -1
+	bnez s3, copy
+
+	ld   a0, -8(t1)
+
+.word 0xfeedfeed
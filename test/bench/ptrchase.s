@@ -0,0 +1,40 @@
+# Follows a linked list through 65536 nodes 64 bytes apart, 4 MB in all,
+# in the order of a full-period LCG, so nearly every step lands on another
+# page. The next pointer of node i leads to node (17477 * i + 12345) mod
+# 65536.
+# Result: a0 = address of the node reached after 6000000 steps = 0x12fa000
+
+_start:
+	li   s0, 0x1000000      # s0 = node 0
+	li   s1, 65536          # s1 = nodes
+
+	li   t0, 0              # t0 = i
+link:
+	slli t1, t0, 2          # t1 = 17477 * i, 17477 = 1 + 4 + 64 + 1024 + 16384
+	add  t1, t1, t0
+	slli t2, t0, 6
+	add  t1, t1, t2
+	slli t2, t0, 10
+	add  t1, t1, t2
+	slli t2, t0, 14
+	add  t1, t1, t2
+	li   t2, 12345
+	add  t1, t1, t2
+	addi t2, s1, -1
+	and  t1, t1, t2         # t1 = next node
+	slli t1, t1, 6
+	add  t1, t1, s0
+	slli t2, t0, 6
+	add  t2, t2, s0
+	sd   t1, 0(t2)
+	addi t0, t0, 1
+	bltu t0, s1, link
+
+	mv   a0, s0
+	li   t0, 6000000
+chase:
+	ld   a0, 0(a0)
+	addi t0, t0, -1
+	bnez t0, chase
+
+.word 0xfeedfeed
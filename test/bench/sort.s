@@ -0,0 +1,53 @@
+# Insertion sort of 3500 pseudo-random doublewords from xorshift64, then a
+# pass counting the pairs still out of order.
+# Result: a0 = smallest element = 0xd9f77f77fd047, a1 = 0 pairs out of order
+
+_start:
+	li   s0, 0x100000       # s0 = &a[0]
+	li   s1, 3500           # s1 = n
+	slli s2, s1, 3
+	add  s2, s2, s0         # s2 = &a[n]
+
+	li   t0, 88172645463325252
+	mv   t1, s0
+fill:
+	slli t3, t0, 13         # xorshift64
+	xor  t0, t0, t3
+	srli t3, t0, 7
+	xor  t0, t0, t3
+	slli t3, t0, 17
+	xor  t0, t0, t3
+	sd   t0, 0(t1)
+	addi t1, t1, 8
+	bltu t1, s2, fill
+
+	addi t1, s0, 8          # t1 = &a[i]
+outer:
+	bgeu t1, s2, check
+	ld   t3, 0(t1)          # t3 = key
+	mv   t4, t1             # t4 = where the key goes
+inner:
+	beq  t4, s0, place
+	ld   t5, -8(t4)
+	bgeu t3, t5, place
+	sd   t5, 0(t4)          # move the larger element up
+	addi t4, t4, -8
+	j    inner
+place:
+	sd   t3, 0(t4)
+	addi t1, t1, 8
+	j    outer
+
+check:
+	li   a1, 0
+	addi t1, s0, 8
+pairs:
+	ld   t3, -8(t1)
+	ld   t4, 0(t1)
+	sltu t5, t4, t3
+	add  a1, a1, t5
+	addi t1, t1, 8
+	bltu t1, s2, pairs
+	ld   a0, 0(s0)
+
+.word 0xfeedfeed
@@ -0,0 +1,20 @@
+# Ten rounds of exactly 65536 instructions that differ only in a counter
+# in memory, so at every check of the loop detector the PC and registers
+# are the same. Only the store to the counter tells the rounds apart.
+_start:
+	li   t1, 10          # t1 = rounds
+	li   s2, 32764       # s2 = spins per round
+round:
+	lw   t0, 0x1f0(zero) # t0 = rounds done
+	addi t0, t0, 1
+	sw   t0, 0x1f0(zero)
+	beq  t0, t1, done
+	li   t0, 0           # same registers every round
+	mv   t2, s2
+	nop
+spin:
+	addi t2, t2, -1
+	bnez t2, spin
+	j    round           # 8 + 2 * 32764 = 65536 instructions a round
+done:
+	.word 0xfeedfeed
@@ -0,0 +1,42 @@
+_start:
+	lui  s1, 0x12345    # s1 = 0x12345678, lui+addi
+	addi s1, s1, 0x678
+	lui  s2, 0x80000    # s2 = sign-extended 0x7fffffff, lui+addiw
+	addiw s2, s2, -1
+	lui  t0, 0          # t0 = &array[0], lui+addi
+	addi t0, t0, 200
+	li   t1, 10         # t1 = count
+	li   t2, 0          # t2 = index
+
+fill:
+	slli t3, t2, 3      # t3 = index * 8, slli+add
+	add  t3, t3, t0     # t3 = &array[index]
+	sd   t2, 0(t3)      # array[index] = index
+	addi t2, t2, 1      # index++, addi+bne
+	bne  t2, t1, fill
+
+	li   a0, 0          # a0 = sum
+	li   t2, 0
+sum:
+	slli t3, t2, 3
+	add  t3, t0, t3     # add reading the slli result as rs2
+	ld   t4, 0(t3)
+	add  a0, a0, t4
+	addi t1, t1, -1     # t1--, addi+bgtz
+	bgtz t1, sum_next
+	j    done
+sum_next:
+	addi t2, t2, 1
+	j    sum
+
+done:
+	auipc ra, 0         # call double, auipc+jalr
+	jalr ra, 16(ra)
+	sd   a0, 184(zero)  # result after the call
+	.word 0xfeedfeed
+
+double:
+	add  a0, a0, a0
+	sd   s1, 168(zero)
+	sd   s2, 176(zero)
+	ret
@@ -0,0 +1,22 @@
+# Touches memory far outside the first 64 KB: a store to the top of a
+# stack-like region, a doubleword that straddles two pages and a load
+# from a page that was never written, then copies the results down low
+
+_start:
+	li   t0, 0x7ffffff000   # t0 = page boundary high in the address space
+	li   t1, 0x1122334455667788
+	sd   t1, -8(t0)         # last doubleword below the boundary
+	sd   t1, -4(t0)         # straddles the boundary
+	ld   t2, -8(t0)         # t2 = 0x5566778855667788
+	ld   t3, -4(t0)         # t3 = 0x1122334455667788
+	lwu  t4, 0(t0)          # t4 = 0x11223344, upper half of the straddle
+	li   t5, 0x40000000000
+	ld   t6, 0(t5)          # t6 = 0, page never written
+
+	li   s0, 200
+	sd   t2, 0(s0)
+	sd   t3, 8(s0)
+	sd   t4, 16(s0)
+	sd   t6, 24(s0)
+
+.word 0xfeedfeed
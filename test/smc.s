@@ -0,0 +1,24 @@
+_start:
+	li   a0, 0          # a0 = sum
+	li   s0, 0          # s0 = iteration
+	li   s1, 200        # s1 = iterations
+	li   s2, 100        # s2 = iteration that patches target
+loop:
+	call target
+	addi s0, s0, 1
+	bne  s0, s2, next
+	lw   t0, 0x88(zero) # target's addi becomes replacement's
+	sw   t0, 0x80(zero)
+next:
+	bne  s0, s1, loop
+	sd   a0, 400(zero)  # 100 * 1 + 100 * 100
+	.word 0xfeedfeed
+
+	.org 0x80
+target:
+	addi a0, a0, 1
+	ret
+
+	.org 0x88
+replacement:
+	addi a0, a0, 100
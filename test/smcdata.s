@@ -0,0 +1,54 @@
+# Stores to data on the code page go through the write TLB's code map,
+# only the two that reach an instruction patch target
+_start:
+	li   a0, 0          # a0 = sum
+	li   s0, 0          # s0 = iteration
+	li   s1, 300        # s1 = iterations
+	lw   t2, 0x100(zero) # target's jump, put back on iteration 200
+	lwu  t4, 0xfc(zero)
+	lhu  t5, 0x104(zero)
+	lwu  t6, 0x108(zero)
+	slli t6, t6, 16
+	srli t3, t4, 16
+	or   t6, t6, t3
+	slli t3, t5, 48
+	or   t6, t6, t3     # doubleword for 0xfe: replacement's jump in its middle
+	li   s4, 0x3fe      # 0x300 ^ 0xfe
+	li   s5, 0x200      # 0x300 ^ 0x100
+loop:
+	sw   s0, 0x200(zero)
+	jal  target
+	addi s0, s0, 1
+	addi t3, s0, -100
+	seqz t3, t3
+	neg  t3, t3
+	and  t3, t3, s4
+	xori a5, t3, 0x300  # 0xfe on iteration 100, else 0x300
+	sd   t6, 0(a5)      # covers the unmarked words around target's
+	addi t3, s0, -200
+	seqz t3, t3
+	neg  t3, t3
+	and  t3, t3, s5
+	xori a6, t3, 0x300  # 0x100 on iteration 200, else 0x300
+	sw   t2, 0(a6)
+	bne  s0, s1, loop
+	sd   a0, 400(zero)  # 100 * 1 + 100 * 100 + 100 * 1
+	.word 0xfeedfeed
+
+	.org 0xfc
+	nop
+target:
+	j    one
+	nop
+replacement:
+	.word 0x0200006f    # j .+0x20, which from target is hundred
+
+	.org 0x110
+one:
+	addi a0, a0, 1
+	ret
+
+	.org 0x120
+hundred:
+	addi a0, a0, 100
+	ret
@@ -0,0 +1,27 @@
+_start:
+	li   a0, 0          # a0 = sum
+	li   s0, 0          # s0 = iteration
+	li   s1, 300        # s1 = iterations
+	li   s2, 100        # s2 = iteration that patches target the first time
+	li   s3, 200        # s3 = iteration that patches it back
+	lw   t1, 0x88(zero) # replacement's addi
+	lw   t2, 0x80(zero) # target's addi
+loop:
+	jal  target         # a direct call, unlike smc.s
+	addi s0, s0, 1
+	bne  s0, s2, 1f
+	sw   t1, 0x80(zero)
+1:	bne  s0, s3, 2f
+	sw   t2, 0x80(zero)
+2:	bne  s0, s1, loop
+	sd   a0, 400(zero)  # 100 * 1 + 100 * 100 + 100 * 1
+	.word 0xfeedfeed
+
+	.org 0x80
+target:
+	addi a0, a0, 1
+	ret
+
+	.org 0x88
+replacement:
+	addi a0, a0, 100